@@ -0,0 +1,262 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* transcodes a frame sequence in cooperation with other workers, on this node
+   or others, through a work queue on a shared directory */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+#include "transcode.h"
+#include "work_queue.h"
+
+#include "cxxopts.hpp"
+
+static void
+print_kdu_message(void *user_data, int is_error, const char *message)
+{
+    std::cerr << (is_error ? "KDU error: " : "KDU warning: ") << message << std::endl;
+}
+
+/* expands the frame number of `pattern`: printf-style %d or %04d, or a run of
+   # padded to its length, e.g. shot.####.exr */
+
+static bool
+frame_path(const std::string &pattern, int frame, std::string &path)
+{
+    size_t at = pattern.find('%');
+    size_t end;
+    int width = 0;
+
+    if (at != std::string::npos)
+    {
+        end = at + 1;
+        while (end < pattern.size() && isdigit((unsigned char)pattern[end]))
+            width = width * 10 + (pattern[end++] - '0');
+        if (end >= pattern.size() || pattern[end] != 'd')
+            return false;
+        end++;
+    }
+    else
+    {
+        at = pattern.find('#');
+        if (at == std::string::npos)
+            return false;
+        end = pattern.find_first_not_of('#', at);
+        if (end == std::string::npos)
+            end = pattern.size();
+        width = (int)(end - at);
+    }
+
+    std::string number = std::to_string(std::abs(frame));
+    if ((int)number.size() < width)
+        number.insert(0, width - number.size(), '0');
+    if (frame < 0)
+        number.insert(0, 1, '-');
+
+    path = pattern.substr(0, at) + number + pattern.substr(end);
+    return true;
+}
+
+/* transcodes a frame to a temporary file, renamed once verified so that the
+   output never holds a partial frame; the frame is discarded if the lease was
+   taken over meanwhile */
+
+static bool
+transcode_frame(
+    exrkdu_session_t session,
+    const std::string &src_fn,
+    const std::string &enc_fn,
+    const transcode_options &options,
+    const std::string &worker_id,
+    work_lease &lease,
+    std::string &error)
+{
+    std::string tmp_fn = enc_fn + "." + worker_id + ".tmp";
+
+    try
+    {
+        transcode(session, src_fn, tmp_fn, options);
+    }
+    catch (const std::exception &e)
+    {
+        remove(tmp_fn.c_str());
+        error = src_fn + ": " + e.what();
+        return false;
+    }
+
+    if (!lease.confirm())
+    {
+        remove(tmp_fn.c_str());
+        return false;
+    }
+
+    if (rename(tmp_fn.c_str(), enc_fn.c_str()) != 0)
+    {
+        remove(tmp_fn.c_str());
+        error = enc_fn + ": cannot rename the transcoded frame";
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    cxxopts::Options options(
+        "exrkdu_batch", "Transcodes a frame sequence with other workers sharing a queue directory");
+
+    options.add_options()(
+        "queue", "Queue directory, shared by the workers", cxxopts::value<std::string>())(
+        "input", "Input frames, e.g. shot.%04d.exr or shot.####.exr", cxxopts::value<std::string>())(
+        "output", "Output frames, e.g. out/shot.%04d.exr", cxxopts::value<std::string>())(
+        "frames", "Frame range, e.g. 1001-1200", cxxopts::value<std::string>())(
+        "range", "Number of frames claimed at once", cxxopts::value<int>()->default_value("10"))(
+        "lease", "Seconds after which the frames of an unresponsive worker are taken over", cxxopts::value<int>()->default_value("60"))(
+        "worker-id", "Name of this worker in the queue, by default <host>.<pid>", cxxopts::value<std::string>())(
+        "cores", "Number of cores to use, 0 for all available to the process", cxxopts::value<int>()->default_value("0"))(
+        "t,threads", "Number of KDU threads per chunk, 0 to let the scheduler decide", cxxopts::value<int>()->default_value("0"))(
+        "write-buffer", "Coalesce the output writes in buffers of this many MiB, 0 to write each chunk", cxxopts::value<int>()->default_value(DEFAULT_WRITE_BUFFER_MIB))(
+        "passthrough", "Copy the chunks of parts already compressed with HTJ2K unchanged", cxxopts::value<bool>()->default_value("false"))(
+        "cache-dir", "Directory of compressed chunks reused across frames", cxxopts::value<std::string>())(
+        "no-verify", "Do not verify the transcoded frames")(
+        "h,help", "Print usage");
+
+    auto args = options.parse(argc, argv);
+
+    int first, last;
+    if (args.count("help") || !args.count("queue") || !args.count("input") || !args.count("output") ||
+        !args.count("frames") || sscanf(args["frames"].as<std::string>().c_str(), "%d-%d", &first, &last) != 2 ||
+        first > last)
+    {
+        std::cout << options.help() << std::endl;
+        exit(args.count("help") ? 0 : -1);
+    }
+
+    auto &src_pattern = args["input"].as<std::string>();
+    auto &enc_pattern = args["output"].as<std::string>();
+
+    std::string unused;
+    if (!frame_path(src_pattern, first, unused) || !frame_path(enc_pattern, first, unused))
+    {
+        std::cout << "The input and output must contain a frame number, e.g. %04d or ####" << std::endl;
+        exit(-1);
+    }
+
+    std::string worker_id;
+    if (args.count("worker-id"))
+        worker_id = args["worker-id"].as<std::string>();
+    else
+    {
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        worker_id = std::string(host) + "." + std::to_string(getpid());
+    }
+
+    /* codec session */
+
+    exrkdu_config_t config;
+    exrkdu_config_init(&config);
+    config.fused_decode = 1;
+    config.fused_encode = 1;
+    config.message_fn = print_kdu_message;
+
+    exrkdu_session_t session;
+    if (exrkdu_session_create(&session, &config) != EXR_ERR_SUCCESS)
+    {
+        std::cout << "Cannot create the codec session" << std::endl;
+        exit(-1);
+    }
+
+    transcode_options transcode_opts = {};
+    transcode_opts.cores = args["cores"].as<int>();
+    transcode_opts.kdu_threads = args["threads"].as<int>();
+    transcode_opts.verify = !args.count("no-verify");
+    transcode_opts.write_buffer = (size_t)std::max(args["write-buffer"].as<int>(), 0) << 20;
+    transcode_opts.passthrough = args["passthrough"].as<bool>();
+    if (args.count("cache-dir"))
+        transcode_opts.cache_dir = args["cache-dir"].as<std::string>();
+
+    /* claim frame ranges until all are done or failed */
+
+    std::vector<work_unit> units = split_frames(first, last, args["range"].as<int>());
+    std::vector<std::string> failures;
+    int done = 0;
+
+    try
+    {
+        work_queue queue(args["queue"].as<std::string>(), worker_id, args["lease"].as<int>());
+
+        while (std::unique_ptr<work_lease> lease = queue.claim(units))
+        {
+            const work_unit &unit = lease->unit();
+            std::cout << worker_id << ": frames " << unit.name() << std::endl;
+
+            std::string error;
+            bool ok = true;
+            for (int frame = unit.first; ok && frame <= unit.last && !lease->is_lost(); frame++)
+            {
+                std::string src_fn, enc_fn;
+                frame_path(src_pattern, frame, src_fn);
+                frame_path(enc_pattern, frame, enc_fn);
+
+                ok = transcode_frame(session, src_fn, enc_fn, transcode_opts, worker_id, *lease, error);
+            }
+
+            if (lease->is_lost())
+            {
+                std::cout << worker_id << ": lost the lease of frames " << unit.name() << std::endl;
+                continue;
+            }
+
+            lease->complete(ok, error);
+            done += ok ? unit.last - unit.first + 1 : 0;
+        }
+
+        queue.failed(units, failures);
+    }
+    catch (const std::exception &e)
+    {
+        failures.push_back(e.what());
+    }
+
+    exrkdu_session_destroy(session);
+
+    std::cout << worker_id << ": transcoded " << done << " frames" << std::endl;
+
+    for (const std::string &failure : failures)
+        std::cout << failure << std::endl;
+
+    return failures.empty() ? 0 : -1;
+}
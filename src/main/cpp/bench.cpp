@@ -0,0 +1,691 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Microbenchmark of kdu_compress/kdu_decompress on synthetic in-memory chunks,
+   without any file I/O */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "bench_gate.h"
+#include "kdu.h"
+#include "synth.h"
+#include "transcode.h"
+
+#include "cxxopts.hpp"
+
+struct scenario
+{
+    int width;
+    int height;
+    int channel_count;
+    exr_pixel_type_t type;
+    synth_content content;
+    int threads;
+    int tile_width;
+    bool adaptive_precision;
+};
+
+struct timing
+{
+    double median_ns;
+    double p99_ns;
+    double spread; /* median absolute deviation, relative to the median */
+};
+
+struct measurement
+{
+    timing enc;
+    timing dec;
+    uint64_t packed_bytes;
+    uint64_t compressed_bytes;
+    int64_t peak_rss_kb;
+};
+
+static const char *
+type_name(exr_pixel_type_t type)
+{
+    switch (type)
+    {
+    case EXR_PIXEL_UINT:
+        return "uint";
+    case EXR_PIXEL_HALF:
+        return "half";
+    default:
+        return "float";
+    }
+}
+
+static std::vector<int>
+parse_list(const std::string &s)
+{
+    std::vector<int> values;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.push_back(std::stoi(item));
+    return values;
+}
+
+static std::vector<exr_pixel_type_t>
+parse_types(const std::string &s)
+{
+    std::vector<exr_pixel_type_t> types;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (item == "half")
+            types.push_back(EXR_PIXEL_HALF);
+        else if (item == "float")
+            types.push_back(EXR_PIXEL_FLOAT);
+        else if (item == "uint")
+            types.push_back(EXR_PIXEL_UINT);
+        else
+            throw std::invalid_argument("Unknown pixel type: " + item);
+    }
+    return types;
+}
+
+/* synthetic content, in the OpenEXR packed layout */
+
+static void
+fill_chunk(const scenario &sc, const std::vector<std::string> &names, std::vector<uint8_t> &packed)
+{
+    int bpe = sc.type == EXR_PIXEL_HALF ? 2 : 4;
+    int line_stride = sc.width * sc.channel_count * bpe;
+
+    for (int c = 0; c < sc.channel_count; c++)
+    {
+        synth_channel channel = {names[c], sc.type, sc.content, 0.f};
+        synth_fill(
+            channel, 1, 0, c, 0, 0, sc.width, sc.height, packed.data() + c * sc.width * bpe, bpe, line_stride);
+    }
+}
+
+static const struct
+{
+    const char *name;
+    synth_content content;
+} content_names[] = {
+    {"gradient", SYNTH_GRADIENT},
+    {"grain", SYNTH_GRAIN},
+    {"alpha", SYNTH_SPARSE_ALPHA},
+    {"constant", SYNTH_CONSTANT},
+    {"id", SYNTH_ID_MATTE}};
+
+static const char *
+content_name(synth_content content)
+{
+    for (const auto &c : content_names)
+        if (c.content == content)
+            return c.name;
+    return "";
+}
+
+static std::vector<synth_content>
+parse_contents(const std::string &s)
+{
+    std::vector<synth_content> contents;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        size_t i = 0;
+        while (i < sizeof(content_names) / sizeof(content_names[0]) && item != content_names[i].name)
+            i++;
+        if (i == sizeof(content_names) / sizeof(content_names[0]))
+            throw std::invalid_argument("Unknown content: " + item);
+        contents.push_back(content_names[i].content);
+    }
+    return contents;
+}
+
+static timing
+summarize(std::vector<double> &samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    timing t;
+    t.median_ns = samples[samples.size() / 2];
+    t.p99_ns = samples[std::min(samples.size() - 1, (size_t)std::ceil(samples.size() * 0.99) - 1)];
+
+    std::vector<double> deviations;
+    for (double v : samples)
+        deviations.push_back(std::fabs(v - t.median_ns));
+    std::sort(deviations.begin(), deviations.end());
+    t.spread = deviations[deviations.size() / 2] / t.median_ns;
+
+    return t;
+}
+
+static const char *channel_names[] = {"R", "G", "B", "A"};
+
+static bool
+run_scenario(const scenario &sc, int warmup, int iterations, measurement &m)
+{
+    int bpe = sc.type == EXR_PIXEL_HALF ? 2 : 4;
+    size_t packed_bytes = (size_t)sc.width * sc.height * sc.channel_count * bpe;
+
+    std::vector<uint8_t> packed(packed_bytes);
+    std::vector<uint8_t> compressed(packed_bytes);
+    std::vector<uint8_t> unpacked(packed_bytes);
+
+    std::vector<std::string> names(sc.channel_count);
+    std::vector<exr_coding_channel_info_t> channels(sc.channel_count);
+    for (int c = 0; c < sc.channel_count; c++)
+    {
+        names[c] = c < 4 ? channel_names[c] : "AOV" + std::to_string(c);
+
+        exr_coding_channel_info_t &ch = channels[c];
+        memset(&ch, 0, sizeof(ch));
+        ch.channel_name = names[c].c_str();
+        ch.width = sc.width;
+        ch.height = sc.height;
+        ch.x_samples = 1;
+        ch.y_samples = 1;
+        ch.bytes_per_element = bpe;
+        ch.data_type = sc.type;
+        ch.user_bytes_per_element = bpe;
+        ch.user_data_type = sc.type;
+    }
+
+    fill_chunk(sc, names, packed);
+
+    exrkdu_config_t config;
+    exrkdu_config_init(&config);
+    config.num_threads = sc.threads;
+    config.tile_width = sc.tile_width;
+    config.adaptive_precision = sc.adaptive_precision;
+
+    exrkdu_session_t session;
+    if (exrkdu_session_create(&session, &config) != EXR_ERR_SUCCESS)
+        return false;
+
+    exr_encode_pipeline_t encode;
+    memset(&encode, 0, sizeof(encode));
+    encode.channels = channels.data();
+    encode.channel_count = sc.channel_count;
+    encode.chunk.width = sc.width;
+    encode.chunk.height = sc.height;
+    encode.packed_buffer = packed.data();
+    encode.packed_bytes = packed_bytes;
+    encode.compressed_buffer = compressed.data();
+    encode.compressed_alloc_size = compressed.size();
+
+    exr_decode_pipeline_t decode;
+    memset(&decode, 0, sizeof(decode));
+    decode.channels = channels.data();
+    decode.channel_count = sc.channel_count;
+    decode.chunk.width = sc.width;
+    decode.chunk.height = sc.height;
+    decode.chunk.unpacked_size = packed_bytes;
+    decode.packed_buffer = compressed.data();
+    decode.unpacked_buffer = unpacked.data();
+
+    bool ok = exrkdu_install_encoder(session, &encode) == EXR_ERR_SUCCESS &&
+              exrkdu_install_decoder(session, &decode) == EXR_ERR_SUCCESS;
+
+    std::vector<double> enc_ns, dec_ns;
+
+    for (int i = 0; ok && i < warmup + iterations; i++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        ok = encode.compress_fn(&encode) == EXR_ERR_SUCCESS;
+        auto t1 = std::chrono::steady_clock::now();
+
+        decode.chunk.packed_size = encode.compressed_bytes;
+
+        auto t2 = std::chrono::steady_clock::now();
+        ok = ok && decode.decompress_fn(&decode) == EXR_ERR_SUCCESS;
+        auto t3 = std::chrono::steady_clock::now();
+
+        if (i < warmup)
+            continue;
+
+        enc_ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+        dec_ns.push_back(std::chrono::duration<double, std::nano>(t3 - t2).count());
+    }
+
+    if (ok && memcmp(packed.data(), unpacked.data(), packed_bytes) != 0)
+    {
+        std::cout << "Decoded chunk does not match the source chunk" << std::endl;
+        ok = false;
+    }
+
+    exrkdu_uninstall_encoder(&encode);
+    exrkdu_uninstall_decoder(&decode);
+    exrkdu_session_destroy(session);
+
+    if (!ok || iterations == 0)
+        return ok;
+
+    m.enc = summarize(enc_ns);
+    m.dec = summarize(dec_ns);
+    m.packed_bytes = packed_bytes;
+    m.compressed_bytes = encode.compressed_bytes;
+    m.peak_rss_kb = 0;
+
+    return true;
+}
+
+/* end-to-end transcode of a synthetic image, with the hybrid scheduler */
+
+struct transcode_scenario
+{
+    std::string preset;
+    int width;
+    int height;
+    int cores;
+    int write_buffer_mib;
+    bool random_order;
+    int io_threads;
+};
+
+static bool
+run_transcode(const transcode_scenario &sc, const std::string &dir, int warmup, int iterations, measurement &m)
+{
+    std::string src_fn = dir + "/exrkdu_bench_" + sc.preset + ".exr";
+    std::string enc_fn = dir + "/exrkdu_bench_" + sc.preset + ".kdu.exr";
+
+    /* mixed workloads: several parts whose chunk counts and pixel types differ */
+    synth_image image;
+    image.seed = 1;
+    if (!synth_make_preset(
+            sc.preset, sc.width, sc.height, sc.preset == "mixed" ? 3 : 1, EXR_STORAGE_SCANLINE, 0,
+            EXR_COMPRESSION_ZIP, image) ||
+        synth_write(image, src_fn) != EXR_ERR_SUCCESS)
+    {
+        std::cout << "Cannot write " << src_fn << std::endl;
+        return false;
+    }
+
+    exrkdu_config_t config;
+    exrkdu_config_init(&config);
+    config.fused_decode = 1;
+    config.fused_encode = 1;
+
+    exrkdu_session_t session;
+    if (exrkdu_session_create(&session, &config) != EXR_ERR_SUCCESS)
+        return false;
+
+    transcode_options options = {sc.cores, 0, false, false, (size_t)sc.write_buffer_mib << 20};
+    options.random_order = sc.random_order;
+    options.io_threads = sc.io_threads;
+
+    std::vector<double> samples;
+    bool ok = true;
+
+    for (int i = 0; ok && i < warmup + iterations; i++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        try
+        {
+            m.packed_bytes = transcode(session, src_fn, enc_fn, options).baseband_bytes;
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << e.what() << std::endl;
+            ok = false;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        if (i >= warmup)
+            samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+    }
+
+    exrkdu_session_destroy(session);
+
+    if (ok)
+    {
+        std::ifstream enc(enc_fn, std::ios::binary | std::ios::ate);
+        m.compressed_bytes = enc ? (uint64_t)enc.tellg() : 0;
+        m.enc = summarize(samples);
+        m.dec = {0, 0, 0};
+        m.peak_rss_kb = 0;
+    }
+
+    remove(src_fn.c_str());
+    remove(enc_fn.c_str());
+
+    return ok;
+}
+
+#ifndef _WIN32
+
+/* runs the scenario in a child process, so that its peak RSS is not masked by
+   the scenarios that ran before it */
+
+static bool
+run_isolated(const std::function<bool(measurement &)> &run, measurement &m)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        bool ok = run(m);
+        ok = ok && write(fds[1], &m, sizeof(m)) == (ssize_t)sizeof(m);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool ok = read(fds[0], &m, sizeof(m)) == (ssize_t)sizeof(m);
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+#ifdef __APPLE__
+    m.peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+    m.peak_rss_kb = usage.ru_maxrss;
+#endif
+
+    return ok;
+}
+
+#endif
+
+static std::string
+scenario_id(const scenario &sc)
+{
+    return std::to_string(sc.width) + "x" + std::to_string(sc.height) + "x" + std::to_string(sc.channel_count) + "-" +
+           type_name(sc.type) + "-" + content_name(sc.content) + "-t" + std::to_string(sc.threads) +
+           (sc.tile_width ? "-tw" + std::to_string(sc.tile_width) : std::string()) +
+           (sc.adaptive_precision ? "-ap" : "");
+}
+
+static std::string
+transcode_id(const transcode_scenario &sc)
+{
+    return "transcode-" + sc.preset + "-" + std::to_string(sc.width) + "x" + std::to_string(sc.height) + "-c" +
+           std::to_string(sc.cores) + (sc.write_buffer_mib ? "-wb" + std::to_string(sc.write_buffer_mib) : "") +
+           (sc.random_order ? "-ry" : "") + (sc.io_threads ? "-io" + std::to_string(sc.io_threads) : "");
+}
+
+static void
+print_measurement(const scenario &sc, const measurement &m)
+{
+    printf(
+        "%6d %6d %4d %-5s %-8s %4d %5d | %8.3f %8.3f %9.1f | %8.3f %8.3f %9.1f | %6.3f %8lld\n",
+        sc.width,
+        sc.height,
+        sc.channel_count,
+        type_name(sc.type),
+        content_name(sc.content),
+        sc.threads,
+        sc.tile_width,
+        m.enc.median_ns / 1e6,
+        m.enc.p99_ns / 1e6,
+        m.packed_bytes / (m.enc.median_ns / 1e9) / 1e6,
+        m.dec.median_ns / 1e6,
+        m.dec.p99_ns / 1e6,
+        m.packed_bytes / (m.dec.median_ns / 1e9) / 1e6,
+        (double)m.compressed_bytes / m.packed_bytes,
+        (long long)m.peak_rss_kb);
+}
+
+int main(int argc, char *argv[])
+{
+    cxxopts::Options options(
+        "exrkdu_bench", "Benchmarks the KDU codec on synthetic in-memory chunks");
+
+    options.add_options()(
+        "widths", "Chunk widths", cxxopts::value<std::string>()->default_value("1920,4096"))(
+        "heights", "Chunk heights (scanlines per chunk)", cxxopts::value<std::string>()->default_value("16,256"))(
+        "channels", "Channel counts", cxxopts::value<std::string>()->default_value("3,4"))(
+        "types", "Pixel types (half, float, uint)", cxxopts::value<std::string>()->default_value("half,float"))(
+        "contents", "Synthetic contents (gradient, grain, alpha, constant, id)", cxxopts::value<std::string>()->default_value("grain"))(
+        "threads", "KDU thread counts", cxxopts::value<std::string>()->default_value("1"))(
+        "tile-widths", "Codestream tile widths, 0 for untiled", cxxopts::value<std::string>()->default_value("0"))(
+        "adaptive-precision", "Also run each scenario with adaptive precision")(
+        "warmup", "Untimed iterations per scenario", cxxopts::value<int>()->default_value("3"))(
+        "iterations", "Timed iterations per scenario", cxxopts::value<int>()->default_value("20"))(
+        "json", "Write the results to a JSON file, e.g. to refresh the baseline", cxxopts::value<std::string>())(
+        "baseline", "Compare the results against a JSON baseline and fail on regressions", cxxopts::value<std::string>())(
+        "tolerance", "Relative throughput loss always accepted", cxxopts::value<double>()->default_value("0.05"))(
+        "noise", "Multiple of the measured timing spread also accepted", cxxopts::value<double>()->default_value("3"))(
+        "bytes-tolerance", "Relative codestream growth accepted", cxxopts::value<double>()->default_value("0.002"))(
+        "rss-tolerance", "Relative peak RSS growth accepted", cxxopts::value<double>()->default_value("0.10"))(
+        "require-baseline", "Fail on scenarios missing from the baseline, e.g. in CI")(
+        "no-isolate", "Run all scenarios in this process, without peak RSS measurement")(
+        "transcode", "Synthetic presets to transcode end to end (beauty, aovs, ids, mixed)", cxxopts::value<std::string>()->default_value(""))(
+        "transcode-size", "Size of the transcoded images", cxxopts::value<std::string>()->default_value("3840x2160"))(
+        "cores", "Core counts given to the transcode scheduler, 0 for all available", cxxopts::value<std::string>()->default_value("0"))(
+        "write-buffers", "Output write buffers of the transcodes in MiB, 0 to write each chunk", cxxopts::value<std::string>()->default_value("0"))(
+        "random-order", "Also run each transcode with RANDOM_Y line order")(
+        "io-threads", "Output I/O threads of the transcodes, 0 to write chunks as they are coded", cxxopts::value<std::string>()->default_value("0"))(
+        "tmpdir", "Directory of the transcoded images", cxxopts::value<std::string>()->default_value("."))(
+        "h,help", "Print usage");
+
+    auto args = options.parse(argc, argv);
+
+    if (args.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    std::vector<int> widths = parse_list(args["widths"].as<std::string>());
+    std::vector<int> heights = parse_list(args["heights"].as<std::string>());
+    std::vector<int> channel_counts = parse_list(args["channels"].as<std::string>());
+    std::vector<exr_pixel_type_t> types = parse_types(args["types"].as<std::string>());
+    std::vector<synth_content> contents = parse_contents(args["contents"].as<std::string>());
+    std::vector<int> threads = parse_list(args["threads"].as<std::string>());
+    std::vector<int> tile_widths = parse_list(args["tile-widths"].as<std::string>());
+    int warmup = args["warmup"].as<int>();
+    int iterations = std::max(1, args["iterations"].as<int>());
+    bool isolate = !args.count("no-isolate");
+    std::vector<bool> adaptive_precisions = {false};
+    if (args.count("adaptive-precision"))
+        adaptive_precisions.push_back(true);
+
+    std::vector<bench_result> baseline;
+    if (args.count("baseline"))
+    {
+        std::string error;
+        if (!bench_read_json(args["baseline"].as<std::string>(), baseline, error))
+        {
+            std::cout << "Cannot read the baseline: " << error << std::endl;
+            exit(-1);
+        }
+
+        /* an empty baseline would pass any run */
+        if (baseline.empty())
+        {
+            std::cout << "The baseline holds no scenario, record it with --json first" << std::endl;
+            exit(-1);
+        }
+    }
+
+    printf(
+        "%6s %6s %4s %-5s %-8s %4s %5s | %8s %8s %9s | %8s %8s %9s | %6s %8s\n",
+        "width", "height", "chan", "type", "content", "thr", "tile",
+        "enc ms", "enc p99", "enc MB/s",
+        "dec ms", "dec p99", "dec MB/s",
+        "ratio", "RSS KB");
+
+    std::vector<bench_result> results;
+
+    bool ok = true;
+    std::vector<scenario> scenarios;
+    for (int width : widths)
+        for (int height : heights)
+            for (int channel_count : channel_counts)
+                for (exr_pixel_type_t type : types)
+                    for (synth_content content : contents)
+                        for (int thread_count : threads)
+                            for (int tile_width : tile_widths)
+                                for (bool adaptive_precision : adaptive_precisions)
+                                    scenarios.push_back(
+                                        {width, height, channel_count, type, content, thread_count, tile_width,
+                                         adaptive_precision});
+
+    for (const scenario &sc : scenarios)
+    {
+        measurement m;
+#ifndef _WIN32
+        auto run = [&](measurement &out) { return run_scenario(sc, warmup, iterations, out); };
+        bool sc_ok = isolate ? run_isolated(run, m) : run(m);
+#else
+        bool sc_ok = run_scenario(sc, warmup, iterations, m);
+#endif
+        if (!sc_ok)
+        {
+            ok = false;
+            continue;
+        }
+
+        print_measurement(sc, m);
+        results.push_back(
+            {scenario_id(sc),
+             m.packed_bytes / m.enc.median_ns * 1e3,
+             m.enc.spread,
+             m.packed_bytes / m.dec.median_ns * 1e3,
+             m.dec.spread,
+             m.compressed_bytes,
+             m.peak_rss_kb});
+    }
+
+    std::vector<std::string> presets;
+    {
+        std::stringstream ss(args["transcode"].as<std::string>());
+        std::string item;
+        while (std::getline(ss, item, ','))
+            if (!item.empty())
+                presets.push_back(item);
+    }
+
+    int transcode_width = 0, transcode_height = 0;
+    if (sscanf(args["transcode-size"].as<std::string>().c_str(), "%dx%d", &transcode_width, &transcode_height) != 2)
+        throw std::invalid_argument("Invalid transcode size: " + args["transcode-size"].as<std::string>());
+
+    std::vector<bool> random_orders = {false};
+    if (args.count("random-order"))
+        random_orders.push_back(true);
+
+    if (!presets.empty())
+        printf("\n%-40s | %8s %8s %9s | %6s %8s\n", "transcode", "ms", "p99", "MB/s", "ratio", "RSS KB");
+
+    for (const std::string &preset : presets)
+        for (int cores : parse_list(args["cores"].as<std::string>()))
+            for (int write_buffer : parse_list(args["write-buffers"].as<std::string>()))
+                for (bool random_order : random_orders)
+                    for (int io_threads : parse_list(args["io-threads"].as<std::string>()))
+                    {
+                        /* concurrent writes need the buffered output */
+                        if (io_threads > 0 && write_buffer == 0)
+                            continue;
+
+                        transcode_scenario sc = {
+                            preset, transcode_width, transcode_height, cores, write_buffer, random_order, io_threads};
+                        measurement m;
+                        auto run = [&](measurement &out) {
+                            return run_transcode(sc, args["tmpdir"].as<std::string>(), warmup, iterations, out);
+                        };
+#ifndef _WIN32
+                        bool sc_ok = isolate ? run_isolated(run, m) : run(m);
+#else
+                        bool sc_ok = run(m);
+#endif
+                        if (!sc_ok)
+                        {
+                            ok = false;
+                            continue;
+                        }
+
+                        double mbps = m.packed_bytes / m.enc.median_ns * 1e3;
+                        printf(
+                            "%-40s | %8.3f %8.3f %9.1f | %6.3f %8lld\n",
+                            transcode_id(sc).c_str(),
+                            m.enc.median_ns / 1e6,
+                            m.enc.p99_ns / 1e6,
+                            mbps,
+                            (double)m.compressed_bytes / m.packed_bytes,
+                            (long long)m.peak_rss_kb);
+                        results.push_back(
+                            {transcode_id(sc), mbps, m.enc.spread, 0, 0, m.compressed_bytes, m.peak_rss_kb});
+                    }
+
+    if (args.count("json") && !bench_write_json(args["json"].as<std::string>(), results))
+    {
+        std::cout << "Cannot write " << args["json"].as<std::string>() << std::endl;
+        ok = false;
+    }
+
+    if (args.count("baseline"))
+    {
+        bench_thresholds thresholds = {
+            args["tolerance"].as<double>(),
+            args["noise"].as<double>(),
+            args["bytes-tolerance"].as<double>(),
+            args["rss-tolerance"].as<double>(),
+            args.count("require-baseline") > 0};
+
+        printf("\n");
+        int regressions = bench_compare(baseline, results, thresholds);
+        if (regressions)
+        {
+            printf("\n%d regression(s) against %s\n", regressions, args["baseline"].as<std::string>().c_str());
+            ok = false;
+        }
+    }
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,297 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "bench_gate.h"
+
+bool
+bench_write_json(const std::string &path, const std::vector<bench_result> &results)
+{
+    std::string tmp_path = path + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\n  \"version\": 1,\n  \"scenarios\": [");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result &r = results[i];
+        fprintf(
+            f,
+            "%s\n    {\"id\": \"%s\", \"encode_mbps\": %.3f, \"encode_spread\": %.5f, "
+            "\"decode_mbps\": %.3f, \"decode_spread\": %.5f, \"compressed_bytes\": %llu, \"peak_rss_kb\": %lld}",
+            i ? "," : "",
+            r.id.c_str(),
+            r.encode_mbps,
+            r.encode_spread,
+            r.decode_mbps,
+            r.decode_spread,
+            (unsigned long long)r.compressed_bytes,
+            (long long)r.peak_rss_kb);
+    }
+    fprintf(f, "%s]\n}\n", results.empty() ? "" : "\n  ");
+
+    bool ok = fclose(f) == 0;
+    return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/* minimal reader for the files written above: an object holding an array of
+   flat objects with string and number members */
+
+namespace
+{
+
+class json_reader
+{
+public:
+    explicit json_reader(const std::string &text) : s(text), pos(0) {}
+
+    bool read(std::vector<bench_result> &results, std::string &error)
+    {
+        if (!expect('{'))
+            return fail(error);
+
+        while (true)
+        {
+            std::string key;
+            if (!read_string(key) || !expect(':'))
+                return fail(error);
+
+            if (key == "scenarios")
+            {
+                if (!read_scenarios(results))
+                    return fail(error);
+            }
+            else
+            {
+                double ignored;
+                if (!read_number(ignored))
+                    return fail(error);
+            }
+
+            if (peek() == ',')
+            {
+                pos++;
+                continue;
+            }
+            if (!expect('}'))
+                return fail(error);
+            return true;
+        }
+    }
+
+private:
+    const std::string &s;
+    size_t pos;
+
+    bool fail(std::string &error)
+    {
+        error = "malformed JSON at offset " + std::to_string(pos);
+        return false;
+    }
+
+    char peek()
+    {
+        while (pos < s.size() && isspace((unsigned char)s[pos]))
+            pos++;
+        return pos < s.size() ? s[pos] : '\0';
+    }
+
+    bool expect(char c)
+    {
+        if (peek() != c)
+            return false;
+        pos++;
+        return true;
+    }
+
+    bool read_string(std::string &out)
+    {
+        if (!expect('"'))
+            return false;
+        out.clear();
+        while (pos < s.size() && s[pos] != '"')
+        {
+            if (s[pos] == '\\' && pos + 1 < s.size())
+                pos++;
+            out += s[pos++];
+        }
+        return expect('"');
+    }
+
+    bool read_number(double &out)
+    {
+        peek();
+        const char *begin = s.c_str() + pos;
+        char *end;
+        out = strtod(begin, &end);
+        if (end == begin)
+            return false;
+        pos += end - begin;
+        return true;
+    }
+
+    bool read_scenarios(std::vector<bench_result> &results)
+    {
+        if (!expect('['))
+            return false;
+        if (expect(']'))
+            return true;
+
+        do
+        {
+            std::map<std::string, double> numbers;
+            bench_result r = {};
+
+            if (!expect('{'))
+                return false;
+            do
+            {
+                std::string key;
+                if (!read_string(key) || !expect(':'))
+                    return false;
+                if (key == "id")
+                {
+                    if (!read_string(r.id))
+                        return false;
+                }
+                else if (!read_number(numbers[key]))
+                {
+                    return false;
+                }
+            } while (expect(','));
+            if (!expect('}'))
+                return false;
+
+            r.encode_mbps = numbers["encode_mbps"];
+            r.encode_spread = numbers["encode_spread"];
+            r.decode_mbps = numbers["decode_mbps"];
+            r.decode_spread = numbers["decode_spread"];
+            r.compressed_bytes = (uint64_t)numbers["compressed_bytes"];
+            r.peak_rss_kb = (int64_t)numbers["peak_rss_kb"];
+            results.push_back(r);
+        } while (expect(','));
+
+        return expect(']');
+    }
+};
+
+} // namespace
+
+bool
+bench_read_json(const std::string &path, std::vector<bench_result> &results, std::string &error)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string text = ss.str();
+
+    return json_reader(text).read(results, error);
+}
+
+static void
+print_row(const char *id, const char *metric, double base, double cur, double delta, double limit, const char *status)
+{
+    printf("%-36s %-12s %12.1f %12.1f %+7.1f%% %6.1f%%  %s\n", id, metric, base, cur, delta * 100, limit * 100, status);
+}
+
+/* higher is better for throughput, lower is better for bytes and memory */
+
+static bool
+compare_metric(
+    const char *id, const char *metric, double base, double cur, bool higher_is_better, double limit)
+{
+    if (base <= 0 || cur <= 0)
+        return true;
+
+    double delta = cur / base - 1;
+    double loss = higher_is_better ? -delta : delta;
+
+    const char *status = loss > limit ? "REGRESSION" : (loss < -limit ? "improved" : "ok");
+    print_row(id, metric, base, cur, delta, limit, status);
+
+    return loss <= limit;
+}
+
+int
+bench_compare(
+    const std::vector<bench_result> &baseline,
+    const std::vector<bench_result> &current,
+    const bench_thresholds &thresholds)
+{
+    printf(
+        "%-36s %-12s %12s %12s %8s %7s  %s\n", "scenario", "metric", "baseline", "current", "delta", "limit", "status");
+
+    int regressions = 0;
+
+    for (const bench_result &cur : current)
+    {
+        auto base = std::find_if(
+            baseline.begin(), baseline.end(), [&](const bench_result &b) { return b.id == cur.id; });
+
+        if (base == baseline.end())
+        {
+            const char *status = thresholds.require_baseline ? "MISSING" : "new";
+            printf("%-36s %-12s %12s %12s %8s %7s  %s\n", cur.id.c_str(), "", "", "", "", "", status);
+            regressions += thresholds.require_baseline ? 1 : 0;
+            continue;
+        }
+
+        /* timing noise of either run widens the accepted band */
+        double enc_limit =
+            thresholds.tolerance + thresholds.noise_factor * std::max(base->encode_spread, cur.encode_spread);
+        double dec_limit =
+            thresholds.tolerance + thresholds.noise_factor * std::max(base->decode_spread, cur.decode_spread);
+
+        const char *id = cur.id.c_str();
+        regressions += !compare_metric(id, "encode MB/s", base->encode_mbps, cur.encode_mbps, true, enc_limit);
+        regressions += !compare_metric(id, "decode MB/s", base->decode_mbps, cur.decode_mbps, true, dec_limit);
+        regressions += !compare_metric(
+            id, "bytes", (double)base->compressed_bytes, (double)cur.compressed_bytes, false, thresholds.bytes_tolerance);
+        regressions += !compare_metric(
+            id, "peak RSS KB", (double)base->peak_rss_kb, (double)cur.peak_rss_kb, false, thresholds.rss_tolerance);
+    }
+
+    return regressions;
+}
@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BENCH_GATE_H
+#define BENCH_GATE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Benchmark results, stored as JSON baselines and compared against new runs */
+
+struct bench_result
+{
+    std::string id;
+    double encode_mbps;
+    double encode_spread; /* median absolute deviation, relative to the median */
+    double decode_mbps;
+    double decode_spread;
+    uint64_t compressed_bytes;
+    int64_t peak_rss_kb; /* 0 if not measured */
+};
+
+struct bench_thresholds
+{
+    double tolerance;       /* relative throughput loss always accepted */
+    double noise_factor;    /* multiple of the measured spread also accepted */
+    double bytes_tolerance; /* relative growth of the codestream */
+    double rss_tolerance;   /* relative growth of the peak RSS */
+    bool require_baseline;  /* scenarios missing from the baseline fail */
+};
+
+bool
+bench_write_json(const std::string &path, const std::vector<bench_result> &results);
+
+bool
+bench_read_json(const std::string &path, std::vector<bench_result> &results, std::string &error);
+
+/* prints a diff table and returns the number of regressions, counting the
+   scenarios missing from the baseline if `thresholds.require_baseline` */
+int
+bench_compare(
+    const std::vector<bench_result> &baseline,
+    const std::vector<bench_result> &current,
+    const bench_thresholds &thresholds);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "chunk_cache.h"
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+chunk_digest
+digest_bytes(const void *data, size_t size, chunk_digest seed)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h1 = seed.lo;
+    uint64_t h2 = seed.hi;
+
+    for (size_t i = 0; i < size / 16; i++, p += 16)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    size_t tail = size & 15;
+    uint64_t k1 = 0, k2 = 0;
+
+    for (size_t i = tail; i > 8; i--)
+        k2 ^= (uint64_t)p[i - 1] << ((i - 9) * 8);
+    if (tail > 8)
+    {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+
+    for (size_t i = std::min<size_t>(tail, 8); i > 0; i--)
+        k1 ^= (uint64_t)p[i - 1] << ((i - 1) * 8);
+    if (tail > 0)
+    {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    return {h1, h2};
+}
+
+std::string
+digest_to_hex(const chunk_digest &digest)
+{
+    char hex[33];
+    snprintf(
+        hex, sizeof(hex), "%016llx%016llx", (unsigned long long)digest.hi, (unsigned long long)digest.lo);
+    return hex;
+}
+
+bool
+digest_from_hex(const char *hex, chunk_digest &digest)
+{
+    uint64_t words[2] = {0, 0};
+
+    for (int i = 0; i < 32; i++)
+    {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return false;
+
+        words[i / 16] = (words[i / 16] << 4) | (uint64_t)v;
+    }
+
+    digest.hi = words[0];
+    digest.lo = words[1];
+    return true;
+}
+
+chunk_cache::chunk_cache(const std::string &dir) : dir(dir)
+{
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+}
+
+std::string
+chunk_cache::path(const chunk_digest &digest) const
+{
+    return this->dir + "/" + digest_to_hex(digest) + ".htj2k";
+}
+
+bool
+chunk_cache::get(const chunk_digest &digest, std::vector<uint8_t> &data) const
+{
+    std::ifstream f(this->path(digest), std::ios::binary | std::ios::ate);
+    if (!f)
+        return false;
+
+    std::streamoff size = f.tellg();
+    if (size <= 0)
+        return false;
+
+    data.resize((size_t)size);
+    f.seekg(0);
+    return (bool)f.read((char *)data.data(), size);
+}
+
+void
+chunk_cache::put(const chunk_digest &digest, const std::vector<uint8_t> &data) const
+{
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+
+    std::string path = this->path(digest);
+    std::string tmp_path = path + "." + std::to_string(rng()) + ".tmp";
+
+    bool ok;
+    {
+        std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+        ok = f && f.write((const char *)data.data(), (std::streamsize)data.size()) && f.flush();
+    }
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+        remove(tmp_path.c_str());
+}
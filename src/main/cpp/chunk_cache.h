@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* 128-bit digest of the baseband samples of a chunk */
+
+struct chunk_digest
+{
+    uint64_t lo;
+    uint64_t hi;
+
+    bool operator==(const chunk_digest &other) const { return this->lo == other.lo && this->hi == other.hi; }
+
+    bool operator<(const chunk_digest &other) const
+    {
+        return this->hi < other.hi || (this->hi == other.hi && this->lo < other.lo);
+    }
+};
+
+/* MurmurHash3 (x64, 128-bit) of `size` bytes, chained from `seed`, e.g. the
+   digest of the channel list of the part */
+chunk_digest
+digest_bytes(const void *data, size_t size, chunk_digest seed);
+
+/* 32 lowercase hexadecimal digits */
+std::string
+digest_to_hex(const chunk_digest &digest);
+
+bool
+digest_from_hex(const char *hex, chunk_digest &digest);
+
+/* Directory of compressed chunks named after the digest of their baseband
+   samples, shared across runs and processes: entries are written to a
+   temporary file and renamed. I/O errors only turn hits into misses. */
+class chunk_cache
+{
+public:
+    /* creates `dir` if it does not exist */
+    explicit chunk_cache(const std::string &dir);
+
+    bool get(const chunk_digest &digest, std::vector<uint8_t> &data) const;
+
+    void put(const chunk_digest &digest, const std::vector<uint8_t> &data) const;
+
+private:
+    std::string path(const chunk_digest &digest) const;
+
+    std::string dir;
+};
+
+#endif
@@ -0,0 +1,452 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+latency_histogram::latency_histogram() : count(0), errors(0), sum_ms(0), max_ms(0)
+{
+    std::fill(this->buckets, this->buckets + BUCKET_COUNT, 0);
+}
+
+void
+latency_histogram::add(double ms, bool ok)
+{
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && ms > (double)(1ull << bucket))
+        bucket++;
+
+    this->buckets[bucket]++;
+    this->count++;
+    this->errors += ok ? 0 : 1;
+    this->sum_ms += ms;
+    this->max_ms = std::max(this->max_ms, ms);
+}
+
+double
+latency_histogram::quantile(double q) const
+{
+    uint64_t rank = (uint64_t)std::ceil(q * this->count);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += this->buckets[i];
+        if (seen >= rank && seen > 0)
+            return std::min((double)(1ull << i), this->max_ms);
+    }
+
+    return this->max_ms;
+}
+
+std::string
+latency_histogram::format() const
+{
+    char fields[256];
+    snprintf(
+        fields,
+        sizeof(fields),
+        "count=%llu\terrors=%llu\tmean_ms=%.3f\tp50_ms=%.3f\tp90_ms=%.3f\tp99_ms=%.3f\tmax_ms=%.3f",
+        (unsigned long long)this->count,
+        (unsigned long long)this->errors,
+        this->count ? this->sum_ms / this->count : 0.0,
+        this->quantile(0.5),
+        this->quantile(0.9),
+        this->quantile(0.99),
+        this->max_ms);
+
+    std::string s = fields;
+    s += "\tbuckets=";
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        s += (i ? "," : "") + std::to_string(1ull << i) + ":" + std::to_string(this->buckets[i]);
+
+    return s;
+}
+
+static std::vector<std::string>
+split_fields(const std::string &line)
+{
+    std::vector<std::string> fields;
+    std::istringstream s(line);
+    std::string field;
+    while (std::getline(s, field, '\t'))
+        fields.push_back(field);
+    return fields;
+}
+
+static bool
+send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+transcode_daemon::transcode_daemon(exrkdu_session_t session, const daemon_options &options)
+    : session(session), options(options), stopping(false)
+{
+    int jobs = std::max(1, options.jobs);
+    int cores = options.cores > 0 ? options.cores : available_cores();
+
+    /* the cores are split between the job slots */
+    this->options.defaults.cores = std::max(1, cores / jobs);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        this->pools.emplace_back(new worker_pool(this->options.defaults.cores));
+        this->free_pools.push_back(this->pools.back().get());
+    }
+}
+
+transcode_daemon::~transcode_daemon()
+{
+    /* connection threads take the lock when they end */
+    std::map<int, std::thread> connections;
+    {
+        std::lock_guard<std::mutex> lock(this->connection_mutex);
+        connections.swap(this->connections);
+    }
+
+    for (auto &c : connections)
+    {
+        shutdown(c.first, SHUT_RDWR);
+        c.second.join();
+        close(c.first);
+    }
+}
+
+/* removes a socket left by a daemon that is no longer running, i.e. one that
+   refuses connections; any other file at the path, including the socket of a
+   running daemon, is left alone and reported */
+
+static bool
+remove_stale_socket(const sockaddr_un &addr, std::string &error)
+{
+    struct stat st;
+    if (lstat(addr.sun_path, &st) != 0)
+    {
+        if (errno == ENOENT)
+            return true;
+        error = std::string(addr.sun_path) + ": " + strerror(errno);
+        return false;
+    }
+
+    if (!S_ISSOCK(st.st_mode))
+    {
+        error = std::string(addr.sun_path) + ": exists and is not a socket";
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        error = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+    bool live = connect(fd, (const sockaddr *)&addr, sizeof(addr)) == 0;
+    int connect_error = errno;
+    close(fd);
+
+    if (live)
+    {
+        error = std::string(addr.sun_path) + ": another daemon is listening on this socket";
+        return false;
+    }
+    if (connect_error != ECONNREFUSED)
+    {
+        error = std::string(addr.sun_path) + ": " + strerror(connect_error);
+        return false;
+    }
+
+    if (unlink(addr.sun_path) != 0 && errno != ENOENT)
+    {
+        error = std::string(addr.sun_path) + ": " + strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+transcode_daemon::serve(std::string &error)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (this->options.socket_path.size() >= sizeof(addr.sun_path))
+    {
+        error = "Socket path too long: " + this->options.socket_path;
+        return false;
+    }
+    strcpy(addr.sun_path, this->options.socket_path.c_str());
+
+    if (!remove_stale_socket(addr, error))
+        return false;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        error = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0)
+    {
+        error = this->options.socket_path + ": " + strerror(errno);
+        close(listen_fd);
+        return false;
+    }
+
+    while (!this->stopping)
+    {
+        /* the timeout bounds the latency of stop() */
+        pollfd p = {listen_fd, POLLIN, 0};
+        int ready = poll(&p, 1, 200);
+
+        {
+            std::lock_guard<std::mutex> lock(this->connection_mutex);
+            for (int fd : this->finished_connections)
+            {
+                this->connections[fd].join();
+                this->connections.erase(fd);
+                close(fd);
+            }
+            this->finished_connections.clear();
+        }
+
+        if (ready <= 0)
+            continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        std::lock_guard<std::mutex> lock(this->connection_mutex);
+        this->connections[fd] = std::thread(&transcode_daemon::handle_connection, this, fd);
+    }
+
+    close(listen_fd);
+    unlink(addr.sun_path);
+
+    return true;
+}
+
+void
+transcode_daemon::handle_connection(int fd)
+{
+    std::string pending;
+    char buf[4096];
+
+    while (!this->stopping)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        pending.append(buf, (size_t)n);
+
+        size_t eol;
+        bool ok = true;
+        while (ok && (eol = pending.find('\n')) != std::string::npos)
+        {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (!line.empty())
+                ok = send_all(fd, this->handle_request(line));
+        }
+
+        if (!ok)
+            break;
+    }
+
+    std::lock_guard<std::mutex> lock(this->connection_mutex);
+    this->finished_connections.push_back(fd);
+}
+
+std::string
+transcode_daemon::handle_request(const std::string &line)
+{
+    std::vector<std::string> fields = split_fields(line);
+    const std::string &command = fields[0];
+
+    if (command == "STATS")
+        return this->format_stats();
+
+    if (command == "SHUTDOWN")
+    {
+        this->stop();
+        return "OK\n";
+    }
+
+    if (command != "TRANSCODE" && command != "VERIFY" && command != "PROXY" && command != "MIPMAP")
+        return "ERR\tUnknown command: " + command + "\n";
+
+    return this->run_job(command, fields);
+}
+
+std::string
+transcode_daemon::run_job(const std::string &command, const std::vector<std::string> &fields)
+{
+    if (fields.size() < 3)
+        return "ERR\tUsage: " + command + "\t<src>\t<dst>\n";
+
+    transcode_options job = this->options.defaults;
+    int levels = 1;
+    int tile_size = 64;
+    bool from_dwt = false;
+
+    for (size_t i = 3; i < fields.size(); i++)
+    {
+        size_t eq = fields[i].find('=');
+        std::string key = fields[i].substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : fields[i].substr(eq + 1);
+
+        if (key == "verify")
+            job.verify = value == "1";
+        else if (key == "passthrough")
+            job.passthrough = value == "1";
+        else if (key == "validate")
+            job.validate = value == "1";
+        else if (key == "random_order")
+            job.random_order = value == "1";
+        else if (key == "previous")
+            job.previous = value;
+        else if (key == "levels" && command == "PROXY")
+            levels = atoi(value.c_str());
+        else if (key == "tile_size" && command == "MIPMAP")
+            tile_size = atoi(value.c_str());
+        else if (key == "dwt" && command == "MIPMAP")
+            from_dwt = value == "1";
+        else
+            return "ERR\tUnknown option: " + key + "\n";
+    }
+
+    auto queued = std::chrono::steady_clock::now();
+
+    {
+        std::unique_lock<std::mutex> lock(this->slot_mutex);
+        this->slot_free.wait(lock, [this] { return !this->free_pools.empty(); });
+        job.pool = this->free_pools.back();
+        this->free_pools.pop_back();
+    }
+
+    auto started = std::chrono::steady_clock::now();
+
+    std::string reply;
+    try
+    {
+        if (command == "TRANSCODE")
+        {
+            transcode_stats stats = transcode(this->session, fields[1], fields[2], job);
+            reply = "reused=" + std::to_string(stats.reused_chunks) + "\tcached=" +
+                    std::to_string(stats.cached_chunks) + "\tcopied_bytes=" + std::to_string(stats.copied_bytes);
+        }
+        else if (command == "PROXY")
+        {
+            make_proxy(this->session, fields[1], fields[2], levels, job);
+        }
+        else if (command == "MIPMAP")
+        {
+            make_mipmap(this->session, fields[1], fields[2], tile_size, from_dwt, job);
+        }
+        else
+        {
+            verify(this->session, fields[1], fields[2], job);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        reply = std::string("ERR\t") + e.what();
+    }
+
+    auto done = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(this->slot_mutex);
+        this->free_pools.push_back(job.pool);
+    }
+    this->slot_free.notify_one();
+
+    double queue_ms = std::chrono::duration<double, std::milli>(started - queued).count();
+    double run_ms = std::chrono::duration<double, std::milli>(done - started).count();
+    bool ok = reply.compare(0, 3, "ERR") != 0;
+
+    {
+        std::lock_guard<std::mutex> lock(this->stats_mutex);
+        this->latencies[command].add(queue_ms + run_ms, ok);
+        this->queue_latency.add(queue_ms, true);
+    }
+
+    if (!ok)
+        return reply + "\n";
+
+    char times[64];
+    snprintf(times, sizeof(times), "OK\tms=%.3f\tqueue_ms=%.3f", run_ms, queue_ms);
+    return times + (reply.empty() ? "" : "\t" + reply) + "\n";
+}
+
+std::string
+transcode_daemon::format_stats()
+{
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    std::string s;
+    for (const auto &l : this->latencies)
+        s += l.first + "\t" + l.second.format() + "\n";
+    s += "QUEUE\t" + this->queue_latency.format() + "\n";
+
+    return s + "OK\n";
+}
@@ -0,0 +1,142 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scheduler.h"
+#include "transcode.h"
+
+/* Job latencies in power-of-two millisecond buckets, from 1 ms to ~17 min */
+
+class latency_histogram
+{
+public:
+    latency_histogram();
+
+    void add(double ms, bool ok);
+
+    /* count=, errors=, mean_ms=, p50_ms=, p90_ms=, p99_ms=, max_ms= and
+       buckets=<upper bound ms>:<count>,... fields, separated by tabs */
+    std::string format() const;
+
+private:
+    static const int BUCKET_COUNT = 22;
+
+    /* upper bound of the bucket holding the q-quantile */
+    double quantile(double q) const;
+
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t count;
+    uint64_t errors;
+    double sum_ms;
+    double max_ms;
+};
+
+struct daemon_options
+{
+    /* path of the Unix domain socket, replaced if it exists */
+    std::string socket_path;
+
+    /* jobs run concurrently; further jobs wait for a free slot */
+    int jobs;
+
+    /* cores shared by the job slots; 0 uses available_cores() */
+    int cores;
+
+    /* options of every job, which requests can override in part */
+    transcode_options defaults;
+};
+
+/* Serves transcode jobs over a Unix domain socket, with a codec session and
+   warm worker threads shared by all the jobs. Each request is a line of
+   tab-separated fields, answered by zero or more lines and a final line that
+   starts with OK or ERR:
+
+     TRANSCODE <src> <dst> [verify=0|1] [passthrough=0|1] [validate=0|1] [random_order=0|1] [previous=<path>]
+     VERIFY <src> <enc>
+     PROXY <src> <dst> [levels=<n>] [random_order=0|1]
+     MIPMAP <src> <dst> [tile_size=<n>] [verify=0|1] [random_order=0|1]
+     STATS
+     SHUTDOWN
+*/
+
+class transcode_daemon
+{
+public:
+    transcode_daemon(exrkdu_session_t session, const daemon_options &options);
+    ~transcode_daemon();
+
+    transcode_daemon(const transcode_daemon &) = delete;
+    transcode_daemon &operator=(const transcode_daemon &) = delete;
+
+    /* serves requests until stop() or SHUTDOWN; returns false, with the
+       error, if the socket cannot be created */
+    bool serve(std::string &error);
+
+    /* makes serve() return once the jobs in progress are done; may be called
+       from a signal handler */
+    void stop() { this->stopping = true; }
+
+private:
+    void handle_connection(int fd);
+    std::string handle_request(const std::string &line);
+    std::string run_job(const std::string &command, const std::vector<std::string> &fields);
+    std::string format_stats();
+
+    exrkdu_session_t session;
+    daemon_options options;
+    std::atomic<bool> stopping;
+
+    /* job slots, each with its own warm pool */
+    std::mutex slot_mutex;
+    std::condition_variable slot_free;
+    std::vector<std::unique_ptr<worker_pool>> pools;
+    std::vector<worker_pool *> free_pools;
+
+    std::mutex stats_mutex;
+    std::map<std::string, latency_histogram> latencies;
+    latency_histogram queue_latency;
+
+    std::mutex connection_mutex;
+    std::map<int, std::thread> connections;
+    std::vector<int> finished_connections;
+};
+
+#endif
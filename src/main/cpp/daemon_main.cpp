@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* serves transcode jobs over a Unix domain socket */
+
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+#include <string>
+
+#include "daemon.h"
+
+#include "cxxopts.hpp"
+
+static transcode_daemon *running_daemon = NULL;
+
+static void
+on_signal(int)
+{
+    if (running_daemon)
+        running_daemon->stop();
+}
+
+static void
+print_kdu_message(void *user_data, int is_error, const char *message)
+{
+    std::cerr << (is_error ? "KDU error: " : "KDU warning: ") << message << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    cxxopts::Options options(
+        "exrkdu_daemon", "Serves HTJ2K transcode jobs over a Unix domain socket");
+
+    options.add_options()(
+        "socket", "Socket path", cxxopts::value<std::string>()->default_value("/tmp/exrkdu.sock"))(
+        "jobs", "Number of jobs run concurrently", cxxopts::value<int>()->default_value("1"))(
+        "cores", "Number of cores shared by the jobs, 0 for all available to the process", cxxopts::value<int>()->default_value("0"))(
+        "t,threads", "Number of KDU threads per chunk, 0 to let the scheduler decide", cxxopts::value<int>()->default_value("0"))(
+        "channel-groups", "Code the channels of each layer as a separate group", cxxopts::value<bool>()->default_value("false"))(
+        "tile-width", "Split the codestream of each chunk in tiles of this width, 0 for no tiling", cxxopts::value<int>()->default_value("0"))(
+        "adaptive-precision", "Declare each component with the precision of its actual samples", cxxopts::value<bool>()->default_value("false"))(
+        "write-buffer", "Coalesce the output writes in buffers of this many MiB, 0 to write each chunk", cxxopts::value<int>()->default_value(DEFAULT_WRITE_BUFFER_MIB))(
+        "io-threads", "Code each part to memory first, then write it with this many threads, 0 to write chunks as they are coded", cxxopts::value<int>()->default_value("0"))(
+        "cache-dir", "Directory of compressed chunks reused across jobs", cxxopts::value<std::string>())(
+        "max-memory", "Limit the buffers alive at once, across jobs, to this many bytes, e.g. 8G", cxxopts::value<std::string>())(
+        "no-verify", "Do not verify the transcoded images by default")(
+        "h,help", "Print usage");
+
+    auto args = options.parse(argc, argv);
+
+    if (args.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    /* the session, and its KDU thread environments, lasts as long as the daemon */
+
+    exrkdu_config_t config;
+    exrkdu_config_init(&config);
+    config.fused_decode = 1;
+    config.fused_encode = 1;
+    config.message_fn = print_kdu_message;
+    config.channel_groups = args["channel-groups"].as<bool>();
+    config.tile_width = args["tile-width"].as<int>();
+    config.adaptive_precision = args["adaptive-precision"].as<bool>();
+
+    exrkdu_session_t session;
+    if (exrkdu_session_create(&session, &config) != EXR_ERR_SUCCESS)
+    {
+        std::cout << "Cannot create the codec session" << std::endl;
+        exit(-1);
+    }
+
+    uint64_t max_memory = 0;
+    if (args.count("max-memory") && !parse_byte_size(args["max-memory"].as<std::string>(), max_memory))
+    {
+        std::cout << options.help() << std::endl;
+        exit(-1);
+    }
+    memory_budget budget(max_memory);
+
+    daemon_options daemon_opts;
+    daemon_opts.socket_path = args["socket"].as<std::string>();
+    daemon_opts.jobs = args["jobs"].as<int>();
+    daemon_opts.cores = args["cores"].as<int>();
+    daemon_opts.defaults = {};
+    daemon_opts.defaults.kdu_threads = args["threads"].as<int>();
+    daemon_opts.defaults.verify = !args.count("no-verify");
+    daemon_opts.defaults.write_buffer = (size_t)std::max(args["write-buffer"].as<int>(), 0) << 20;
+    daemon_opts.defaults.io_threads = args["io-threads"].as<int>();
+    if (args.count("cache-dir"))
+        daemon_opts.defaults.cache_dir = args["cache-dir"].as<std::string>();
+    daemon_opts.defaults.budget = &budget;
+
+    std::string error;
+    bool ok;
+    {
+        transcode_daemon daemon(session, daemon_opts);
+
+        running_daemon = &daemon;
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+
+        std::cout << "Listening on " << daemon_opts.socket_path << std::endl;
+        ok = daemon.serve(error);
+
+        running_daemon = NULL;
+    }
+
+    exrkdu_session_destroy(session);
+
+    if (!ok)
+    {
+        std::cout << error << std::endl;
+        exit(-1);
+    }
+
+    return 0;
+}
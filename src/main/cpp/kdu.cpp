@@ -27,10 +27,25 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iterator>
 #include <limits>
+#include <list>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <fstream>
-#include <iostream>
+#include <thread>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "kdu.h"
@@ -44,9 +59,178 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "kdu_messaging.h"
 #include "kdu_sample_processing.h"
 #include "kdu_stripe_decompressor.h"
+#include "kdu_threads.h"
 
 using namespace kdu_supp;
 
+struct exrkdu_session
+{
+    exrkdu_session() { exrkdu_config_init(&this->config); }
+
+    exrkdu_config_t config;
+
+    /* idle KDU thread environments and their thread counts, kept warm across
+       chunks, most recently used first; environments beyond max_idle_threads
+       threads in total are destroyed, least recently used first */
+    std::mutex env_mutex;
+    std::list<std::pair<int, kdu_thread_env *>> idle_envs;
+    int idle_threads = 0;
+    int max_idle_threads = (int)std::max(2u, std::thread::hardware_concurrency());
+
+    /* per-chunk records, if config.collect_metrics is set */
+    std::mutex metrics_mutex;
+    std::vector<exrkdu_chunk_stats_t> metrics;
+};
+
+/* state attached to a pipeline by exrkdu_install_decoder/encoder */
+
+#define EXRKDU_BINDING_MAGIC 0x6b647562
+
+struct exrkdu_binding
+{
+    uint32_t magic;
+    exrkdu_session *session;
+    void *prev_user_data;
+    union
+    {
+        exr_result_t (*prev_decompress_fn)(exr_decode_pipeline_t *);
+        exr_result_t (*prev_compress_fn)(exr_encode_pipeline_t *);
+    };
+    union
+    {
+        exr_result_t (*prev_unpack_fn)(exr_decode_pipeline_t *);
+        exr_result_t (*prev_pack_fn)(exr_encode_pipeline_t *);
+    };
+
+    /* the current chunk was coded directly from/to the user buffers */
+    bool fused;
+
+    /* overrides config.num_threads if non-zero */
+    int num_threads;
+};
+
+static exrkdu_binding *
+get_binding(void *user_data)
+{
+    exrkdu_binding *binding = (exrkdu_binding *)user_data;
+
+    if (binding != NULL && binding->magic == EXRKDU_BINDING_MAGIC)
+        return binding;
+
+    return NULL;
+}
+
+static exrkdu_session *
+default_session()
+{
+    static exrkdu_session session;
+
+    return &session;
+}
+
+static exrkdu_session *
+get_session(void *user_data)
+{
+    exrkdu_binding *binding = get_binding(user_data);
+
+    return binding ? binding->session : default_session();
+}
+
+/* number of threads available to a call, including the calling thread */
+
+static int
+thread_count(const exrkdu_session *session, const exrkdu_binding *binding)
+{
+    if (binding && binding->num_threads > 0)
+        return binding->num_threads;
+
+    return session->config.num_threads;
+}
+
+static void
+destroy_env(kdu_thread_env *env)
+{
+    env->destroy();
+    delete env;
+}
+
+/* borrows a KDU thread environment from the session for the duration of a call */
+
+class session_env
+{
+public:
+    session_env(exrkdu_session *session, exrkdu_binding *binding)
+        : session(session), env(NULL), num_threads(thread_count(session, binding)), succeeded(false)
+    {
+        if (this->num_threads < 2)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(session->env_mutex);
+            for (auto it = session->idle_envs.begin(); it != session->idle_envs.end(); ++it)
+            {
+                if (it->first == this->num_threads)
+                {
+                    this->env = it->second;
+                    session->idle_threads -= it->first;
+                    session->idle_envs.erase(it);
+                    return;
+                }
+            }
+        }
+
+        this->env = new kdu_thread_env;
+        this->env->create();
+        for (int i = 1; i < this->num_threads; i++)
+        {
+            if (!this->env->add_thread())
+                break;
+        }
+    }
+
+    /* an environment that saw an error is not returned to the session */
+    ~session_env()
+    {
+        if (this->env == NULL)
+            return;
+
+        if (!this->succeeded)
+        {
+            destroy_env(this->env);
+            return;
+        }
+
+        std::list<std::pair<int, kdu_thread_env *>> evicted;
+        {
+            std::lock_guard<std::mutex> lock(this->session->env_mutex);
+            std::list<std::pair<int, kdu_thread_env *>> &idle = this->session->idle_envs;
+            idle.emplace_front(this->num_threads, this->env);
+            this->session->idle_threads += this->num_threads;
+
+            /* the environment just returned is kept, even if larger than the bound */
+            while (this->session->idle_threads > this->session->max_idle_threads && idle.size() > 1)
+            {
+                this->session->idle_threads -= idle.back().first;
+                evicted.splice(evicted.end(), idle, std::prev(idle.end()));
+            }
+        }
+
+        /* joining the threads is done outside of the lock */
+        for (auto &e : evicted)
+            destroy_env(e.second);
+    }
+
+    void done() { this->succeeded = true; }
+
+    kdu_thread_env *get() { return this->env; }
+
+private:
+    exrkdu_session *session;
+    kdu_thread_env *env;
+    int num_threads;
+    bool succeeded;
+};
+
 class mem_compressed_target : public kdu_compressed_target
 {
 public:
@@ -104,208 +288,2303 @@ private:
     uint8_t *cur_ptr;
 };
 
-class error_message_handler : public kdu_core::kdu_message
+/* KDU messages are routed to the message sink of the calling thread, which
+   forwards them to the callback of the session being used on that thread.
+   Messages issued from KDU worker threads have no sink and are dropped; the
+   corresponding errors still reach the calling thread as kdu_exception. */
+
+class message_sink
 {
 public:
-    void put_text(const char *msg) { std::cout << msg; }
+    message_sink(exrkdu_session *session);
+    ~message_sink();
 
-    virtual void flush(bool end_of_message = false)
+    void put_text(const char *msg) { this->text.append(msg); }
+
+    void end_message(int is_error)
     {
-        if (end_of_message)
+        if (this->session->config.message_fn != NULL)
         {
-            std::cout << std::endl;
+            this->session->config.message_fn(
+                this->session->config.message_user_data, is_error, this->text.c_str());
         }
+        this->text.clear();
     }
+
+private:
+    exrkdu_session *session;
+    message_sink *prev_sink;
+    std::string text;
 };
 
-static error_message_handler error_handler;
+static thread_local message_sink *current_sink = NULL;
 
-extern "C" exr_result_t
-kdu_decompress(
-    exr_decode_pipeline_t *decode)
+class message_router : public kdu_core::kdu_message
 {
-    exr_result_t rv = EXR_ERR_SUCCESS;
+public:
+    message_router(bool is_error) : is_error(is_error) {}
 
-    if (decode->chunk.packed_size == 0)
-        return EXR_ERR_SUCCESS;
+    void put_text(const char *msg)
+    {
+        if (current_sink)
+            current_sink->put_text(msg);
+    }
 
-    if (decode->chunk.packed_size == decode->chunk.unpacked_size)
+    virtual void flush(bool end_of_message = false)
     {
-        if (decode->unpacked_buffer != decode->packed_buffer)
-            memcpy(decode->unpacked_buffer, decode->packed_buffer, decode->chunk.packed_size);
-        return EXR_ERR_SUCCESS;
+        if (!end_of_message)
+            return;
+
+        if (current_sink)
+            current_sink->end_message(this->is_error);
+
+        if (this->is_error)
+            throw KDU_ERROR_EXCEPTION;
     }
 
-    std::vector<CodestreamChannelInfo> cs_to_file_ch(decode->channel_count);
+private:
+    bool is_error;
+};
 
-    /* read the channel map */
+static message_router error_router(true);
+static message_router warning_router(false);
 
-    size_t header_sz = read_header(
-        (uint8_t *)decode->packed_buffer, decode->chunk.packed_size, cs_to_file_ch);
-    if (decode->channel_count != cs_to_file_ch.size())
-        throw std::runtime_error("Unexpected number of channels");
+message_sink::message_sink(exrkdu_session *session)
+    : session(session), prev_sink(current_sink)
+{
+    static std::once_flag routers_installed;
+    std::call_once(routers_installed, []
+                   {
+                       kdu_core::kdu_customize_errors(&error_router);
+                       kdu_core::kdu_customize_warnings(&warning_router); });
 
-    std::vector<int> heights(decode->channel_count);
-    std::vector<int> sample_offsets(decode->channel_count);
+    current_sink = this;
+}
 
-    int32_t width = decode->chunk.width;
-    int32_t height = decode->chunk.height;
+message_sink::~message_sink()
+{
+    current_sink = this->prev_sink;
+}
+
+/* the codec handles a single sample type across all channels */
 
-    for (int i = 0; i < sample_offsets.size(); i++)
+static bool
+has_uniform_type(const exr_coding_channel_info_t *channels, int channel_count)
+{
+    for (int i = 1; i < channel_count; i++)
     {
-        sample_offsets[i] = cs_to_file_ch[i].file_index * width;
+        if (channels[i].data_type != channels[0].data_type)
+            return false;
     }
 
-    std::vector<int> row_gaps(decode->channel_count);
-    std::fill(
-        row_gaps.begin(), row_gaps.end(), width * decode->channel_count);
+    return true;
+}
+
+/* location of the samples of a codestream component, with gaps in samples */
 
-    kdu_core::kdu_customize_errors(&error_handler);
+struct component_plane
+{
+    uint8_t *base;
+    int sample_gap;
+    int row_gap;
 
-    kdu_compressed_source_buffered infile(
-        ((kdu_byte *)(decode->packed_buffer)) + header_sz, decode->chunk.packed_size - header_sz);
+    /* bits declared in the codestream, 0 for the full width of the type */
+    int precision;
+};
 
-    kdu_codestream cs;
-    cs.create(&infile);
+/* planes of the packed/unpacked OpenEXR buffer, where each line holds the
+   samples of every channel in turn */
+
+static void
+make_packed_planes(
+    void *buffer,
+    const std::vector<CodestreamChannelInfo> &cs_to_file_ch,
+    const exr_coding_channel_info_t *channels,
+    int channel_count,
+    int width,
+    std::vector<component_plane> &planes)
+{
+    int bpe = channels[0].bytes_per_element;
+
+    planes.resize(cs_to_file_ch.size());
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        planes[i].base = (uint8_t *)buffer + (size_t)cs_to_file_ch[i].file_index * width * bpe;
+        planes[i].sample_gap = 1;
+        planes[i].row_gap = width * channel_count;
+        planes[i].precision = 0;
+    }
+}
+
+/* planes of the user buffers, if the codec can access them directly, i.e.
+   without type conversion, subsampling or skipped lines */
+
+static bool
+make_user_planes(
+    const std::vector<CodestreamChannelInfo> &cs_to_file_ch,
+    const exr_coding_channel_info_t *channels,
+    int width,
+    int height,
+    std::vector<component_plane> &planes,
+    bool allow_skipped = false)
+{
+    bool any = false;
+
+    planes.resize(cs_to_file_ch.size());
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        const exr_coding_channel_info_t &ch = channels[cs_to_file_ch[i].file_index];
+        int bpe = ch.bytes_per_element;
 
-    kdu_dims dims;
-    cs.get_dims(0, dims, false);
+        /* when decoding, a channel without buffer is not decoded at all */
+        if (allow_skipped && ch.decode_to_ptr == NULL && ch.width == width && ch.height == height)
+        {
+            planes[i].base = NULL;
+            planes[i].sample_gap = 0;
+            planes[i].row_gap = 0;
+            planes[i].precision = 0;
+            continue;
+        }
 
-    assert(width == dims.size.x);
-    assert(height == dims.size.y);
-    assert(decode->channel_count == cs.get_num_components());
-    assert(sizeof(int16_t) == 2);
+        if (ch.decode_to_ptr == NULL ||
+            ch.width != width || ch.height != height ||
+            ch.user_data_type != ch.data_type ||
+            ch.user_bytes_per_element != bpe ||
+            ch.user_pixel_stride <= 0 || ch.user_pixel_stride % bpe != 0 ||
+            ch.user_line_stride <= 0 || ch.user_line_stride % bpe != 0 ||
+            ((uintptr_t)ch.decode_to_ptr) % bpe != 0)
+            return false;
+
+        planes[i].base = ch.decode_to_ptr;
+        planes[i].sample_gap = ch.user_pixel_stride / bpe;
+        planes[i].row_gap = ch.user_line_stride / bpe;
+        planes[i].precision = 0;
+        any = true;
+    }
 
-    kdu_stripe_decompressor d;
+    /* callers that set no buffer at all read the unpacked buffer instead */
+    return any;
+}
 
-    d.start(cs);
+/* KDU is fed in stripes of its recommended height rather than the whole chunk
+   at once, which keeps its working buffers cache-resident and small, and lets
+   it overlap the DWT with block coding */
 
-    std::fill(heights.begin(), heights.end(), height);
+#define MIN_STRIPE_HEIGHT 8
+#define MAX_STRIPE_HEIGHT 1024
 
-    if (decode->channels[0].data_type == EXR_PIXEL_HALF)
+template <typename T, class Coder, class Step>
+static void
+code_stripes(Coder &coder, const std::vector<component_plane> &planes, int height, bool is_signed, const Step &step)
+{
+    size_t n = planes.size();
+    std::vector<T *> bufs(n);
+    std::vector<int> heights(n);
+    std::vector<int> sample_gaps(n);
+    std::vector<int> row_gaps(n);
+    std::vector<int> recommended(n);
+    std::vector<int> max_heights(n);
+    std::vector<int> precisions(n);
+    std::unique_ptr<bool[]> signs(new bool[n]);
+    bool reduced = false;
+
+    for (size_t i = 0; i < n; i++)
     {
-        d.pull_stripe(
-            (kdu_int16 *)decode->unpacked_buffer,
-            heights.data(),
-            sample_offsets.data(),
-            NULL,
-            row_gaps.data());
+        bufs[i] = (T *)planes[i].base;
+        sample_gaps[i] = planes[i].sample_gap;
+        row_gaps[i] = planes[i].row_gap;
+        precisions[i] = planes[i].precision ? planes[i].precision : (int)sizeof(T) * 8;
+        signs[i] = is_signed;
+        reduced = reduced || planes[i].precision != 0;
     }
-    else
+
+    /* the default layout is kept unless a component has a reduced precision,
+       in which case the samples are described explicitly */
+    int *stripe_precisions = reduced ? precisions.data() : NULL;
+    bool *stripe_signs = reduced ? signs.get() : NULL;
+
+    coder.get_recommended_stripe_heights(
+        MIN_STRIPE_HEIGHT, MAX_STRIPE_HEIGHT, recommended.data(), max_heights.data());
+
+    /* all components have the dimensions of the chunk */
+    int stripe_height = std::max(1, recommended[0]);
+
+    for (int y = 0; y < height; y += stripe_height)
+    {
+        int h = std::min(stripe_height, height - y);
+        std::fill(heights.begin(), heights.end(), h);
+
+        step(bufs.data(), heights.data(), sample_gaps.data(), row_gaps.data(), stripe_precisions, stripe_signs);
+
+        for (size_t i = 0; i < n; i++)
+            bufs[i] += (ptrdiff_t)row_gaps[i] * h;
+    }
+}
+
+template <typename T>
+static void
+pull_planes(kdu_stripe_decompressor &d, const std::vector<component_plane> &planes, int height, bool is_signed)
+{
+    code_stripes<T>(
+        d, planes, height, is_signed,
+        [&](T **bufs, int *heights, int *sample_gaps, int *row_gaps, int *precisions, bool *signs)
+        { d.pull_stripe(bufs, heights, sample_gaps, row_gaps, precisions, signs); });
+}
+
+template <typename T>
+static void
+push_planes(kdu_stripe_compressor &c, const std::vector<component_plane> &planes, int height, bool is_signed)
+{
+    code_stripes<T>(
+        c, planes, height, is_signed,
+        [&](T **bufs, int *heights, int *sample_gaps, int *row_gaps, int *precisions, bool *signs)
+        { c.push_stripe(bufs, heights, sample_gaps, row_gaps, precisions, signs); });
+}
+
+/* smallest precision that represents every sample of the plane exactly, as
+   supplied to KDU: unsigned for UINT, signed otherwise. Signed planes with
+   negative samples keep the full precision, since the SMAG non-linearity
+   depends on it. Returns 0 if no bit can be saved. */
+
+template <typename T>
+static int
+get_plane_precision(const component_plane &plane, int width, int height, bool is_signed)
+{
+    const int full = (int)sizeof(T) * 8;
+    typedef typename std::make_unsigned<T>::type U;
+
+    U bits = 0;
+    const T *line = (const T *)plane.base;
+    for (int y = 0; y < height; y++, line += plane.row_gap)
     {
-        d.pull_stripe(
-            (kdu_int32 *)decode->unpacked_buffer,
-            heights.data(),
-            sample_offsets.data(),
-            NULL,
-            row_gaps.data());
+        const T *sample = line;
+        for (int x = 0; x < width; x++, sample += plane.sample_gap)
+        {
+            if (is_signed && *sample < 0)
+                return 0;
+            bits |= (U)*sample;
+        }
     }
 
-    d.finish();
+    int precision = is_signed ? 1 : 0;
+    for (; bits; bits >>= 1)
+        precision++;
+    precision = std::max(precision, 1);
 
-    cs.destroy();
+    return precision < full ? precision : 0;
+}
 
-    return rv;
+/* the colour transform requires the first 3 components to share a precision */
+
+template <typename T>
+static void
+set_plane_precisions(std::vector<component_plane> &planes, int width, int height, bool is_signed, bool isRGB)
+{
+    for (component_plane &plane : planes)
+        plane.precision = get_plane_precision<T>(plane, width, height, is_signed);
+
+    if (isRGB && planes.size() >= 3)
+    {
+        int precision = 0;
+        for (int i = 0; i < 3 && precision >= 0; i++)
+            precision = planes[i].precision ? std::max(precision, planes[i].precision) : -1;
+        for (int i = 0; i < 3; i++)
+            planes[i].precision = std::max(precision, 0);
+    }
 }
 
-extern "C" exr_result_t
-kdu_compress(exr_encode_pipeline_t *encode)
+/* returns true and the common value if all the samples of the plane are equal */
+
+template <typename T>
+static bool
+get_constant_value(const component_plane &plane, int width, int height, uint32_t &value)
 {
-    exr_result_t rv = EXR_ERR_SUCCESS;
+    const T *line = (const T *)plane.base;
+    T first = line[0];
 
-    std::vector<CodestreamChannelInfo> cs_to_file_ch(encode->channel_count);
-    bool isRGB = make_channel_map(
-        encode->channel_count, encode->channels, cs_to_file_ch);
+    for (int y = 0; y < height; y++, line += plane.row_gap)
+    {
+        const T *sample = line;
+        for (int x = 0; x < width; x++, sample += plane.sample_gap)
+        {
+            if (*sample != first)
+                return false;
+        }
+    }
 
-    int height = encode->chunk.height;
-    int width = encode->chunk.width;
+    value = (uint32_t)(typename std::make_unsigned<T>::type)first;
+    return true;
+}
+
+template <typename T>
+static void
+fill_planes(
+    const std::vector<component_plane> &planes, int width, int height, const std::vector<uint32_t> &values)
+{
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        if (planes[i].base == NULL)
+            continue;
+
+        T value = (T)values[i];
+        T *line = (T *)planes[i].base;
+
+        for (int y = 0; y < height; y++, line += planes[i].row_gap)
+        {
+            T *sample = line;
+            for (int x = 0; x < width; x++, sample += planes[i].sample_gap)
+                *sample = value;
+        }
+    }
+}
+
+/* ranges of codestream components coded as separate codestreams, by layer
+   name prefix, e.g. "diffuse.R", "diffuse.G" and "diffuse.B" */
+
+struct channel_group
+{
+    int first;
+    int count;
+};
+
+static std::string
+layer_prefix(const char *name)
+{
+    const char *dot = name ? strrchr(name, '.') : NULL;
 
-    std::vector<int> heights(encode->channel_count);
-    std::fill(heights.begin(), heights.end(), height);
+    return dot ? std::string(name, dot - name) : std::string();
+}
+
+static void
+make_channel_groups(
+    const std::vector<CodestreamChannelInfo> &cs_to_file_ch,
+    const exr_coding_channel_info_t *channels,
+    bool isRGB,
+    std::vector<channel_group> &groups)
+{
+    groups.clear();
 
-    std::vector<int> sample_offsets(encode->channel_count);
-    for (int i = 0; i < sample_offsets.size(); i++)
+    std::string prev;
+    for (size_t i = 0; i < cs_to_file_ch.size(); i++)
     {
-        sample_offsets[i] = cs_to_file_ch[i].file_index * width;
+        std::string prefix = layer_prefix(channels[cs_to_file_ch[i].file_index].channel_name);
+        if (i == 0 || prefix != prev)
+            groups.push_back({(int)i, 0});
+        groups.back().count++;
+        prev = prefix;
     }
 
-    std::vector<int> row_gaps(encode->channel_count);
-    std::fill(
-        row_gaps.begin(), row_gaps.end(), width * encode->channel_count);
+    /* the colour transform spans the first 3 components */
+    while (isRGB && groups.size() > 1 && groups[0].count < 3)
+    {
+        groups[0].count += groups[1].count;
+        groups.erase(groups.begin() + 1);
+    }
+}
 
-    siz_params siz;
-    siz.set(Scomponents, 0, 0, encode->channel_count);
+/* tile_width > 0 splits the chunk in tiles of that width, which KDU codes
+   concurrently when threads are available */
+
+static void
+make_siz(
+    siz_params &siz,
+    const std::vector<component_plane> &planes,
+    int width,
+    int height,
+    exr_pixel_type_t type,
+    int tile_width)
+{
+    siz.set(Scomponents, 0, 0, (int)planes.size());
     siz.set(Sdims, 0, 0, height);
     siz.set(Sdims, 0, 1, width);
-    siz.set(Nprecision, 0, 0, encode->channels[0].data_type == EXR_PIXEL_HALF ? 16 : 32);
-    siz.set(Nsigned, 0, 0, encode->channels[0].data_type != EXR_PIXEL_UINT);
+    if (tile_width > 0 && tile_width < width)
+    {
+        siz.set(Stiles, 0, 0, height);
+        siz.set(Stiles, 0, 1, tile_width);
+    }
+    for (size_t c = 0; c < planes.size(); c++)
+    {
+        int precision = planes[c].precision ? planes[c].precision : (type == EXR_PIXEL_HALF ? 16 : 32);
+        siz.set(Nprecision, (int)c, 0, precision);
+    }
+    siz.set(Nsigned, 0, 0, type != EXR_PIXEL_UINT);
     static_cast<kdu_params &>(siz).finalize();
+}
 
-    size_t header_sz = write_header(
-        (uint8_t *)encode->compressed_buffer,
-        encode->packed_bytes,
-        cs_to_file_ch);
+/* DWT levels of the chunks */
+#define DWT_LEVELS 5
+
+static void
+set_coding_params(kdu_codestream &codestream, bool isRGB, exr_pixel_type_t type, int levels = DWT_LEVELS)
+{
+    codestream.set_disabled_auto_comments(0xFFFFFFFF);
+
+    kdu_params *cod = codestream.access_siz()->access_cluster(COD_params);
+
+    cod->set(Creversible, 0, 0, true);
+    cod->set(Corder, 0, 0, Corder_RPCL);
+    cod->set(Cmodes, 0, 0, Cmodes_HT);
+    cod->set(Cblk, 0, 0, 32);
+    cod->set(Cblk, 0, 1, 128);
+    cod->set(Clevels, 0, 0, levels);
+    cod->set(Cycc, 0, 0, isRGB);
+
+    if (type != EXR_PIXEL_UINT)
+    {
+        kdu_params *nlt = codestream.access_siz()->access_cluster(NLT_params);
+        nlt->set(NLType, 0, 0, NLType_SMAG);
+    }
 
+    codestream.access_siz()->finalize_all();
+}
+
+/* codes the planes as the components of a new codestream */
+
+static void
+encode_components(
+    kdu_thread_env *env,
+    siz_params &siz,
+    const std::vector<component_plane> &planes,
+    bool isRGB,
+    exr_pixel_type_t type,
+    int height,
+    kdu_compressed_target &output,
+    int levels = DWT_LEVELS)
+{
     kdu_codestream codestream;
-    mem_compressed_target output(((uint8_t *)encode->compressed_buffer) + header_sz, encode->packed_bytes - header_sz);
 
     try
     {
-
         codestream.create(&siz, &output);
 
-        codestream.set_disabled_auto_comments(0xFFFFFFFF);
+        set_coding_params(codestream, isRGB, type, levels);
 
-        kdu_params *cod = codestream.access_siz()->access_cluster(COD_params);
+        kdu_stripe_compressor compressor;
+        compressor.start(
+            codestream, 0, NULL, NULL, 0, false, false, true, 0.0, 0, false, env);
 
-        cod->set(Creversible, 0, 0, true);
-        cod->set(Corder, 0, 0, Corder_RPCL);
-        cod->set(Cmodes, 0, 0, Cmodes_HT);
-        cod->set(Cblk, 0, 0, 32);
-        cod->set(Cblk, 0, 1, 128);
-        cod->set(Clevels, 0, 0, 5);
-        cod->set(Cycc, 0, 0, isRGB);
+        if (type == EXR_PIXEL_HALF)
+            push_planes<kdu_int16>(compressor, planes, height, true);
+        else
+            push_planes<kdu_int32>(compressor, planes, height, type != EXR_PIXEL_UINT);
 
-        if (encode->channels[0].data_type != EXR_PIXEL_UINT)
-        {
-            kdu_params *nlt = codestream.access_siz()->access_cluster(NLT_params);
-            nlt->set(NLType, 0, 0, NLType_SMAG);
-        }
+        compressor.finish();
 
-        codestream.access_siz()->finalize_all();
+        if (env)
+            env->cs_terminate(codestream);
 
-        kdu_stripe_compressor compressor;
-        compressor.start(codestream);
+        codestream.destroy();
+    }
+    catch (...)
+    {
+        if (env)
+            env->handle_exception(KDU_ERROR_EXCEPTION);
+        if (codestream.exists())
+            codestream.destroy();
+        throw;
+    }
+}
+
+/* decodes the given components of a codestream to the planes, which hold one
+   entry per decoded component, at the resolution reduced by `discard_levels`
+   DWT levels, i.e. ceil(width / 2^discard_levels) samples per line */
+
+static void
+decode_components(
+    kdu_thread_env *env,
+    const uint8_t *data,
+    size_t size,
+    const std::vector<int> &components,
+    const std::vector<component_plane> &planes,
+    int component_count,
+    bool is_half,
+    int width,
+    int height,
+    int discard_levels = 0)
+{
+    kdu_compressed_source_buffered infile((kdu_byte *)data, size);
+
+    kdu_codestream cs;
+
+    try
+    {
+        cs.create(&infile, env);
+
+        kdu_dims dims;
+        cs.get_dims(0, dims, false);
+
+        if (width != dims.size.x || height != dims.size.y || component_count != cs.get_num_components())
+            throw std::runtime_error("Codestream does not match the chunk");
 
-        if (encode->channels[0].data_type == EXR_PIXEL_HALF)
+        /* components coded with a reduced precision */
+        std::vector<component_plane> stripe_planes(planes);
+        int full_precision = is_half ? 16 : 32;
+        for (size_t i = 0; i < components.size(); i++)
         {
-            compressor.push_stripe(
-                (kdu_int16 *)encode->packed_buffer,
-                heights.data(),
-                sample_offsets.data(),
-                NULL,
-                row_gaps.data());
+            int precision = cs.get_bit_depth(components[i]);
+            stripe_planes[i].precision = precision != full_precision ? precision : 0;
         }
-        else
+        bool is_signed = cs.get_signed(components[0]);
+
+        if ((int)components.size() != component_count || discard_levels > 0)
         {
-            compressor.push_stripe(
-                (kdu_int32 *)encode->packed_buffer,
-                heights.data(),
-                sample_offsets.data(),
-                NULL,
-                row_gaps.data());
+            cs.apply_input_restrictions(
+                (int)components.size(), components.data(), discard_levels, 0, NULL, KDU_WANT_OUTPUT_COMPONENTS);
         }
 
-        compressor.finish();
+        kdu_stripe_decompressor d;
 
-        codestream.destroy();
+        d.start(cs, false, false, env);
+
+        int reduced_height = (height + (1 << discard_levels) - 1) >> discard_levels;
+        if (is_half)
+            pull_planes<kdu_int16>(d, stripe_planes, reduced_height, is_signed);
+        else
+            pull_planes<kdu_int32>(d, stripe_planes, reduced_height, is_signed);
+
+        d.finish();
+
+        if (env)
+            env->cs_terminate(cs);
 
-        encode->compressed_bytes = output.get_size() + header_sz;
+        cs.destroy();
     }
-    catch (const std::range_error &e)
+    catch (...)
     {
-        encode->compressed_bytes = encode->packed_bytes;
+        if (env)
+            env->handle_exception(KDU_ERROR_EXCEPTION);
+        if (cs.exists())
+            cs.destroy();
+        throw;
     }
+}
 
-    return rv;
+/* moves the coding passes of a code-block to another codestream without
+   decoding them, as kdu_transcode does */
+
+static void
+copy_block(kdu_block *in, kdu_block *out)
+{
+    if (in->K_max_prime != out->K_max_prime || in->size != out->size)
+        throw std::runtime_error("Incompatible code-blocks");
+
+    out->missing_msbs = in->missing_msbs;
+    if (out->max_passes < in->num_passes + 2)
+        out->set_max_passes(in->num_passes + 2, false);
+    out->num_passes = in->num_passes;
+
+    int num_bytes = 0;
+    for (int z = 0; z < in->num_passes; z++)
+    {
+        num_bytes += (out->pass_lengths[z] = in->pass_lengths[z]);
+        out->pass_slopes[z] = in->pass_slopes[z];
+    }
+
+    if (out->max_bytes < num_bytes)
+        out->set_max_bytes(num_bytes, false);
+    memcpy(out->byte_buffer, in->byte_buffer, (size_t)num_bytes);
+}
+
+/* copies `count` components of a tile, from `in_first`, to the components of
+   a tile coded with the same parameters, from `out_first` */
+
+static void
+copy_tile_components(kdu_tile in, int in_first, kdu_tile out, int out_first, int count)
+{
+    for (int c = 0; c < count; c++)
+    {
+        kdu_tile_comp comp_in = in.access_component(in_first + c);
+        kdu_tile_comp comp_out = out.access_component(out_first + c);
+
+        int num_resolutions = comp_out.get_num_resolutions();
+        if (comp_in.get_num_resolutions() != num_resolutions)
+            throw std::runtime_error("Incompatible tile components");
+
+        for (int r = 0; r < num_resolutions; r++)
+        {
+            kdu_resolution res_in = comp_in.access_resolution(r);
+            kdu_resolution res_out = comp_out.access_resolution(r);
+
+            int min_band;
+            int num_bands = res_out.get_valid_band_indices(min_band);
+            for (int b = min_band; b < min_band + num_bands; b++)
+            {
+                kdu_subband band_in = res_in.access_subband(b);
+                kdu_subband band_out = res_out.access_subband(b);
+
+                kdu_dims blocks_in, blocks_out;
+                band_in.get_valid_blocks(blocks_in);
+                band_out.get_valid_blocks(blocks_out);
+                if (blocks_in.size != blocks_out.size)
+                    throw std::runtime_error("Incompatible subbands");
+
+                kdu_coords idx;
+                for (idx.y = 0; idx.y < blocks_out.size.y; idx.y++)
+                {
+                    for (idx.x = 0; idx.x < blocks_out.size.x; idx.x++)
+                    {
+                        kdu_block *block_in = band_in.open_block(idx + blocks_in.pos);
+                        kdu_block *block_out = band_out.open_block(idx + blocks_out.pos);
+                        copy_block(block_in, block_out);
+                        band_in.close_block(block_in);
+                        band_out.close_block(block_out);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* codes each group of components as a separate codestream, on the KDU threads
+   of the chunk, and merges them into a single standard codestream by copying
+   their code-blocks, so that any HTJ2K decoder can read the chunk */
+
+static void
+compress_groups(
+    exrkdu_session *session,
+    kdu_thread_env *env,
+    const std::vector<channel_group> &groups,
+    const std::vector<component_plane> &planes,
+    siz_params &siz,
+    bool isRGB,
+    exr_pixel_type_t type,
+    int width,
+    int height,
+    kdu_compressed_target &output)
+{
+    int bpe = type == EXR_PIXEL_HALF ? 2 : 4;
+
+    std::vector<std::vector<uint8_t>> buffers(groups.size());
+    std::vector<size_t> sizes(groups.size());
+
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        const channel_group &group = groups[g];
+
+        std::vector<component_plane> group_planes(
+            planes.begin() + group.first, planes.begin() + group.first + group.count);
+
+        siz_params group_siz;
+        make_siz(group_siz, group_planes, width, height, type, session->config.tile_width);
+
+        /* a group that does not fit in its share of the chunk makes the whole
+           chunk fall back to raw storage */
+        buffers[g].resize((size_t)group.count * width * height * bpe);
+        mem_compressed_target target(buffers[g].data(), buffers[g].size());
+
+        encode_components(env, group_siz, group_planes, isRGB && g == 0, type, height, target);
+        sizes[g] = target.get_size();
+    }
+
+    std::vector<kdu_compressed_source_buffered *> sources;
+    std::vector<kdu_codestream> inputs(groups.size());
+    kdu_codestream merged;
+
+    try
+    {
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            sources.push_back(new kdu_compressed_source_buffered(buffers[g].data(), sizes[g]));
+            inputs[g].create(sources[g]);
+        }
+
+        merged.create(&siz, &output);
+        set_coding_params(merged, isRGB, type);
+
+        kdu_dims tiles;
+        merged.get_valid_tiles(tiles);
+
+        kdu_coords idx;
+        for (idx.y = 0; idx.y < tiles.size.y; idx.y++)
+        {
+            for (idx.x = 0; idx.x < tiles.size.x; idx.x++)
+            {
+                kdu_tile tile_out = merged.open_tile(idx + tiles.pos);
+                for (size_t g = 0; g < groups.size(); g++)
+                {
+                    kdu_tile tile_in = inputs[g].open_tile(idx + tiles.pos);
+                    copy_tile_components(tile_in, 0, tile_out, groups[g].first, groups[g].count);
+                    tile_in.close();
+                }
+                tile_out.close();
+            }
+        }
+
+        merged.trans_out();
+    }
+    catch (...)
+    {
+        if (merged.exists())
+            merged.destroy();
+        for (kdu_codestream &cs : inputs)
+            if (cs.exists())
+                cs.destroy();
+        for (kdu_compressed_source_buffered *source : sources)
+            delete source;
+        throw;
+    }
+
+    merged.destroy();
+    for (kdu_codestream &cs : inputs)
+        cs.destroy();
+    for (kdu_compressed_source_buffered *source : sources)
+        delete source;
+}
+
+/* constant components, e.g. an opaque alpha next to varying RGB, have no
+   detail: their code-blocks outside the lowest resolution are empty and their
+   LL band holds the constant. They are coded and decoded from that band alone,
+   without the DWT of the full chunk. */
+
+/* marks the constant planes and their values; the components of the colour
+   transform are constant together or not at all. Returns the constant count. */
+
+template <typename T>
+static int
+find_constant_planes(
+    const std::vector<component_plane> &planes,
+    int width,
+    int height,
+    bool isRGB,
+    std::vector<bool> &constant,
+    std::vector<uint32_t> &values)
+{
+    constant.assign(planes.size(), false);
+    values.assign(planes.size(), 0);
+
+    for (size_t i = 0; i < planes.size(); i++)
+        constant[i] = get_constant_value<T>(planes[i], width, height, values[i]);
+
+    if (isRGB && planes.size() >= 3 && !(constant[0] && constant[1] && constant[2]))
+        constant[0] = constant[1] = constant[2] = false;
+
+    return (int)std::count(constant.begin(), constant.end(), true);
+}
+
+static void
+empty_block(kdu_block *block)
+{
+    block->missing_msbs = block->K_max_prime;
+    block->num_passes = 0;
+}
+
+/* fills a component of a tile with the code-blocks of a codestream of its LL
+   band alone, i.e. without DWT levels, and empty code-blocks elsewhere */
+
+static void
+copy_ll_component(kdu_tile ll, int in_comp, kdu_tile out, int out_comp)
+{
+    kdu_tile_comp comp_in = ll.access_component(in_comp);
+    kdu_tile_comp comp_out = out.access_component(out_comp);
+
+    if (comp_in.get_num_resolutions() != 1)
+        throw std::runtime_error("Incompatible tile components");
+
+    int num_resolutions = comp_out.get_num_resolutions();
+    for (int r = 0; r < num_resolutions; r++)
+    {
+        kdu_resolution res_out = comp_out.access_resolution(r);
+
+        int min_band;
+        int num_bands = res_out.get_valid_band_indices(min_band);
+        for (int b = min_band; b < min_band + num_bands; b++)
+        {
+            kdu_subband band_out = res_out.access_subband(b);
+            kdu_subband band_in;
+            if (r == 0)
+                band_in = comp_in.access_resolution(0).access_subband(b);
+
+            kdu_dims blocks_in, blocks_out;
+            band_out.get_valid_blocks(blocks_out);
+            if (r == 0)
+            {
+                band_in.get_valid_blocks(blocks_in);
+                if (blocks_in.size != blocks_out.size)
+                    throw std::runtime_error("Incompatible subbands");
+            }
+
+            kdu_coords idx;
+            for (idx.y = 0; idx.y < blocks_out.size.y; idx.y++)
+            {
+                for (idx.x = 0; idx.x < blocks_out.size.x; idx.x++)
+                {
+                    kdu_block *block_out = band_out.open_block(idx + blocks_out.pos);
+                    if (r == 0)
+                    {
+                        kdu_block *block_in = band_in.open_block(idx + blocks_in.pos);
+                        copy_block(block_in, block_out);
+                        band_in.close_block(block_in);
+                    }
+                    else
+                    {
+                        empty_block(block_out);
+                    }
+                    band_out.close_block(block_out);
+                }
+            }
+        }
+    }
+}
+
+/* codes the varying components as one codestream and the LL band of the
+   constant ones, which is ~1/1000 of the chunk, as another, then assembles the
+   chunk from their code-blocks; throws if KDU codes the LL band differently
+   alone, in which case the chunk is coded in full */
+
+static void
+compress_constant(
+    exrkdu_session *session,
+    kdu_thread_env *env,
+    const std::vector<component_plane> &planes,
+    const std::vector<bool> &constant,
+    const std::vector<uint32_t> &values,
+    siz_params &siz,
+    bool isRGB,
+    exr_pixel_type_t type,
+    int width,
+    int height,
+    kdu_compressed_target &output)
+{
+    int bpe = type == EXR_PIXEL_HALF ? 2 : 4;
+
+    std::vector<int> varying;
+    std::vector<component_plane> varying_planes;
+    for (size_t c = 0; c < planes.size(); c++)
+    {
+        if (!constant[c])
+        {
+            varying.push_back((int)c);
+            varying_planes.push_back(planes[c]);
+        }
+    }
+
+    std::vector<uint8_t> varying_buf;
+    size_t varying_size = 0;
+    if (!varying.empty())
+    {
+        siz_params varying_siz;
+        make_siz(varying_siz, varying_planes, width, height, type, session->config.tile_width);
+
+        varying_buf.resize(varying.size() * width * height * bpe);
+        mem_compressed_target target(varying_buf.data(), varying_buf.size());
+        encode_components(env, varying_siz, varying_planes, isRGB && !constant[0], type, height, target);
+        varying_size = target.get_size();
+    }
+
+    /* the LL band of every component, the varying ones being left at zero */
+    siz_params ll_siz;
+    ll_siz.copy_from(&siz, -1, -1, -1, 0, DWT_LEVELS, false, false, false);
+    static_cast<kdu_params &>(ll_siz).finalize();
+
+    int ll_width, ll_height;
+    if (!ll_siz.get(Sdims, 0, 0, ll_height) || !ll_siz.get(Sdims, 0, 1, ll_width))
+        throw std::runtime_error("Invalid LL band");
+
+    size_t ll_plane_size = (size_t)ll_width * ll_height * bpe;
+    std::vector<uint8_t> ll_samples(planes.size() * ll_plane_size);
+    std::vector<component_plane> ll_planes(planes.size());
+    std::vector<uint32_t> ll_values(planes.size());
+    for (size_t c = 0; c < planes.size(); c++)
+    {
+        ll_planes[c].base = ll_samples.data() + c * ll_plane_size;
+        ll_planes[c].sample_gap = 1;
+        ll_planes[c].row_gap = ll_width;
+        ll_planes[c].precision = planes[c].precision;
+        ll_values[c] = constant[c] ? values[c] : 0;
+    }
+
+    if (type == EXR_PIXEL_HALF)
+        fill_planes<kdu_int16>(ll_planes, ll_width, ll_height, ll_values);
+    else
+        fill_planes<kdu_int32>(ll_planes, ll_width, ll_height, ll_values);
+
+    /* with headroom for the tile headers */
+    std::vector<uint8_t> ll_buf(ll_samples.size() + 65536);
+    mem_compressed_target ll_target(ll_buf.data(), ll_buf.size());
+    encode_components(NULL, ll_siz, ll_planes, isRGB, type, ll_height, ll_target, 0);
+
+    kdu_compressed_source_buffered varying_source(varying_buf.data(), varying_size);
+    kdu_compressed_source_buffered ll_source(ll_buf.data(), ll_target.get_size());
+    kdu_codestream varying_cs, ll_cs, merged;
+
+    try
+    {
+        if (!varying.empty())
+            varying_cs.create(&varying_source);
+        ll_cs.create(&ll_source);
+
+        merged.create(&siz, &output);
+        set_coding_params(merged, isRGB, type);
+
+        kdu_dims tiles, ll_tiles, varying_tiles;
+        merged.get_valid_tiles(tiles);
+        ll_cs.get_valid_tiles(ll_tiles);
+        if (ll_tiles.size != tiles.size)
+            throw std::runtime_error("Incompatible LL band");
+        if (!varying.empty())
+            varying_cs.get_valid_tiles(varying_tiles);
+
+        kdu_coords idx;
+        for (idx.y = 0; idx.y < tiles.size.y; idx.y++)
+        {
+            for (idx.x = 0; idx.x < tiles.size.x; idx.x++)
+            {
+                kdu_tile tile_out = merged.open_tile(idx + tiles.pos);
+
+                kdu_tile ll_tile = ll_cs.open_tile(idx + ll_tiles.pos);
+                for (size_t c = 0; c < planes.size(); c++)
+                {
+                    if (constant[c])
+                        copy_ll_component(ll_tile, (int)c, tile_out, (int)c);
+                }
+                ll_tile.close();
+
+                if (!varying.empty())
+                {
+                    kdu_tile varying_tile = varying_cs.open_tile(idx + varying_tiles.pos);
+                    for (size_t v = 0; v < varying.size(); v++)
+                        copy_tile_components(varying_tile, (int)v, tile_out, varying[v], 1);
+                    varying_tile.close();
+                }
+
+                tile_out.close();
+            }
+        }
+
+        merged.trans_out();
+    }
+    catch (...)
+    {
+        if (merged.exists())
+            merged.destroy();
+        if (ll_cs.exists())
+            ll_cs.destroy();
+        if (varying_cs.exists())
+            varying_cs.destroy();
+        throw;
+    }
+
+    merged.destroy();
+    ll_cs.destroy();
+    if (varying_cs.exists())
+        varying_cs.destroy();
+}
+
+/* true if the code-blocks of a tile component are all empty outside its
+   lowest resolution; the highest resolutions are checked first, since the
+   detail of varying components is found there */
+
+static bool
+has_empty_details(kdu_tile_comp comp)
+{
+    for (int r = comp.get_num_resolutions() - 1; r > 0; r--)
+    {
+        kdu_resolution res = comp.access_resolution(r);
+
+        int min_band;
+        int num_bands = res.get_valid_band_indices(min_band);
+        for (int b = min_band; b < min_band + num_bands; b++)
+        {
+            kdu_subband band = res.access_subband(b);
+
+            kdu_dims blocks;
+            band.get_valid_blocks(blocks);
+
+            kdu_coords idx;
+            for (idx.y = 0; idx.y < blocks.size.y; idx.y++)
+            {
+                for (idx.x = 0; idx.x < blocks.size.x; idx.x++)
+                {
+                    kdu_block *block = band.open_block(idx + blocks.pos);
+                    bool empty = block->num_passes == 0;
+                    band.close_block(block);
+                    if (!empty)
+                        return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/* fills the planes of the components that decode to a constant, found from
+   their code-blocks and their LL band alone, and clears their base so that
+   they are not decoded again; returns their count */
+
+template <typename T>
+static int
+fill_constant_components(
+    const uint8_t *data, size_t size, std::vector<component_plane> &planes, bool is_half, int width, int height)
+{
+    kdu_compressed_source_buffered infile((kdu_byte *)data, size);
+    kdu_codestream cs;
+
+    int levels = 0;
+    bool ycc = false;
+    std::vector<bool> no_detail(planes.size(), true);
+
+    try
+    {
+        cs.create(&infile);
+        levels = cs.get_min_dwt_levels();
+
+        cs.access_siz()->access_cluster(COD_params)->get(Cycc, 0, 0, ycc);
+
+        kdu_dims tiles;
+        cs.get_valid_tiles(tiles);
+
+        kdu_coords idx;
+        for (idx.y = 0; idx.y < tiles.size.y && levels > 0; idx.y++)
+        {
+            for (idx.x = 0; idx.x < tiles.size.x; idx.x++)
+            {
+                kdu_tile tile = cs.open_tile(idx + tiles.pos);
+                for (size_t c = 0; c < planes.size(); c++)
+                {
+                    if (no_detail[c])
+                        no_detail[c] = has_empty_details(tile.access_component((int)c));
+                }
+                tile.close();
+            }
+        }
+
+        /* components mixed by the colour transform are constant together */
+        if (ycc && planes.size() >= 3 &&
+            !(no_detail[0] && no_detail[1] && no_detail[2] && planes[0].base && planes[1].base && planes[2].base))
+            no_detail[0] = no_detail[1] = no_detail[2] = false;
+
+        cs.destroy();
+    }
+    catch (...)
+    {
+        if (cs.exists())
+            cs.destroy();
+        throw;
+    }
+
+    /* without DWT levels, decoding the LL band is decoding the chunk */
+    if (levels == 0)
+        return 0;
+
+    std::vector<int> candidates;
+    for (size_t c = 0; c < planes.size(); c++)
+    {
+        if (no_detail[c] && planes[c].base != NULL)
+            candidates.push_back((int)c);
+    }
+    if (candidates.empty())
+        return 0;
+
+    int ll_width = (width + (1 << levels) - 1) >> levels;
+    int ll_height = (height + (1 << levels) - 1) >> levels;
+    size_t ll_plane_size = (size_t)ll_width * ll_height * sizeof(T);
+    std::vector<uint8_t> ll_samples(candidates.size() * ll_plane_size);
+    std::vector<component_plane> ll_planes(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        ll_planes[i].base = ll_samples.data() + i * ll_plane_size;
+        ll_planes[i].sample_gap = 1;
+        ll_planes[i].row_gap = ll_width;
+        ll_planes[i].precision = 0;
+    }
+
+    decode_components(
+        NULL, data, size, candidates, ll_planes, (int)planes.size(), is_half, width, height, levels);
+
+    std::vector<bool> is_constant(candidates.size());
+    std::vector<uint32_t> values(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++)
+        is_constant[i] = get_constant_value<T>(ll_planes[i], ll_width, ll_height, values[i]);
+
+    /* the colour transform of a constant LL band is constant only if all of
+       its components are */
+    if (ycc && candidates.size() >= 3 && candidates[2] == 2 && !(is_constant[0] && is_constant[1] && is_constant[2]))
+        is_constant[0] = is_constant[1] = is_constant[2] = false;
+
+    int count = 0;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        if (!is_constant[i])
+            continue;
+
+        std::vector<component_plane> plane(1, planes[candidates[i]]);
+        fill_planes<T>(plane, width, height, std::vector<uint32_t>(1, values[i]));
+        planes[candidates[i]].base = NULL;
+        count++;
+    }
+
+    return count;
+}
+
+static exr_result_t
+fused_unpack(exr_decode_pipeline_t *decode);
+
+static exr_result_t
+decompress_chunk(
+    exrkdu_session *session, exrkdu_binding *binding, exr_decode_pipeline_t *decode, exrkdu_chunk_stats_t &stats)
+{
+    if (decode->chunk.packed_size == 0)
+        return EXR_ERR_SUCCESS;
+
+    if (decode->chunk.packed_size == decode->chunk.unpacked_size)
+    {
+        stats.raw_fallback = 1;
+        if (decode->unpacked_buffer != decode->packed_buffer)
+            memcpy(decode->unpacked_buffer, decode->packed_buffer, decode->chunk.packed_size);
+        return EXR_ERR_SUCCESS;
+    }
+
+    if (!has_uniform_type(decode->channels, decode->channel_count))
+        return EXR_ERR_FEATURE_NOT_IMPLEMENTED;
+
+    std::vector<CodestreamChannelInfo> cs_to_file_ch(decode->channel_count);
+
+    /* read the channel map */
+
+    size_t header_sz = read_header(
+        (uint8_t *)decode->packed_buffer, decode->chunk.packed_size, cs_to_file_ch);
+    if (decode->channel_count != cs_to_file_ch.size())
+        return EXR_ERR_CORRUPT_CHUNK;
+
+    int32_t width = decode->chunk.width;
+    int32_t height = decode->chunk.height;
+
+    for (size_t i = 0; i < cs_to_file_ch.size(); i++)
+    {
+        if (cs_to_file_ch[i].file_index < 0 || cs_to_file_ch[i].file_index >= decode->channel_count)
+            return EXR_ERR_CORRUPT_CHUNK;
+    }
+
+    /* in fused mode, samples go straight to the user buffers and the OpenEXR
+       unpack pass is skipped */
+
+    std::vector<component_plane> planes;
+    bool fused = binding != NULL && decode->unpack_and_convert_fn == fused_unpack &&
+                 decode->user_line_begin_skip == 0 && decode->user_line_end_ignore == 0 &&
+                 make_user_planes(cs_to_file_ch, decode->channels, width, height, planes, true);
+    if (!fused)
+    {
+        make_packed_planes(
+            decode->unpacked_buffer, cs_to_file_ch, decode->channels, decode->channel_count, width, planes);
+    }
+
+    bool is_half = decode->channels[0].data_type == EXR_PIXEL_HALF;
+
+    const uint8_t *cs_data = (const uint8_t *)decode->packed_buffer + header_sz;
+    size_t cs_size = decode->chunk.packed_size - header_sz;
+
+    /* constant components are filled in directly */
+    if (session->config.constant_chunks)
+    {
+        stats.constant = is_half ? fill_constant_components<kdu_int16>(cs_data, cs_size, planes, true, width, height)
+                                 : fill_constant_components<kdu_int32>(cs_data, cs_size, planes, false, width, height);
+    }
+
+    /* components to decode, all at once on the KDU threads of the chunk, which
+       decode them concurrently */
+
+    std::vector<int> components;
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        if (planes[i].base != NULL)
+            components.push_back((int)i);
+    }
+
+    if (components.empty())
+    {
+        /* every component was constant */
+    }
+    else
+    {
+        session_env env(session, binding);
+
+        std::vector<component_plane> wanted_planes;
+        for (int i : components)
+            wanted_planes.push_back(planes[i]);
+
+        decode_components(
+            env.get(), cs_data, cs_size, components, wanted_planes, decode->channel_count, is_half, width, height);
+
+        env.done();
+    }
+
+    if (fused)
+        binding->fused = true;
+
+    return EXR_ERR_SUCCESS;
+}
+
+static exr_result_t
+compress_chunk(
+    exrkdu_session *session, exrkdu_binding *binding, exr_encode_pipeline_t *encode, exrkdu_chunk_stats_t &stats)
+{
+    if (!has_uniform_type(encode->channels, encode->channel_count))
+        return EXR_ERR_FEATURE_NOT_IMPLEMENTED;
+
+    std::vector<CodestreamChannelInfo> cs_to_file_ch(encode->channel_count);
+    bool isRGB = make_channel_map(
+        encode->channel_count, encode->channels, cs_to_file_ch);
+
+    int height = encode->chunk.height;
+    int width = encode->chunk.width;
+
+    /* in fused mode, samples are read straight from the user buffers, which
+       fused_pack() has already checked */
+
+    std::vector<component_plane> planes;
+    bool fused = binding != NULL && binding->fused &&
+                 make_user_planes(cs_to_file_ch, encode->channels, width, height, planes);
+    if (!fused)
+    {
+        make_packed_planes(
+            encode->packed_buffer, cs_to_file_ch, encode->channels, encode->channel_count, width, planes);
+    }
+
+    exr_pixel_type_t type = (exr_pixel_type_t)encode->channels[0].data_type;
+
+    /* tighter per-component precisions, from the actual sample values */
+    if (session->config.adaptive_precision)
+    {
+        if (type == EXR_PIXEL_HALF)
+            set_plane_precisions<kdu_int16>(planes, width, height, true, isRGB);
+        else
+            set_plane_precisions<kdu_int32>(planes, width, height, type != EXR_PIXEL_UINT, isRGB);
+    }
+
+    siz_params siz;
+    make_siz(siz, planes, width, height, type, session->config.tile_width);
+
+    size_t header_sz = write_header(
+        (uint8_t *)encode->compressed_buffer,
+        encode->packed_bytes,
+        cs_to_file_ch);
+
+    /* a chunk as large as the packed samples reads as stored uncompressed, so
+       the codestream must be strictly smaller; overflow falls back to raw */
+    if (header_sz + 1 >= encode->packed_bytes)
+        throw std::range_error("Buffer size exceeded");
+    mem_compressed_target output(
+        ((uint8_t *)encode->compressed_buffer) + header_sz, encode->packed_bytes - header_sz - 1);
+
+    /* constant components are coded from their LL band alone */
+
+    std::vector<bool> constant;
+    std::vector<uint32_t> constant_values;
+    int constant_count = 0;
+    if (session->config.constant_chunks)
+    {
+        constant_count = type == EXR_PIXEL_HALF
+                             ? find_constant_planes<kdu_int16>(planes, width, height, isRGB, constant, constant_values)
+                             : find_constant_planes<kdu_int32>(planes, width, height, isRGB, constant, constant_values);
+    }
+
+    if (constant_count > 0)
+    {
+        session_env env(session, binding);
+
+        try
+        {
+            compress_constant(
+                session, env.get(), planes, constant, constant_values, siz, isRGB, type, width, height, output);
+
+            env.done();
+            stats.constant = constant_count;
+            encode->compressed_bytes = output.get_size() + header_sz;
+            return EXR_ERR_SUCCESS;
+        }
+        catch (const std::range_error &)
+        {
+            throw;
+        }
+        catch (const std::bad_alloc &)
+        {
+            throw;
+        }
+        catch (...)
+        {
+            /* the LL band coded alone does not match that of the chunk */
+            output = mem_compressed_target(
+                ((uint8_t *)encode->compressed_buffer) + header_sz, encode->packed_bytes - header_sz - 1);
+        }
+    }
+
+    std::vector<channel_group> groups;
+    if (session->config.channel_groups)
+        make_channel_groups(cs_to_file_ch, encode->channels, isRGB, groups);
+
+    if (groups.size() > 1)
+    {
+        session_env env(session, binding);
+
+        compress_groups(session, env.get(), groups, planes, siz, isRGB, type, width, height, output);
+
+        env.done();
+    }
+    else
+    {
+        session_env env(session, binding);
+
+        encode_components(env.get(), siz, planes, isRGB, type, height, output);
+
+        env.done();
+    }
+
+    encode->compressed_bytes = output.get_size() + header_sz;
+
+    return EXR_ERR_SUCCESS;
+}
+
+static void
+init_stats(exrkdu_chunk_stats_t &stats, int is_encode, int part_index, const exr_chunk_info_t &chunk, int channel_count)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.is_encode = is_encode;
+    stats.part_index = part_index;
+    stats.start_x = chunk.start_x;
+    stats.start_y = chunk.start_y;
+    stats.width = chunk.width;
+    stats.height = chunk.height;
+    stats.channel_count = channel_count;
+}
+
+static void
+record_stats(exrkdu_session *session, exrkdu_chunk_stats_t &stats, std::chrono::steady_clock::time_point start)
+{
+    stats.start_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         start.time_since_epoch())
+                         .count();
+    stats.duration_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    if (session->config.chunk_fn)
+        session->config.chunk_fn(session->config.chunk_user_data, &stats);
+
+    if (!session->config.collect_metrics)
+        return;
+
+    std::lock_guard<std::mutex> lock(session->metrics_mutex);
+    session->metrics.push_back(stats);
+}
+
+static bool
+wants_stats(const exrkdu_session *session)
+{
+    return session->config.collect_metrics || session->config.chunk_fn != NULL;
+}
+
+/* no exception crosses the C boundary */
+
+static exr_result_t
+guarded_decompress(
+    exrkdu_session *session, exrkdu_binding *binding, exr_decode_pipeline_t *decode, exrkdu_chunk_stats_t &stats)
+{
+    message_sink sink(session);
+
+    try
+    {
+        return decompress_chunk(session, binding, decode, stats);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (...)
+    {
+        return EXR_ERR_CORRUPT_CHUNK;
+    }
+}
+
+extern "C" exr_result_t
+kdu_decompress(
+    exr_decode_pipeline_t *decode)
+{
+    exrkdu_binding *binding = get_binding(decode->decoding_user_data);
+    exrkdu_session *session = binding ? binding->session : default_session();
+
+    if (!wants_stats(session))
+    {
+        exrkdu_chunk_stats_t stats;
+        return guarded_decompress(session, binding, decode, stats);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    exrkdu_chunk_stats_t stats;
+    init_stats(stats, 0, decode->part_index, decode->chunk, decode->channel_count);
+
+    exr_result_t rv = guarded_decompress(session, binding, decode, stats);
+
+    stats.packed_bytes = decode->chunk.unpacked_size;
+    stats.compressed_bytes = decode->chunk.packed_size;
+    stats.result = rv;
+    record_stats(session, stats, start);
+
+    return rv;
+}
+
+/* replaces the OpenEXR unpack pass, which has nothing left to do after a fused
+   decode */
+
+static exr_result_t
+fused_unpack(exr_decode_pipeline_t *decode)
+{
+    exrkdu_binding *binding = get_binding(decode->decoding_user_data);
+
+    if (binding == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    /* decompress_fn is not called for chunks stored uncompressed */
+    if (binding->fused)
+    {
+        binding->fused = false;
+        return EXR_ERR_SUCCESS;
+    }
+
+    if (binding->prev_unpack_fn == NULL)
+        return EXR_ERR_SUCCESS;
+
+    return binding->prev_unpack_fn(decode);
+}
+
+static exr_result_t
+guarded_compress(
+    exrkdu_session *session, exrkdu_binding *binding, exr_encode_pipeline_t *encode, exrkdu_chunk_stats_t &stats)
+{
+    message_sink sink(session);
+
+    try
+    {
+        exr_result_t rv = compress_chunk(session, binding, encode, stats);
+        if (binding)
+            binding->fused = false;
+        return rv;
+    }
+    catch (const std::range_error &)
+    {
+        /* the codestream does not fit: store the chunk uncompressed, which
+           requires the packed buffer that a fused encode skipped */
+        stats.raw_fallback = 1;
+        if (binding && binding->fused)
+        {
+            binding->fused = false;
+            exr_result_t rv = binding->prev_pack_fn(encode);
+            if (rv != EXR_ERR_SUCCESS)
+                return rv;
+        }
+        encode->compressed_bytes = encode->packed_bytes;
+        return EXR_ERR_SUCCESS;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (...)
+    {
+        return EXR_ERR_UNKNOWN;
+    }
+}
+
+extern "C" exr_result_t
+kdu_compress(exr_encode_pipeline_t *encode)
+{
+    exrkdu_binding *binding = get_binding(encode->encoding_user_data);
+    exrkdu_session *session = binding ? binding->session : default_session();
+
+    if (!wants_stats(session))
+    {
+        exrkdu_chunk_stats_t stats;
+        return guarded_compress(session, binding, encode, stats);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    exrkdu_chunk_stats_t stats;
+    init_stats(stats, 1, encode->part_index, encode->chunk, encode->channel_count);
+
+    exr_result_t rv = guarded_compress(session, binding, encode, stats);
+
+    stats.packed_bytes = encode->packed_bytes;
+    stats.compressed_bytes = encode->compressed_bytes;
+    stats.result = rv;
+    record_stats(session, stats, start);
+
+    return rv;
+}
+
+/* replaces the OpenEXR pack pass when the chunk can be encoded straight from
+   the user buffers */
+
+static exr_result_t
+fused_pack(exr_encode_pipeline_t *encode)
+{
+    exrkdu_binding *binding = get_binding(encode->encoding_user_data);
+
+    if (binding == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    std::vector<CodestreamChannelInfo> cs_to_file_ch(encode->channel_count);
+    for (int i = 0; i < encode->channel_count; i++)
+        cs_to_file_ch[i].file_index = i;
+
+    std::vector<component_plane> planes;
+    binding->fused = has_uniform_type(encode->channels, encode->channel_count) &&
+                     make_user_planes(
+                         cs_to_file_ch, encode->channels, encode->chunk.width, encode->chunk.height, planes);
+
+    if (binding->fused)
+        return EXR_ERR_SUCCESS;
+
+    return binding->prev_pack_fn(encode);
+}
+
+/* checks the chunk header and the main header of the codestream, without
+   decoding any code-block */
+
+static exr_result_t
+validate_chunk(const exr_decode_pipeline_t *decode, const uint8_t *data, uint64_t size)
+{
+    if (size != decode->chunk.packed_size)
+        return EXR_ERR_CORRUPT_CHUNK;
+
+    /* chunk stored uncompressed */
+    if (size == decode->chunk.unpacked_size)
+        return EXR_ERR_SUCCESS;
+
+    if (!has_uniform_type(decode->channels, decode->channel_count))
+        return EXR_ERR_FEATURE_NOT_IMPLEMENTED;
+
+    std::vector<CodestreamChannelInfo> cs_to_file_ch(decode->channel_count);
+    size_t header_sz = read_header((uint8_t *)data, size, cs_to_file_ch);
+    if (decode->channel_count != cs_to_file_ch.size() || header_sz >= size)
+        return EXR_ERR_CORRUPT_CHUNK;
+
+    /* each channel is coded exactly once */
+    std::vector<bool> mapped(decode->channel_count, false);
+    for (const CodestreamChannelInfo &ch : cs_to_file_ch)
+    {
+        if (ch.file_index < 0 || ch.file_index >= decode->channel_count || mapped[ch.file_index])
+            return EXR_ERR_CORRUPT_CHUNK;
+        mapped[ch.file_index] = true;
+    }
+
+    exr_pixel_type_t type = (exr_pixel_type_t)decode->channels[0].data_type;
+    int max_precision = type == EXR_PIXEL_HALF ? 16 : 32;
+
+    kdu_compressed_source_buffered infile((kdu_byte *)data + header_sz, size - header_sz);
+
+    kdu_codestream cs;
+    exr_result_t rv = EXR_ERR_SUCCESS;
+
+    try
+    {
+        cs.create(&infile);
+
+        kdu_dims dims;
+        cs.get_dims(0, dims, false);
+        if (dims.size.x != decode->chunk.width || dims.size.y != decode->chunk.height ||
+            cs.get_num_components() != decode->channel_count)
+            rv = EXR_ERR_CORRUPT_CHUNK;
+
+        /* SIZ: reduced precisions are allowed, see adaptive_precision */
+        for (int c = 0; rv == EXR_ERR_SUCCESS && c < decode->channel_count; c++)
+        {
+            int precision = cs.get_bit_depth(c);
+            if (precision < 1 || precision > max_precision || cs.get_signed(c) != (type != EXR_PIXEL_UINT))
+                rv = EXR_ERR_CORRUPT_CHUNK;
+        }
+
+        /* COD: lossless HT block coding */
+        kdu_params *cod = cs.access_siz()->access_cluster(COD_params);
+        bool reversible = false;
+        int modes = 0;
+        if (rv == EXR_ERR_SUCCESS &&
+            (!cod->get(Creversible, 0, 0, reversible) || !reversible || !cod->get(Cmodes, 0, 0, modes) ||
+             !(modes & Cmodes_HT)))
+            rv = EXR_ERR_CORRUPT_CHUNK;
+
+        cs.destroy();
+    }
+    catch (...)
+    {
+        if (cs.exists())
+            cs.destroy();
+        throw;
+    }
+
+    return rv;
+}
+
+extern "C" exr_result_t
+exrkdu_validate_chunk(
+    exrkdu_session_t session, const exr_decode_pipeline_t *decode, const void *data, uint64_t size)
+{
+    if (decode == NULL || data == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    message_sink sink(session ? session : default_session());
+
+    try
+    {
+        return validate_chunk(decode, (const uint8_t *)data, size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (...)
+    {
+        return EXR_ERR_CORRUPT_CHUNK;
+    }
+}
+
+/* decodes a chunk at a resolution reduced by up to `discard_levels` DWT
+   levels to `out`, in the unpacked layout; returns the levels discarded */
+
+static int
+decode_reduced(
+    exrkdu_session *session,
+    const exr_decode_pipeline_t *decode,
+    const uint8_t *data,
+    uint64_t size,
+    int discard_levels,
+    uint8_t *out,
+    uint64_t out_size)
+{
+    /* a chunk stored uncompressed has no DWT */
+    if (size == decode->chunk.unpacked_size)
+    {
+        if (size > out_size)
+            throw std::range_error("Output buffer too small");
+        memcpy(out, data, size);
+        return 0;
+    }
+
+    if (!has_uniform_type(decode->channels, decode->channel_count))
+        throw std::runtime_error("Channels of different types");
+
+    std::vector<CodestreamChannelInfo> cs_to_file_ch(decode->channel_count);
+    size_t header_sz = read_header((void *)data, size, cs_to_file_ch);
+    if (header_sz >= size || cs_to_file_ch.size() != (size_t)decode->channel_count)
+        throw std::runtime_error("Corrupt chunk header");
+
+    for (size_t i = 0; i < cs_to_file_ch.size(); i++)
+    {
+        if (cs_to_file_ch[i].file_index < 0 || cs_to_file_ch[i].file_index >= decode->channel_count)
+            throw std::runtime_error("Corrupt chunk header");
+    }
+
+    /* chunks with fewer DWT levels are reduced as far as they go */
+    {
+        kdu_compressed_source_buffered infile((kdu_byte *)data + header_sz, size - header_sz);
+        kdu_codestream cs;
+        try
+        {
+            cs.create(&infile);
+            discard_levels = std::min(discard_levels, cs.get_min_dwt_levels());
+        }
+        catch (...)
+        {
+            if (cs.exists())
+                cs.destroy();
+            throw;
+        }
+        cs.destroy();
+    }
+
+    int width = (decode->chunk.width + (1 << discard_levels) - 1) >> discard_levels;
+    int height = (decode->chunk.height + (1 << discard_levels) - 1) >> discard_levels;
+    if ((uint64_t)width * height * decode->channel_count * decode->channels[0].bytes_per_element > out_size)
+        throw std::range_error("Output buffer too small");
+
+    std::vector<component_plane> planes;
+    make_packed_planes(out, cs_to_file_ch, decode->channels, decode->channel_count, width, planes);
+
+    std::vector<int> components;
+    for (size_t i = 0; i < planes.size(); i++)
+        components.push_back((int)i);
+
+    session_env env(session, NULL);
+
+    decode_components(
+        env.get(), data + header_sz, size - header_sz, components, planes, decode->channel_count,
+        decode->channels[0].data_type == EXR_PIXEL_HALF, decode->chunk.width, decode->chunk.height, discard_levels);
+
+    env.done();
+
+    return discard_levels;
+}
+
+extern "C" exr_result_t
+exrkdu_decode_reduced(
+    exrkdu_session_t session,
+    const exr_decode_pipeline_t *decode,
+    const void *data,
+    uint64_t size,
+    int discard_levels,
+    void *out,
+    uint64_t out_size,
+    int *discarded)
+{
+    if (decode == NULL || data == NULL || out == NULL || discarded == NULL || discard_levels < 0)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    exrkdu_session *s = session ? session : default_session();
+    message_sink sink(s);
+
+    try
+    {
+        *discarded = decode_reduced(s, decode, (const uint8_t *)data, size, discard_levels, (uint8_t *)out, out_size);
+        return EXR_ERR_SUCCESS;
+    }
+    catch (const std::range_error &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (...)
+    {
+        return EXR_ERR_CORRUPT_CHUNK;
+    }
+}
+
+/* sets the coding parameters of a proxy codestream to those of a chunk, with
+   `discard_levels` fewer DWT levels, so that its code-blocks are those of the
+   remaining resolutions of the chunk */
+
+static void
+copy_coding_params(kdu_codestream &in, kdu_codestream &out, int discard_levels)
+{
+    kdu_params *cod_in = in.access_siz()->access_cluster(COD_params);
+
+    bool reversible = false, ycc = false, use_precincts = false;
+    int order = 0, modes = 0, blk_height = 0, blk_width = 0, levels = 0;
+    if (!cod_in->get(Creversible, 0, 0, reversible) || !reversible || !cod_in->get(Cmodes, 0, 0, modes) ||
+        !(modes & Cmodes_HT) || !cod_in->get(Clevels, 0, 0, levels) || levels < discard_levels ||
+        !cod_in->get(Corder, 0, 0, order) || !cod_in->get(Cblk, 0, 0, blk_height) ||
+        !cod_in->get(Cblk, 0, 1, blk_width) || (cod_in->get(Cuse_precincts, 0, 0, use_precincts) && use_precincts))
+        throw std::runtime_error("Unsupported coding parameters");
+    cod_in->get(Cycc, 0, 0, ycc);
+
+    out.set_disabled_auto_comments(0xFFFFFFFF);
+
+    kdu_params *cod = out.access_siz()->access_cluster(COD_params);
+    cod->set(Creversible, 0, 0, true);
+    cod->set(Corder, 0, 0, order);
+    cod->set(Cmodes, 0, 0, modes);
+    cod->set(Cblk, 0, 0, blk_height);
+    cod->set(Cblk, 0, 1, blk_width);
+    cod->set(Clevels, 0, 0, levels - discard_levels);
+    cod->set(Cycc, 0, 0, ycc);
+
+    int nltype;
+    kdu_params *nlt_in = in.access_siz()->access_cluster(NLT_params);
+    if (nlt_in != NULL && nlt_in->get(NLType, 0, 0, nltype))
+        out.access_siz()->access_cluster(NLT_params)->set(NLType, 0, 0, nltype);
+
+    out.access_siz()->finalize_all();
+}
+
+/* reduces chunks in the compressed domain, as kdu_transcode does with
+   -reduce, and stacks them as the tile rows of a single codestream; returns
+   the size of the proxy chunk */
+
+static size_t
+proxy_chunks(
+    const uint8_t *const *chunks,
+    const uint64_t *sizes,
+    int count,
+    int discard_levels,
+    uint8_t *out,
+    size_t out_capacity)
+{
+    if (count < 1 || discard_levels < 1)
+        throw std::invalid_argument("Invalid proxy");
+
+    /* the chunk header, i.e. the channel map, is that of all chunks */
+    std::vector<CodestreamChannelInfo> cs_to_file_ch;
+    size_t header_sz = read_header((void *)chunks[0], sizes[0], cs_to_file_ch);
+    if (header_sz >= sizes[0] || header_sz > out_capacity)
+        throw std::runtime_error("Corrupt chunk header");
+    for (int i = 1; i < count; i++)
+    {
+        if (sizes[i] <= header_sz || memcmp(chunks[i], chunks[0], header_sz) != 0)
+            throw std::runtime_error("Chunks with different channel maps");
+    }
+    memcpy(out, chunks[0], header_sz);
+
+    std::vector<kdu_compressed_source_buffered *> sources;
+    std::vector<kdu_codestream> inputs(count);
+    kdu_codestream merged;
+    mem_compressed_target target(out + header_sz, out_capacity - header_sz);
+
+    try
+    {
+        int width = 0, height = 0, row_height = 0, tile_columns = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            sources.push_back(
+                new kdu_compressed_source_buffered((kdu_byte *)chunks[i] + header_sz, sizes[i] - header_sz));
+            inputs[i].create(sources[i]);
+            if (inputs[i].get_min_dwt_levels() < discard_levels)
+                throw std::runtime_error("Not enough DWT levels");
+            inputs[i].apply_input_restrictions(0, 0, discard_levels, 0, NULL, KDU_WANT_CODESTREAM_COMPONENTS);
+
+            kdu_dims dims, tiles;
+            inputs[i].get_dims(0, dims, false);
+            inputs[i].get_valid_tiles(tiles);
+            if (i == 0)
+            {
+                width = dims.size.x;
+                row_height = dims.size.y;
+                tile_columns = tiles.size.x;
+            }
+            if (dims.size.x != width || (i < count - 1 && dims.size.y != row_height) || dims.size.y > row_height ||
+                tiles.size.x != tile_columns || tiles.size.y != 1)
+                throw std::runtime_error("Incompatible chunks");
+            height += dims.size.y;
+        }
+
+        /* the reduced chunks are the rows of tiles */
+        siz_params siz;
+        siz.copy_from(inputs[0].access_siz(), -1, -1, -1, 0, discard_levels, false, false, false);
+        int tile_width;
+        if (!siz.get(Stiles, 0, 1, tile_width))
+            tile_width = width;
+        siz.set(Sdims, 0, 0, height);
+        siz.set(Stiles, 0, 0, row_height);
+        siz.set(Stiles, 0, 1, tile_width);
+        static_cast<kdu_params &>(siz).finalize();
+
+        merged.create(&siz, &target);
+        copy_coding_params(inputs[0], merged, discard_levels);
+
+        kdu_dims tiles_out;
+        merged.get_valid_tiles(tiles_out);
+        if (tiles_out.size.y != count || tiles_out.size.x != tile_columns)
+            throw std::runtime_error("Incompatible chunks");
+
+        for (int i = 0; i < count; i++)
+        {
+            kdu_dims tiles_in;
+            inputs[i].get_valid_tiles(tiles_in);
+
+            for (int x = 0; x < tile_columns; x++)
+            {
+                kdu_tile tile_in = inputs[i].open_tile(tiles_in.pos + kdu_coords(x, 0));
+                kdu_tile tile_out = merged.open_tile(tiles_out.pos + kdu_coords(x, i));
+                copy_tile_components(tile_in, 0, tile_out, 0, tile_out.get_num_components());
+                tile_in.close();
+                tile_out.close();
+            }
+        }
+
+        merged.trans_out();
+    }
+    catch (...)
+    {
+        if (merged.exists())
+            merged.destroy();
+        for (kdu_codestream &cs : inputs)
+            if (cs.exists())
+                cs.destroy();
+        for (kdu_compressed_source_buffered *source : sources)
+            delete source;
+        throw;
+    }
+
+    merged.destroy();
+    for (kdu_codestream &cs : inputs)
+        cs.destroy();
+    for (kdu_compressed_source_buffered *source : sources)
+        delete source;
+
+    return header_sz + target.get_size();
+}
+
+extern "C" exr_result_t
+exrkdu_proxy_chunks(
+    exrkdu_session_t session,
+    const void *const *chunks,
+    const uint64_t *sizes,
+    int count,
+    int discard_levels,
+    void *out,
+    uint64_t out_capacity,
+    uint64_t *out_size)
+{
+    if (chunks == NULL || sizes == NULL || out == NULL || out_size == NULL || count < 1 || discard_levels < 1)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    message_sink sink(session ? session : default_session());
+
+    try
+    {
+        *out_size = proxy_chunks(
+            (const uint8_t *const *)chunks, sizes, count, discard_levels, (uint8_t *)out, (size_t)out_capacity);
+        return EXR_ERR_SUCCESS;
+    }
+    catch (const std::range_error &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return EXR_ERR_OUT_OF_MEMORY;
+    }
+    catch (...)
+    {
+        return EXR_ERR_CORRUPT_CHUNK;
+    }
+}
+
+extern "C" void
+exrkdu_config_init(exrkdu_config_t *config)
+{
+    config->num_threads = 0;
+    config->fused_decode = 0;
+    config->fused_encode = 0;
+    config->constant_chunks = 1;
+    config->channel_groups = 0;
+    config->tile_width = 0;
+    config->adaptive_precision = 0;
+    config->collect_metrics = 0;
+    config->chunk_fn = NULL;
+    config->chunk_user_data = NULL;
+    config->message_fn = NULL;
+    config->message_user_data = NULL;
+}
+
+extern "C" exr_result_t
+exrkdu_session_create(exrkdu_session_t *session, const exrkdu_config_t *config)
+{
+    if (session == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    exrkdu_session *s = new (std::nothrow) exrkdu_session;
+    if (s == NULL)
+        return EXR_ERR_OUT_OF_MEMORY;
+
+    if (config != NULL)
+        s->config = *config;
+
+    *session = s;
+
+    return EXR_ERR_SUCCESS;
+}
+
+extern "C" void
+exrkdu_session_get_config(exrkdu_session_t session, exrkdu_config_t *config)
+{
+    *config = (session ? session : default_session())->config;
+}
+
+extern "C" void
+exrkdu_session_destroy(exrkdu_session_t session)
+{
+    if (session == NULL)
+        return;
+
+    for (auto &idle : session->idle_envs)
+        destroy_env(idle.second);
+
+    delete session;
+}
+
+extern "C" exr_result_t
+exrkdu_install_decoder(exrkdu_session_t session, exr_decode_pipeline_t *decode)
+{
+    if (session == NULL || decode == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    exrkdu_binding *binding = get_binding(decode->decoding_user_data);
+
+    if (binding == NULL)
+    {
+        binding = new (std::nothrow) exrkdu_binding;
+        if (binding == NULL)
+            return EXR_ERR_OUT_OF_MEMORY;
+
+        binding->magic = EXRKDU_BINDING_MAGIC;
+        binding->prev_user_data = decode->decoding_user_data;
+        binding->num_threads = 0;
+        binding->prev_decompress_fn = decode->decompress_fn;
+        binding->prev_unpack_fn = decode->unpack_and_convert_fn;
+    }
+
+    binding->session = session;
+    binding->fused = false;
+
+    decode->decoding_user_data = binding;
+    decode->decompress_fn = kdu_decompress;
+    decode->unpack_and_convert_fn =
+        session->config.fused_decode ? fused_unpack : binding->prev_unpack_fn;
+
+    return EXR_ERR_SUCCESS;
+}
+
+extern "C" void
+exrkdu_uninstall_decoder(exr_decode_pipeline_t *decode)
+{
+    exrkdu_binding *binding = get_binding(decode->decoding_user_data);
+
+    if (binding == NULL)
+        return;
+
+    decode->decoding_user_data = binding->prev_user_data;
+    decode->decompress_fn = binding->prev_decompress_fn;
+    decode->unpack_and_convert_fn = binding->prev_unpack_fn;
+
+    binding->magic = 0;
+    delete binding;
+}
+
+extern "C" exr_result_t
+exrkdu_install_encoder(exrkdu_session_t session, exr_encode_pipeline_t *encode)
+{
+    if (session == NULL || encode == NULL)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    exrkdu_binding *binding = get_binding(encode->encoding_user_data);
+
+    if (binding == NULL)
+    {
+        binding = new (std::nothrow) exrkdu_binding;
+        if (binding == NULL)
+            return EXR_ERR_OUT_OF_MEMORY;
+
+        binding->magic = EXRKDU_BINDING_MAGIC;
+        binding->prev_user_data = encode->encoding_user_data;
+        binding->num_threads = 0;
+        binding->prev_compress_fn = encode->compress_fn;
+        binding->prev_pack_fn = encode->convert_and_pack_fn;
+    }
+
+    binding->session = session;
+    binding->fused = false;
+
+    encode->encoding_user_data = binding;
+    encode->compress_fn = kdu_compress;
+    encode->convert_and_pack_fn =
+        session->config.fused_encode && binding->prev_pack_fn ? fused_pack : binding->prev_pack_fn;
+
+    return EXR_ERR_SUCCESS;
+}
+
+extern "C" exr_result_t
+exrkdu_set_decoder_threads(exr_decode_pipeline_t *decode, int num_threads)
+{
+    exrkdu_binding *binding = decode ? get_binding(decode->decoding_user_data) : NULL;
+
+    if (binding == NULL || num_threads < 0)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    binding->num_threads = num_threads;
+
+    return EXR_ERR_SUCCESS;
+}
+
+extern "C" exr_result_t
+exrkdu_set_encoder_threads(exr_encode_pipeline_t *encode, int num_threads)
+{
+    exrkdu_binding *binding = encode ? get_binding(encode->encoding_user_data) : NULL;
+
+    if (binding == NULL || num_threads < 0)
+        return EXR_ERR_INVALID_ARGUMENT;
+
+    binding->num_threads = num_threads;
+
+    return EXR_ERR_SUCCESS;
+}
+
+extern "C" void
+exrkdu_uninstall_encoder(exr_encode_pipeline_t *encode)
+{
+    exrkdu_binding *binding = get_binding(encode->encoding_user_data);
+
+    if (binding == NULL)
+        return;
+
+    encode->encoding_user_data = binding->prev_user_data;
+    encode->compress_fn = binding->prev_compress_fn;
+    encode->convert_and_pack_fn = binding->prev_pack_fn;
+
+    binding->magic = 0;
+    delete binding;
+}
+
+extern "C" size_t
+exrkdu_session_get_metrics(exrkdu_session_t session, exrkdu_chunk_stats_t *stats, size_t max_count)
+{
+    std::lock_guard<std::mutex> lock(session->metrics_mutex);
+
+    size_t count = std::min(max_count, session->metrics.size());
+    if (stats != NULL && count > 0)
+        memcpy(stats, session->metrics.data(), count * sizeof(exrkdu_chunk_stats_t));
+
+    return session->metrics.size();
+}
+
+extern "C" void
+exrkdu_session_reset_metrics(exrkdu_session_t session)
+{
+    std::lock_guard<std::mutex> lock(session->metrics_mutex);
+    session->metrics.clear();
+}
+
+extern "C" exr_result_t
+exrkdu_session_write_metrics_csv(exrkdu_session_t session, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return EXR_ERR_FILE_ACCESS;
+
+    fprintf(f, "op,part,x,y,width,height,channels,packed_bytes,compressed_bytes,duration_ns,raw_fallback,constant,result\n");
+
+    {
+        std::lock_guard<std::mutex> lock(session->metrics_mutex);
+
+        for (const exrkdu_chunk_stats_t &s : session->metrics)
+        {
+            fprintf(
+                f,
+                "%s,%d,%d,%d,%d,%d,%d,%llu,%llu,%llu,%d,%d,%d\n",
+                s.is_encode ? "encode" : "decode",
+                s.part_index,
+                s.start_x,
+                s.start_y,
+                s.width,
+                s.height,
+                s.channel_count,
+                (unsigned long long)s.packed_bytes,
+                (unsigned long long)s.compressed_bytes,
+                (unsigned long long)s.duration_ns,
+                s.raw_fallback,
+                s.constant,
+                s.result);
+        }
+    }
+
+    return fclose(f) == 0 ? EXR_ERR_SUCCESS : EXR_ERR_WRITE_IO;
+}
+
+/* Prometheus text exposition format, written to a temporary file and renamed
+   so that a textfile collector never sees a partial file */
+
+static const double duration_buckets[] = {1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 1e-1, 5e-1, 1.0};
+
+#define DURATION_BUCKET_COUNT (sizeof(duration_buckets) / sizeof(duration_buckets[0]))
+
+struct op_totals
+{
+    uint64_t chunks;
+    uint64_t raw_fallbacks;
+    uint64_t constants;
+    uint64_t errors;
+    uint64_t packed_bytes;
+    uint64_t compressed_bytes;
+    double duration_sum;
+    uint64_t buckets[DURATION_BUCKET_COUNT];
+};
+
+extern "C" exr_result_t
+exrkdu_session_write_metrics_prometheus(exrkdu_session_t session, const char *path)
+{
+    op_totals totals[2];
+    memset(totals, 0, sizeof(totals));
+
+    {
+        std::lock_guard<std::mutex> lock(session->metrics_mutex);
+
+        for (const exrkdu_chunk_stats_t &s : session->metrics)
+        {
+            op_totals &t = totals[s.is_encode ? 1 : 0];
+            double duration = s.duration_ns * 1e-9;
+
+            t.chunks++;
+            t.raw_fallbacks += s.raw_fallback ? 1 : 0;
+            t.constants += s.constant;
+            t.errors += s.result != EXR_ERR_SUCCESS ? 1 : 0;
+            t.packed_bytes += s.packed_bytes;
+            t.compressed_bytes += s.compressed_bytes;
+            t.duration_sum += duration;
+            for (size_t i = 0; i < DURATION_BUCKET_COUNT; i++)
+            {
+                if (duration <= duration_buckets[i])
+                    t.buckets[i]++;
+            }
+        }
+    }
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (f == NULL)
+        return EXR_ERR_FILE_ACCESS;
+
+    static const char *ops[2] = {"decode", "encode"};
+
+    struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"exrkdu_chunks_total", "Chunks processed by the codec", offsetof(op_totals, chunks)},
+        {"exrkdu_chunk_raw_fallbacks_total", "Chunks stored uncompressed", offsetof(op_totals, raw_fallbacks)},
+        {"exrkdu_constant_components_total", "Constant components coded or filled in from their LL band", offsetof(op_totals, constants)},
+        {"exrkdu_chunk_errors_total", "Chunks that failed", offsetof(op_totals, errors)},
+        {"exrkdu_packed_bytes_total", "Uncompressed chunk bytes", offsetof(op_totals, packed_bytes)},
+        {"exrkdu_compressed_bytes_total", "Compressed chunk bytes", offsetof(op_totals, compressed_bytes)},
+    };
+
+    for (const auto &c : counters)
+    {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", c.name, c.help, c.name);
+        for (int op = 0; op < 2; op++)
+        {
+            uint64_t value = *(const uint64_t *)((const char *)&totals[op] + c.offset);
+            fprintf(f, "%s{op=\"%s\"} %llu\n", c.name, ops[op], (unsigned long long)value);
+        }
+    }
+
+    fprintf(
+        f,
+        "# HELP exrkdu_chunk_duration_seconds Time spent coding a chunk\n"
+        "# TYPE exrkdu_chunk_duration_seconds histogram\n");
+    for (int op = 0; op < 2; op++)
+    {
+        for (size_t i = 0; i < DURATION_BUCKET_COUNT; i++)
+        {
+            fprintf(
+                f,
+                "exrkdu_chunk_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                ops[op],
+                duration_buckets[i],
+                (unsigned long long)totals[op].buckets[i]);
+        }
+        fprintf(
+            f,
+            "exrkdu_chunk_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+            ops[op],
+            (unsigned long long)totals[op].chunks);
+        fprintf(f, "exrkdu_chunk_duration_seconds_sum{op=\"%s\"} %.9f\n", ops[op], totals[op].duration_sum);
+        fprintf(
+            f,
+            "exrkdu_chunk_duration_seconds_count{op=\"%s\"} %llu\n",
+            ops[op],
+            (unsigned long long)totals[op].chunks);
+    }
+
+    if (fclose(f) != 0)
+        return EXR_ERR_WRITE_IO;
+
+    if (rename(tmp_path.c_str(), path) != 0)
+        return EXR_ERR_FILE_ACCESS;
+
+    return EXR_ERR_SUCCESS;
 }
@@ -33,11 +33,242 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "openexr_decode.h"
 #include "openexr_encode.h"
 
-extern "C" exr_result_t
+#if defined(_WIN32) && defined(EXRKDU_DLL)
+#  ifdef EXRKDU_EXPORTS
+#    define EXRKDU_EXPORT __declspec(dllexport)
+#  else
+#    define EXRKDU_EXPORT __declspec(dllimport)
+#  endif
+#elif defined(EXRKDU_EXPORTS) && !defined(_WIN32)
+#  define EXRKDU_EXPORT __attribute__((visibility("default")))
+#else
+#  define EXRKDU_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Record of a single compress/decompress call */
+typedef struct
+{
+    int is_encode;
+    int part_index;
+    int start_x;
+    int start_y;
+    int width;
+    int height;
+    int channel_count;
+    /* size of the chunk in the OpenEXR packed (uncompressed) layout */
+    uint64_t packed_bytes;
+    /* size of the chunk as stored in the file */
+    uint64_t compressed_bytes;
+    /* start time, in nanoseconds of the monotonic clock used by
+       std::chrono::steady_clock */
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    /* the chunk is stored uncompressed because the codestream did not fit */
+    int raw_fallback;
+    /* components of the chunk found constant, and therefore coded or filled
+       in from their LL band alone */
+    int constant;
+    exr_result_t result;
+} exrkdu_chunk_stats_t;
+
+/* Codec configuration shared by all the pipelines attached to a session */
+typedef struct
+{
+    /* number of KDU threads used by each compress/decompress call, including
+       the calling thread; values < 2 run KDU single-threaded */
+    int num_threads;
+
+    /* when non-zero, decoded samples are written directly to the
+       `decode_to_ptr` buffers, bypassing the OpenEXR unpack pass, whenever no
+       type conversion or line skipping is requested */
+    int fused_decode;
+
+    /* when non-zero, samples are read directly from the `encode_from_ptr`
+       buffers, bypassing the OpenEXR pack pass, under the same conditions;
+       the packed buffer is only filled for chunks stored uncompressed */
+    int fused_encode;
+
+    /* when non-zero (default), constant components of a chunk, e.g. an opaque
+       alpha, are coded from their LL band alone, without the DWT of the chunk,
+       and components whose code-blocks are empty outside the LL band are
+       filled in instead of decoded if that band is constant */
+    int constant_chunks;
+
+    /* when non-zero, the channels of a chunk are split in groups by layer name
+       prefix (e.g. "diffuse.*"), which are coded in turn as separate
+       codestreams, each on the KDU threads of the chunk, and merged into the
+       single codestream of the chunk by code-block copy; no thread is started
+       beyond those of the chunk. Decoding is unaffected. */
+    int channel_groups;
+
+    /* when > 0, the codestream of a chunk wider than `tile_width` is split in
+       tiles of that width, which are coded and decoded concurrently when
+       `num_threads` > 1; any HTJ2K decoder reads such codestreams */
+    int tile_width;
+
+    /* when non-zero, each component is declared with the smallest precision
+       that holds its samples exactly, e.g. 9 bits for a UINT ID channel with
+       500 IDs, which saves bit-planes and block coding work; components with
+       negative half/float samples keep the full precision */
+    int adaptive_precision;
+
+    /* when non-zero, the session records an exrkdu_chunk_stats_t for every
+       chunk it codes */
+    int collect_metrics;
+
+    /* optional callback invoked after every chunk, on the thread that coded it,
+       e.g. to build a timeline */
+    void (*chunk_fn) (void* user_data, const exrkdu_chunk_stats_t* stats);
+    void* chunk_user_data;
+
+    /* optional callback receiving KDU error (is_error != 0) and warning
+       messages; it is called on the thread running the codec, possibly
+       concurrently */
+    void (*message_fn) (void* user_data, int is_error, const char* message);
+    void* message_user_data;
+} exrkdu_config_t;
+
+/* Codec session, which holds the configuration and the state (e.g. KDU thread
+   environments) reused across chunks. Idle KDU threads beyond the number of
+   hardware threads are destroyed, least recently used first. A session may be
+   shared by any number of pipelines. */
+typedef struct exrkdu_session* exrkdu_session_t;
+
+EXRKDU_EXPORT void
+exrkdu_config_init (exrkdu_config_t* config);
+
+EXRKDU_EXPORT exr_result_t
+exrkdu_session_create (exrkdu_session_t* session, const exrkdu_config_t* config);
+
+/* The session must outlive every pipeline it is installed on */
+EXRKDU_EXPORT void
+exrkdu_session_destroy (exrkdu_session_t session);
+
+/* Copies the configuration of the session, or of the default session used by
+   pipelines installed with a NULL session */
+EXRKDU_EXPORT void
+exrkdu_session_get_config (exrkdu_session_t session, exrkdu_config_t* config);
+
+/* Copies up to max_count records and returns the number of records held by the
+   session */
+EXRKDU_EXPORT size_t
+exrkdu_session_get_metrics (
+    exrkdu_session_t session, exrkdu_chunk_stats_t* stats, size_t max_count);
+
+EXRKDU_EXPORT void
+exrkdu_session_reset_metrics (exrkdu_session_t session);
+
+/* Writes one CSV row per recorded chunk */
+EXRKDU_EXPORT exr_result_t
+exrkdu_session_write_metrics_csv (exrkdu_session_t session, const char* path);
+
+/* Writes totals and duration histograms in the Prometheus text format, e.g. for
+   the node exporter textfile collector; the file is replaced atomically */
+EXRKDU_EXPORT exr_result_t
+exrkdu_session_write_metrics_prometheus (
+    exrkdu_session_t session, const char* path);
+
+/* Installs the session as `decompress_fn` of the pipeline. Must be called after
+   exr_decoding_choose_default_routines(). */
+EXRKDU_EXPORT exr_result_t
+exrkdu_install_decoder (exrkdu_session_t session, exr_decode_pipeline_t* decode);
+
+/* Restores the routines replaced by exrkdu_install_decoder(). Must be called
+   before exr_decoding_destroy(). */
+EXRKDU_EXPORT void
+exrkdu_uninstall_decoder (exr_decode_pipeline_t* decode);
+
+/* Installs the session as `compress_fn` of the pipeline. Must be called after
+   exr_encoding_choose_default_routines(). */
+EXRKDU_EXPORT exr_result_t
+exrkdu_install_encoder (exrkdu_session_t session, exr_encode_pipeline_t* encode);
+
+/* Restores the routines replaced by exrkdu_install_encoder(). Must be called
+   before exr_encoding_destroy(). */
+EXRKDU_EXPORT void
+exrkdu_uninstall_encoder (exr_encode_pipeline_t* encode);
+
+/* Overrides `num_threads` of the session for the chunks coded by an installed
+   pipeline, e.g. to give more KDU threads to the last chunks of a part when
+   fewer chunks are in flight; 0 reverts to the session setting. */
+EXRKDU_EXPORT exr_result_t
+exrkdu_set_decoder_threads (exr_decode_pipeline_t* decode, int num_threads);
+
+EXRKDU_EXPORT exr_result_t
+exrkdu_set_encoder_threads (exr_encode_pipeline_t* encode, int num_threads);
+
+/* Checks, without decoding any sample, that a chunk compressed with HTJ2K can
+   be decoded to the channels of `decode`, as set by exr_decoding_initialize():
+   the chunk header maps each channel to one codestream component, and the
+   SIZ and COD segments of the codestream declare the chunk dimensions, the
+   precision and signedness of the pixel type, and reversible HT block coding.
+   Returns EXR_ERR_CORRUPT_CHUNK otherwise. `session` may be NULL. */
+EXRKDU_EXPORT exr_result_t
+exrkdu_validate_chunk (
+    exrkdu_session_t session,
+    const exr_decode_pipeline_t* decode,
+    const void* data,
+    uint64_t size);
+
+/* Decodes a chunk compressed with HTJ2K, read with exr_read_chunk(), at a
+   resolution reduced by 2^discard_levels in each dimension, i.e. the low-pass
+   band of its highest `discard_levels` DWT levels, which skips the synthesis of
+   those levels. A chunk with fewer DWT levels is reduced as far as it goes,
+   and one stored uncompressed is copied as is; the levels actually discarded,
+   d, are returned in `discarded`. The samples are written to `out` in the
+   unpacked layout of the pipeline, each of the ceil(height / 2^d) lines holding
+   ceil(width / 2^d) samples of every channel in turn. Returns
+   EXR_ERR_OUT_OF_MEMORY if they do not fit in `out_size` bytes. `session` may be
+   NULL. */
+EXRKDU_EXPORT exr_result_t
+exrkdu_decode_reduced (
+    exrkdu_session_t session,
+    const exr_decode_pipeline_t* decode,
+    const void* data,
+    uint64_t size,
+    int discard_levels,
+    void* out,
+    uint64_t out_size,
+    int* discarded);
+
+/* Rewrites `count` consecutive chunks of a part compressed with HTJ2K as one
+   chunk of a proxy of the part, smaller by 2^discard_levels in each dimension,
+   without decoding any sample: the highest `discard_levels` DWT levels of each
+   chunk are dropped and the code-blocks of the remaining resolutions are
+   copied, each chunk becoming a row of tiles of the proxy chunk. The chunks
+   must share their channel map, width and coding parameters, and all but the
+   last one their height. The proxy chunk, of at most `out_capacity` bytes, is
+   written to `out`; returns EXR_ERR_OUT_OF_MEMORY if it does not fit and
+   EXR_ERR_CORRUPT_CHUNK if the chunks cannot be rewritten, e.g. if they are
+   stored uncompressed. `session` may be NULL. */
+EXRKDU_EXPORT exr_result_t
+exrkdu_proxy_chunks (
+    exrkdu_session_t session,
+    const void* const* chunks,
+    const uint64_t* sizes,
+    int count,
+    int discard_levels,
+    void* out,
+    uint64_t out_capacity,
+    uint64_t* out_size);
+
+/* Raw codec entry points. When installed directly (without a session), the
+   pipeline user data must be NULL and a process-wide default session is used.
+   KDU errors are reported as EXR_ERR_CORRUPT_CHUNK (decoding) or
+   EXR_ERR_UNKNOWN (encoding). */
+
+EXRKDU_EXPORT exr_result_t
 kdu_decompress (exr_decode_pipeline_t* decode);
 
-extern "C" exr_result_t
+EXRKDU_EXPORT exr_result_t
 kdu_compress (exr_encode_pipeline_t* encode);
 
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
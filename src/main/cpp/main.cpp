@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <string>
 #include <map>
 #include <chrono>
@@ -8,12 +9,11 @@
 
 #include <openexr.h>
 #include "kdu.h"
+#include "trace.h"
+#include "transcode.h"
 
 #include "cxxopts.hpp"
 
-#define MAX_CHANNEL_COUNT 32
-#define MAX_PART_COUNT 128
-
 void dif(exr_result_t r)
 {
     if (r != EXR_ERR_SUCCESS)
@@ -23,6 +23,22 @@ void dif(exr_result_t r)
     }
 }
 
+void print_kdu_message(void *user_data, int is_error, const char *message)
+{
+    std::cerr << (is_error ? "KDU error: " : "KDU warning: ") << message << std::endl;
+}
+
+void trace_kdu_chunk(void *user_data, const exrkdu_chunk_stats_t *stats)
+{
+    std::string args = "\"part\":" + std::to_string(stats->part_index) +
+                       ",\"y\":" + std::to_string(stats->start_y) +
+                       ",\"compressed_bytes\":" + std::to_string(stats->compressed_bytes) +
+                       ",\"raw_fallback\":" + std::to_string(stats->raw_fallback);
+
+    tracer.add(
+        stats->is_encode ? "kdu_compress" : "kdu_decompress", "codec", stats->start_ns, stats->duration_ns, args);
+}
+
 int main(int argc, char *argv[])
 {
     cxxopts::Options options(
@@ -31,7 +47,28 @@ int main(int argc, char *argv[])
     options.add_options()(
         "ipath", "Input image path", cxxopts::value<std::string>())(
         "epath", "Encoded image path", cxxopts::value<std::string>())(
-        "d,default", "Use the default HTJ2K decoder", cxxopts::value<bool>()->default_value("false"));
+        "d,default", "Use the default HTJ2K decoder", cxxopts::value<bool>()->default_value("false"))(
+        "t,threads", "Number of KDU threads per chunk, 0 to let the scheduler decide", cxxopts::value<int>()->default_value("0"))(
+        "cores", "Number of cores to use, 0 for all available to the process", cxxopts::value<int>()->default_value("0"))(
+        "channel-groups", "Code the channels of each layer as a separate group", cxxopts::value<bool>()->default_value("false"))(
+        "tile-width", "Split the codestream of each chunk in tiles of this width, 0 for no tiling", cxxopts::value<int>()->default_value("0"))(
+        "adaptive-precision", "Declare each component with the precision of its actual samples", cxxopts::value<bool>()->default_value("false"))(
+        "write-buffer", "Coalesce the output writes in buffers of this many MiB, 0 to write each chunk", cxxopts::value<int>()->default_value(DEFAULT_WRITE_BUFFER_MIB))(
+        "preallocate", "Preallocate the output to an estimate of its size", cxxopts::value<bool>()->default_value("false"))(
+        "direct-io", "Write the output with O_DIRECT, bypassing the page cache", cxxopts::value<bool>()->default_value("false"))(
+        "io-threads", "Code each part to memory first, then write it with this many threads, 0 to write chunks as they are coded", cxxopts::value<int>()->default_value("0"))(
+        "passthrough", "Copy the chunks of parts already compressed with HTJ2K unchanged", cxxopts::value<bool>()->default_value("false"))(
+        "validate", "Check the header and SIZ/COD of each copied chunk", cxxopts::value<bool>()->default_value("false"))(
+        "random-order", "Write the output with RANDOM_Y line order, each chunk as soon as it is coded", cxxopts::value<bool>()->default_value("false"))(
+        "previous", "Previous output, whose chunks are reused where the source is unchanged", cxxopts::value<std::string>())(
+        "cache-dir", "Directory of compressed chunks reused across runs", cxxopts::value<std::string>())(
+        "proxy", "Write a proxy of an HTJ2K input, smaller by 2^N in each dimension, without decoding it", cxxopts::value<int>())(
+        "mipmap", "Write a MIPMAP tiled image with tiles of this size from an HTJ2K input, its levels averaged in linear space", cxxopts::value<int>())(
+        "mipmap-dwt", "Decode the MIPMAP levels from the DWT of the input, which filters the bit patterns of HALF and FLOAT samples", cxxopts::value<bool>()->default_value("false"))(
+        "max-memory", "Limit the buffers alive at once to this many bytes, e.g. 8G", cxxopts::value<std::string>())(
+        "metrics", "Write per-chunk codec metrics to this path", cxxopts::value<std::string>())(
+        "metrics-format", "Metrics format: csv or prometheus", cxxopts::value<std::string>()->default_value("csv"))(
+        "trace", "Write a Chrome trace-event timeline to this path", cxxopts::value<std::string>());
 
     options.parse_positional({"ipath", "epath"});
 
@@ -48,302 +85,109 @@ int main(int argc, char *argv[])
     auto &src_fn = args["ipath"].as<std::string>();
     auto &enc_fn = args["epath"].as<std::string>();
 
-    exr_result_t r;
-
     /* decode mode */
 
     bool use_default_htj2k_decoder = args["default"].as<bool>();
 
-    /* source file */
+    /* codec session */
 
-    exr_context_t src_file;
-    dif(exr_start_read(&src_file, src_fn.c_str(), NULL));
+    exrkdu_config_t config;
+    exrkdu_config_init(&config);
+    config.fused_decode = 1;
+    config.fused_encode = 1;
+    config.message_fn = print_kdu_message;
+    config.channel_groups = args["channel-groups"].as<bool>();
+    config.tile_width = args["tile-width"].as<int>();
+    config.adaptive_precision = args["adaptive-precision"].as<bool>();
+    config.collect_metrics = args.count("metrics") > 0;
 
-    int partCount;
-    dif(exr_get_count(src_file, &partCount));
+    if (args.count("trace"))
+    {
+        tracer.enable();
+        config.chunk_fn = trace_kdu_chunk;
+    }
 
-    if (partCount > MAX_PART_COUNT)
+    auto &metrics_format = args["metrics-format"].as<std::string>();
+    if (metrics_format != "csv" && metrics_format != "prometheus")
     {
-        std::cout << "Max part count exceeded" << std::endl;
+        std::cout << options.help() << std::endl;
         exit(-1);
     }
 
-    /* encoded file */
-
-    exr_context_t enc_file;
-    dif(exr_start_write(&enc_file, enc_fn.c_str(), EXR_WRITE_FILE_DIRECTLY, NULL));
+    exrkdu_session_t session;
+    dif(exrkdu_session_create(&session, &config));
 
-    /* copy parts to the output file */
+    /* transcode and verify */
 
-    for (int part_id = 0; part_id < partCount; part_id++)
+    uint64_t max_memory = 0;
+    if (args.count("max-memory") && !parse_byte_size(args["max-memory"].as<std::string>(), max_memory))
     {
-        exr_storage_t stortype;
-        dif(exr_get_storage(src_file, part_id, &stortype));
-        if (stortype != EXR_STORAGE_SCANLINE)
-        {
-            std::cout << "Only supports scanline files" << std::endl;
-            exit(-1);
-        }
-
-        const char *pn = NULL;
-        exr_get_name(src_file, part_id, &pn);
-
-        int new_part_id = 0;
-        dif(exr_add_part(enc_file, pn, EXR_STORAGE_SCANLINE, &new_part_id));
-
-        if (new_part_id != part_id)
-        {
-            std::cout << "Part index mismatch" << std::endl;
-            exit(-1);
-        }
-
-        dif(exr_copy_unset_attributes(enc_file, part_id, src_file, part_id));
-        dif(exr_set_compression(enc_file, part_id, EXR_COMPRESSION_HTJ2K));
+        std::cout << options.help() << std::endl;
+        exit(-1);
     }
-    dif(exr_write_header(enc_file));
-
-    /* baseband buffers */
-
-    uint8_t *baseband_bufs[MAX_PART_COUNT] = {NULL};
-
-    /* generated encoded file */
-
-    for (int part_id = 0; part_id < partCount; part_id++)
+    memory_budget budget(max_memory);
+
+    transcode_options transcode_opts = {};
+    transcode_opts.cores = args["cores"].as<int>();
+    transcode_opts.kdu_threads = args["threads"].as<int>();
+    transcode_opts.verify = true;
+    transcode_opts.default_decoder = use_default_htj2k_decoder;
+    transcode_opts.write_buffer = (size_t)std::max(args["write-buffer"].as<int>(), 0) << 20;
+    transcode_opts.preallocate = args["preallocate"].as<bool>();
+    transcode_opts.direct_io = args["direct-io"].as<bool>();
+    transcode_opts.io_threads = args["io-threads"].as<int>();
+    transcode_opts.passthrough = args["passthrough"].as<bool>();
+    transcode_opts.validate = args["validate"].as<bool>();
+    transcode_opts.random_order = args["random-order"].as<bool>();
+    if (args.count("previous"))
+        transcode_opts.previous = args["previous"].as<std::string>();
+    if (args.count("cache-dir"))
+        transcode_opts.cache_dir = args["cache-dir"].as<std::string>();
+    transcode_opts.budget = &budget;
+
+    try
     {
-        exr_attr_box2i_t dw;
-        dif(exr_get_data_window(src_file, part_id, &dw));
-        int width = dw.max.x - dw.min.x + 1;
-        int height = dw.max.y - dw.min.y + 1;
-
-        const exr_attr_chlist_t *channels;
-        dif(exr_get_channels(src_file, part_id, &channels));
-
-        /* allocate basband image buffer */
-        uint8_t pixelstride = 0;
-        if (channels->num_channels > MAX_CHANNEL_COUNT)
+        if (args.count("proxy"))
         {
-            std::cout << "Max channel count exceeded" << std::endl;
-            exit(-1);
+            make_proxy(session, src_fn, enc_fn, args["proxy"].as<int>(), transcode_opts);
         }
-        uint8_t ch_offset[MAX_CHANNEL_COUNT];
-        for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+        else if (args.count("mipmap"))
         {
-            ch_offset[ch_id] = pixelstride;
-            pixelstride += channels->entries[ch_id].pixel_type == EXR_PIXEL_HALF ? 2 : 4;
+            make_mipmap(
+                session, src_fn, enc_fn, args["mipmap"].as<int>(), args["mipmap-dwt"].as<bool>(), transcode_opts);
         }
-        int32_t linestride = pixelstride * width;
-        baseband_bufs[part_id] = (uint8_t *)malloc(height * width * pixelstride);
-
-        /* decode */
-
-        bool first = true;
-        exr_decode_pipeline_t decoder;
-        exr_chunk_info_t dec_chunk;
-        int32_t scansperchunk;
-        dif(exr_get_scanlines_per_chunk(src_file, part_id, &scansperchunk));
-        uint8_t *chunk_buf = baseband_bufs[part_id];
-        for (int y = dw.min.y; y <= dw.max.y; y += scansperchunk)
+        else
         {
-            dif(exr_read_scanline_chunk_info(src_file, part_id, y, &dec_chunk));
-
-            if (first)
-            {
-                dif(exr_decoding_initialize(src_file, part_id, &dec_chunk, &decoder));
-            }
-            else
-            {
-                dif(exr_decoding_update(src_file, part_id, &dec_chunk, &decoder));
-            }
-
-            for (int ch_id = 0; ch_id < decoder.channel_count; ++ch_id)
-            {
-                const exr_coding_channel_info_t &channel = decoder.channels[ch_id];
-
-                if (channel.height == 0)
-                {
-                    decoder.channels[ch_id].decode_to_ptr = NULL;
-                    decoder.channels[ch_id].user_pixel_stride = 0;
-                    decoder.channels[ch_id].user_line_stride = 0;
-                    continue;
-                }
-
-                decoder.channels[ch_id].decode_to_ptr = chunk_buf + ch_offset[ch_id];
-                decoder.channels[ch_id].user_pixel_stride = pixelstride;
-                decoder.channels[ch_id].user_line_stride = linestride;
-            }
+            transcode_stats stats = transcode(session, src_fn, enc_fn, transcode_opts);
 
-            if (first)
+            if (!transcode_opts.previous.empty() || !transcode_opts.cache_dir.empty())
             {
-                dif(
-                    exr_decoding_choose_default_routines(src_file, part_id, &decoder));
+                std::cout << "Reused " << stats.reused_chunks << " chunks from the previous output and "
+                          << stats.cached_chunks << " from the cache" << std::endl;
             }
-            dif(exr_decoding_run(src_file, part_id, &decoder));
-
-            first = false;
-            chunk_buf += linestride * scansperchunk;
         }
-        dif(exr_decoding_destroy(src_file, &decoder));
-
-        /* encode */
-
-        first = true;
-        exr_encode_pipeline_t encoder;
-        exr_chunk_info_t enc_chunk;
-        dif(exr_get_scanlines_per_chunk(enc_file, part_id, &scansperchunk));
-        chunk_buf = baseband_bufs[part_id];
-        for (int y = dw.min.y; y <= dw.max.y; y += scansperchunk)
-        {
-            dif(exr_write_scanline_chunk_info(enc_file, part_id, y, &enc_chunk));
-
-            if (first)
-            {
-                dif(exr_encoding_initialize(enc_file, part_id, &enc_chunk, &encoder));
-            }
-            else
-            {
-                dif(exr_encoding_update(enc_file, part_id, &enc_chunk, &encoder));
-            }
-
-            for (int ch_id = 0; ch_id < encoder.channel_count; ++ch_id)
-            {
-                const exr_coding_channel_info_t &channel = encoder.channels[ch_id];
-
-                if (channel.height == 0)
-                {
-                    encoder.channels[ch_id].encode_from_ptr = NULL;
-                    encoder.channels[ch_id].user_pixel_stride = 0;
-                    encoder.channels[ch_id].user_line_stride = 0;
-                    continue;
-                }
-
-                encoder.channels[ch_id].encode_from_ptr = chunk_buf + ch_offset[ch_id];
-                encoder.channels[ch_id].user_pixel_stride = pixelstride;
-                encoder.channels[ch_id].user_line_stride = linestride;
-            }
-
-            if (first)
-            {
-                dif(
-                    exr_encoding_choose_default_routines(enc_file, part_id, &encoder));
-                encoder.compressed_bytes = scansperchunk * linestride;
-                encoder.compressed_buffer = malloc(encoder.compressed_bytes);
-                encoder.compress_fn = kdu_compress;
-            }
-            dif(exr_encoding_run(enc_file, part_id, &encoder));
-
-            first = false;
-            chunk_buf += linestride * scansperchunk;
-        }
-        free(encoder.compressed_buffer);
-        dif(exr_encoding_destroy(enc_file, &encoder));
     }
-
-    dif(exr_finish(&src_file));
-    dif(exr_finish(&enc_file));
-
-    /* read and compare with baseband */
-
-    exr_context_t dec_file;
-    dif(exr_start_read(&dec_file, enc_fn.c_str(), NULL));
-
-    for (int part_id = 0; part_id < partCount; part_id++)
+    catch (const std::exception &e)
     {
-        exr_attr_box2i_t dw;
-        dif(exr_get_data_window(dec_file, part_id, &dw));
-        int width = dw.max.x - dw.min.x + 1;
-        int height = dw.max.y - dw.min.y + 1;
-
-        /* allocate decoded image buffer */
-
-        const exr_attr_chlist_t *channels;
-        dif(exr_get_channels(dec_file, part_id, &channels));
-        uint8_t pixelstride = 0;
-        if (channels->num_channels > MAX_CHANNEL_COUNT)
-        {
-            std::cout << "Max channel count exceeded" << std::endl;
-            exit(-1);
-        }
-        uint8_t ch_offset[MAX_CHANNEL_COUNT];
-        for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
-        {
-            ch_offset[ch_id] = pixelstride;
-            pixelstride += channels->entries[ch_id].pixel_type == EXR_PIXEL_HALF ? 2 : 4;
-        }
-        int32_t linestride = pixelstride * width;
-        uint8_t *dec_buffer = (uint8_t *)malloc(height * width * pixelstride);
-
-        /* decode */
-
-        bool first = true;
-        exr_decode_pipeline_t decoder;
-        exr_chunk_info_t dec_chunk;
-        int32_t scansperchunk;
-        dif(exr_get_scanlines_per_chunk(dec_file, part_id, &scansperchunk));
-        uint8_t *chunk_buf = dec_buffer;
-        for (int y = dw.min.y; y <= dw.max.y; y += scansperchunk)
-        {
-            dif(exr_read_scanline_chunk_info(dec_file, part_id, y, &dec_chunk));
-
-            if (first)
-            {
-                dif(exr_decoding_initialize(dec_file, part_id, &dec_chunk, &decoder));
-            }
-            else
-            {
-                dif(exr_decoding_update(dec_file, part_id, &dec_chunk, &decoder));
-            }
-
-            for (int ch_id = 0; ch_id < decoder.channel_count; ++ch_id)
-            {
-                const exr_coding_channel_info_t &channel = decoder.channels[ch_id];
-
-                if (channel.height == 0)
-                {
-                    decoder.channels[ch_id].decode_to_ptr = NULL;
-                    decoder.channels[ch_id].user_pixel_stride = 0;
-                    decoder.channels[ch_id].user_line_stride = 0;
-                    continue;
-                }
-
-                decoder.channels[ch_id].decode_to_ptr = chunk_buf + ch_offset[ch_id];
-                decoder.channels[ch_id].user_pixel_stride = pixelstride;
-                decoder.channels[ch_id].user_line_stride = linestride;
-            }
-
-            if (first)
-            {
-                dif(
-                    exr_decoding_choose_default_routines(dec_file, part_id, &decoder));
-                if (!use_default_htj2k_decoder)
-                {
-                    decoder.decompress_fn = kdu_decompress;
-                }
-            }
-            dif(exr_decoding_run(dec_file, part_id, &decoder));
-
-            first = false;
-            chunk_buf += linestride * scansperchunk;
-        }
-        dif(exr_decoding_destroy(dec_file, &decoder));
-
-        /* compare with baseband */
-
-        if (memcmp(baseband_bufs[part_id], dec_buffer, height * width * pixelstride))
-        {
-            std::cout << "Decoded image does not match the source image" << std::endl;
-            exit(-1);
-        }
-
-        free(dec_buffer);
+        std::cout << e.what() << std::endl;
+        exit(-1);
     }
 
-    dif(exr_finish(&dec_file));
+    if (config.collect_metrics)
+    {
+        auto &metrics_fn = args["metrics"].as<std::string>();
+        if (metrics_format == "csv")
+            dif(exrkdu_session_write_metrics_csv(session, metrics_fn.c_str()));
+        else
+            dif(exrkdu_session_write_metrics_prometheus(session, metrics_fn.c_str()));
+    }
 
-    /* free baseband buffers */
+    exrkdu_session_destroy(session);
 
-    for (int part_id = 0; part_id < partCount; part_id++)
+    if (tracer.is_enabled() && !tracer.write(args["trace"].as<std::string>()))
     {
-        free(baseband_bufs[part_id]);
+        std::cout << "Cannot write the trace" << std::endl;
+        exit(-1);
     }
 
     std::cout << "Success" << std::endl;
@@ -0,0 +1,375 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "output.h"
+#include "scheduler.h"
+
+/* alignment of the offsets, sizes and memory of O_DIRECT writes */
+static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+buffered_output::buffered_output()
+    : fd(-1), direct_fd(-1), direct_ok(false), preallocated(false), buffer(NULL), capacity(0), start(0), end(0),
+      file_end(0), write_count(0)
+{
+}
+
+buffered_output::~buffered_output()
+{
+    std::string error;
+    this->close(error);
+
+    this->io_pool.reset();
+    for (uint8_t *block : this->blocks)
+        free(block);
+}
+
+#ifndef _WIN32
+
+bool
+buffered_output::open(const std::string &path, const output_options &options, std::string &error)
+{
+    this->capacity = std::max<size_t>(options.buffer_size, 1);
+    this->capacity = (this->capacity + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+
+    /* one buffer being filled, plus one being written by each I/O thread */
+    int block_count = 1 + std::max(options.io_threads, 0);
+    for (int i = 0; i < block_count; i++)
+    {
+        void *p = NULL;
+        if (posix_memalign(&p, DIRECT_IO_ALIGNMENT, this->capacity) != 0)
+        {
+            error = "Cannot allocate the output buffer";
+            return false;
+        }
+        this->blocks.push_back((uint8_t *)p);
+    }
+    this->buffer = this->blocks[0];
+    this->free_blocks.assign(this->blocks.begin() + 1, this->blocks.end());
+
+    this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (this->fd < 0)
+    {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+#ifdef O_DIRECT
+    /* filesystems without O_DIRECT support fall back to buffered writes */
+    if (options.direct_io)
+        this->direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+#endif
+    this->direct_ok = this->direct_fd >= 0;
+
+#ifdef __linux__
+    /* preallocation is a hint: it fails on filesystems that do not support it */
+    if (options.preallocate > 0)
+        this->preallocated = fallocate(this->fd, 0, 0, (off_t)options.preallocate) == 0;
+#endif
+
+    if (options.io_threads > 0)
+        this->io_pool.reset(new worker_pool(options.io_threads));
+
+    return true;
+}
+
+bool
+buffered_output::close(std::string &error)
+{
+    if (this->fd < 0)
+        return true;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        if (this->error.empty())
+            this->flush((size_t)(this->end - this->start));
+        this->wait_blocks();
+
+        if (this->preallocated && this->error.empty() && ftruncate(this->fd, (off_t)this->file_end) != 0)
+            this->error = std::string("ftruncate: ") + strerror(errno);
+
+        if (this->direct_fd >= 0)
+            ::close(this->direct_fd);
+        if (::close(this->fd) != 0 && this->error.empty())
+            this->error = std::string("close: ") + strerror(errno);
+
+        this->fd = -1;
+        this->direct_fd = -1;
+    }
+
+    error = this->error;
+    return error.empty();
+}
+
+bool
+buffered_output::write_at(int fd, const uint8_t *data, size_t size, uint64_t offset, std::string &error)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, data, size, (off_t)offset);
+        this->write_count++;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            error = std::string("pwrite: ") + strerror(n < 0 ? errno : EIO);
+            return false;
+        }
+
+        data += n;
+        size -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+/* writes the aligned part of a block with O_DIRECT, if enabled, and the
+   remainder through the page cache; called by the I/O threads concurrently */
+
+bool
+buffered_output::write_block(const uint8_t *data, size_t size, uint64_t offset, std::string &error)
+{
+    if (this->direct_ok && offset % DIRECT_IO_ALIGNMENT == 0)
+    {
+        size_t aligned = size / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+
+        if (aligned > 0 && !this->write_at(this->direct_fd, data, aligned, offset, error))
+        {
+            if (errno != EINVAL)
+                return false;
+
+            /* the filesystem accepted O_DIRECT but rejects the writes */
+            this->direct_ok = false;
+            error.clear();
+        }
+        else
+        {
+            data += aligned;
+            size -= aligned;
+            offset += aligned;
+        }
+    }
+
+    return this->write_at(this->fd, data, size, offset, error);
+}
+
+#else
+
+bool
+buffered_output::open(const std::string &path, const output_options &options, std::string &error)
+{
+    error = "Buffered output is not supported on this platform";
+    return false;
+}
+
+bool
+buffered_output::close(std::string &error)
+{
+    error = this->error;
+    return error.empty();
+}
+
+bool
+buffered_output::write_at(int fd, const uint8_t *data, size_t size, uint64_t offset, std::string &error)
+{
+    return false;
+}
+
+bool
+buffered_output::write_block(const uint8_t *data, size_t size, uint64_t offset, std::string &error)
+{
+    return false;
+}
+
+#endif
+
+/* writes the first `size` bytes of the buffer, which must be all of it or the
+   whole capacity; with I/O threads, the buffer is handed to one of them and
+   the next free buffer is filled meanwhile */
+
+bool
+buffered_output::flush(size_t size)
+{
+    if (size > 0)
+    {
+        this->file_end = std::max(this->file_end, this->start + size);
+
+        if (this->io_pool)
+        {
+            uint8_t *block = this->buffer;
+            uint64_t offset = this->start;
+            {
+                std::unique_lock<std::mutex> lock(this->block_mutex);
+                this->block_returned.wait(lock, [this] { return !this->free_blocks.empty(); });
+
+                if (!this->block_error.empty())
+                {
+                    this->error = this->block_error;
+                    return false;
+                }
+
+                this->buffer = this->free_blocks.back();
+                this->free_blocks.pop_back();
+            }
+
+            this->io_pool->submit([this, block, size, offset] {
+                std::string error;
+                bool ok = this->write_block(block, size, offset, error);
+
+                std::lock_guard<std::mutex> lock(this->block_mutex);
+                if (!ok && this->block_error.empty())
+                    this->block_error = error;
+                this->free_blocks.push_back(block);
+                this->block_returned.notify_one();
+            });
+        }
+        else if (!this->write_block(this->buffer, size, this->start, this->error))
+            return false;
+    }
+
+    this->start += size;
+    this->end = this->start;
+
+    return true;
+}
+
+/* waits for the buffers being written by the I/O threads */
+
+bool
+buffered_output::wait_blocks()
+{
+    if (this->io_pool)
+    {
+        this->io_pool->wait();
+
+        std::lock_guard<std::mutex> lock(this->block_mutex);
+        if (this->error.empty())
+            this->error = this->block_error;
+    }
+
+    return this->error.empty();
+}
+
+bool
+buffered_output::write(const uint8_t *data, uint64_t size, uint64_t offset)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (!this->error.empty())
+        return false;
+
+    /* writes outside the buffered window flush it: the ones behind it go
+       straight to the file, the ones ahead of it start a new window */
+    if (offset < this->start || offset >= this->start + this->capacity)
+    {
+        if (!this->flush((size_t)(this->end - this->start)))
+            return false;
+
+        /* the zeros buffered in place of e.g. the offset table must be on
+           file before it is written */
+        if (offset < this->start)
+        {
+            if (!this->wait_blocks())
+                return false;
+
+            this->file_end = std::max(this->file_end, offset + size);
+            return this->write_at(this->fd, data, (size_t)size, offset, this->error);
+        }
+
+        this->start = this->end = offset;
+    }
+
+    while (size > 0)
+    {
+        size_t at = (size_t)(offset - this->start);
+        size_t filled = (size_t)(this->end - this->start);
+
+        /* a gap, e.g. the chunk offset table, is written by the library later */
+        if (at > filled)
+            memset(this->buffer + filled, 0, at - filled);
+
+        size_t n = (size_t)std::min<uint64_t>(size, this->capacity - at);
+        memcpy(this->buffer + at, data, n);
+        this->end = std::max(this->end, offset + n);
+
+        data += n;
+        size -= n;
+        offset += n;
+
+        if (this->end - this->start == this->capacity && !this->flush(this->capacity))
+            return false;
+    }
+
+    return true;
+}
+
+int64_t
+buffered_output::write_fn(
+    exr_const_context_t f,
+    void *user_data,
+    const void *buffer,
+    uint64_t size,
+    uint64_t offset,
+    exr_stream_error_func_ptr_t error_cb)
+{
+    buffered_output *out = (buffered_output *)user_data;
+
+    if (!out->write((const uint8_t *)buffer, size, offset))
+    {
+        std::string error;
+        {
+            std::lock_guard<std::mutex> lock(out->mutex);
+            error = out->error;
+        }
+        error_cb(f, EXR_ERR_WRITE_IO, "%s", error.c_str());
+        return -1;
+    }
+
+    return (int64_t)size;
+}
+
+void
+buffered_output::install(exr_context_initializer_t &init)
+{
+    init.user_data = this;
+    init.write_fn = write_fn;
+}
@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <openexr.h>
+
+struct output_options
+{
+    /* bytes coalesced before a write, rounded up to a multiple of 4 KiB */
+    size_t buffer_size;
+
+    /* bytes reserved with fallocate() when the file is opened, 0 for none; the
+       file is trimmed to its actual size when closed */
+    uint64_t preallocate;
+
+    /* write the aligned part of each buffer with O_DIRECT, bypassing the page
+       cache, where the filesystem supports it */
+    bool direct_io;
+
+    /* threads writing full buffers concurrently at their offsets, while the
+       next buffer is filled; 0 writes each buffer before filling the next */
+    int io_threads;
+};
+
+class worker_pool;
+
+/* Output stream of an OpenEXR write context that coalesces the many small
+   writes of the library (the chunk headers, then each chunk) into large
+   aligned writes. Writes behind the buffered window, i.e. the chunk offset
+   tables written by exr_finish(), go directly to the file, once the buffers
+   written concurrently are on file. */
+class buffered_output
+{
+public:
+    buffered_output();
+    ~buffered_output();
+
+    buffered_output(const buffered_output &) = delete;
+    buffered_output &operator=(const buffered_output &) = delete;
+
+    /* creates or truncates the file at `path` */
+    bool open(const std::string &path, const output_options &options, std::string &error);
+
+    /* makes the context created from `init` write through this stream */
+    void install(exr_context_initializer_t &init);
+
+    /* writes the buffered data and closes the file; returns false, with the
+       first error, if any write failed */
+    bool close(std::string &error);
+
+    /* number of write system calls */
+    uint64_t write_calls() const { return this->write_count; }
+
+private:
+    static int64_t write_fn(
+        exr_const_context_t f,
+        void *user_data,
+        const void *buffer,
+        uint64_t size,
+        uint64_t offset,
+        exr_stream_error_func_ptr_t error_cb);
+
+    bool write(const uint8_t *data, uint64_t size, uint64_t offset);
+    bool flush(size_t size);
+    bool wait_blocks();
+    bool write_block(const uint8_t *data, size_t size, uint64_t offset, std::string &error);
+    bool write_at(int fd, const uint8_t *data, size_t size, uint64_t offset, std::string &error);
+
+    std::mutex mutex;
+    int fd;
+    int direct_fd;
+    std::atomic<bool> direct_ok;
+    bool preallocated;
+    uint8_t *buffer;
+    size_t capacity;
+    uint64_t start;
+    uint64_t end;
+    uint64_t file_end;
+    std::atomic<uint64_t> write_count;
+    std::string error;
+
+    /* buffers being written by the I/O threads, returned to `free_blocks` with
+       the first error, if any, in `block_error` */
+    std::unique_ptr<worker_pool> io_pool;
+    std::vector<uint8_t *> blocks;
+    std::mutex block_mutex;
+    std::condition_variable block_returned;
+    std::vector<uint8_t *> free_blocks;
+    std::string block_error;
+};
+
+#endif
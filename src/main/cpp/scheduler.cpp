@@ -0,0 +1,450 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "scheduler.h"
+
+/* a KDU thread needs roughly this many bytes of samples to stay busy; below
+   that, synchronization costs outweigh the extra thread */
+#define MIN_BYTES_PER_KDU_THREAD (1 << 20)
+
+#ifdef __linux__
+
+/* returns the quota in CPUs, rounded up, or 0 if unlimited */
+static int
+cgroup_cpu_quota()
+{
+    long long quota = -1;
+    long long period = 0;
+
+    /* cgroup v2: "<quota|max> <period>" */
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    if (v2)
+    {
+        std::string quota_str;
+        v2 >> quota_str >> period;
+        if (quota_str != "max" && !quota_str.empty())
+            quota = std::stoll(quota_str);
+    }
+    else
+    {
+        std::ifstream v1_quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream v1_period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (v1_quota && v1_period)
+        {
+            v1_quota >> quota;
+            v1_period >> period;
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+        return 0;
+
+    return (int)((quota + period - 1) / period);
+}
+
+#endif
+
+int
+available_cores()
+{
+    int cores = (int)std::thread::hardware_concurrency();
+
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cores = CPU_COUNT(&set);
+
+    try
+    {
+        int quota = cgroup_cpu_quota();
+        if (quota > 0)
+            cores = std::min(cores, quota);
+    }
+    catch (...)
+    {
+        /* malformed cgroup files are ignored */
+    }
+#endif
+
+    return std::max(1, cores);
+}
+
+bool
+parse_byte_size(const std::string &s, uint64_t &bytes)
+{
+    size_t end = 0;
+    unsigned long long value;
+    try
+    {
+        value = std::stoull(s, &end);
+    }
+    catch (const std::exception &)
+    {
+        return false;
+    }
+
+    std::string suffix = s.substr(end);
+    if (suffix.size() > 1 && (suffix.back() == 'B' || suffix.back() == 'b'))
+        suffix.pop_back();
+
+    int shift;
+    if (suffix.empty())
+        shift = 0;
+    else if (suffix == "K" || suffix == "k")
+        shift = 10;
+    else if (suffix == "M" || suffix == "m")
+        shift = 20;
+    else if (suffix == "G" || suffix == "g")
+        shift = 30;
+    else if (suffix == "T" || suffix == "t")
+        shift = 40;
+    else
+        return false;
+
+    bytes = (uint64_t)value << shift;
+    return true;
+}
+
+memory_budget::memory_budget(uint64_t limit) : max_bytes(limit), used(0), next_ticket(0), serving(0)
+{
+}
+
+bool
+memory_budget::acquire(uint64_t bytes, const std::atomic<bool> *cancel)
+{
+    if (this->max_bytes == 0)
+        return true;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    uint64_t ticket = this->next_ticket++;
+    auto fits = [&] {
+        return ticket == this->serving && (this->used + bytes <= this->max_bytes || this->used == 0);
+    };
+    this->released.wait(lock, [&] { return fits() || (cancel && *cancel); });
+
+    bool acquired = fits();
+    if (acquired)
+        this->used += bytes;
+
+    /* a cancelled request leaves the line */
+    if (ticket == this->serving)
+        this->advance();
+    else
+        this->abandoned.insert(ticket);
+
+    /* the next request in line may fit as well */
+    this->released.notify_all();
+
+    return acquired;
+}
+
+/* moves to the next request in line that is still waiting */
+void
+memory_budget::advance()
+{
+    this->serving++;
+    while (this->abandoned.erase(this->serving))
+        this->serving++;
+}
+
+void
+memory_budget::wake()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->released.notify_all();
+}
+
+void
+memory_budget::release(uint64_t bytes)
+{
+    if (this->max_bytes == 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->used -= bytes;
+    }
+    this->released.notify_all();
+}
+
+memory_lease::memory_lease(memory_budget *budget, uint64_t bytes, const std::atomic<bool> *cancel)
+    : budget(budget), bytes(bytes), cancelled(false)
+{
+    if (this->budget && !this->budget->acquire(bytes, cancel))
+    {
+        this->budget = NULL;
+        this->cancelled = true;
+    }
+}
+
+memory_lease::memory_lease(memory_lease &&other)
+    : budget(other.budget), bytes(other.bytes), cancelled(other.cancelled)
+{
+    other.budget = NULL;
+}
+
+memory_lease::~memory_lease()
+{
+    if (this->budget)
+        this->budget->release(this->bytes);
+}
+
+memory_lease &
+memory_lease::operator=(memory_lease &&other)
+{
+    if (this != &other)
+    {
+        if (this->budget)
+            this->budget->release(this->bytes);
+        this->budget = other.budget;
+        this->bytes = other.bytes;
+        this->cancelled = other.cancelled;
+        other.budget = NULL;
+    }
+    return *this;
+}
+
+chunk_scheduler::chunk_scheduler(int cores, int kdu_threads, worker_pool *pool)
+    : pool(pool), budget(NULL), planned_chunk_bytes(0), core_count(std::max(1, cores)),
+      forced_kdu_threads(kdu_threads), concurrency(1), max_kdu_threads(1)
+{
+}
+
+uint64_t
+chunk_scheduler::chunk_working_bytes(size_t chunk_bytes)
+{
+    /* the packed or unpacked buffer of OpenEXR, the compressed buffer and the
+       compressed chunk held until it is written */
+    return 3 * (uint64_t)chunk_bytes;
+}
+
+void
+chunk_scheduler::plan(int chunk_count, size_t chunk_bytes)
+{
+    chunk_count = std::max(1, chunk_count);
+    this->planned_chunk_bytes = chunk_bytes;
+
+    if (this->forced_kdu_threads > 0)
+    {
+        this->max_kdu_threads = this->forced_kdu_threads;
+        this->concurrency = std::max(1, std::min(chunk_count, this->core_count / this->forced_kdu_threads));
+        return;
+    }
+
+    this->concurrency = std::min(chunk_count, this->core_count);
+    this->max_kdu_threads = (int)std::max<size_t>(1, chunk_bytes / MIN_BYTES_PER_KDU_THREAD);
+}
+
+int
+chunk_scheduler::kdu_threads(int remaining, int running, int held_cores) const
+{
+    if (this->forced_kdu_threads > 0)
+        return this->forced_kdu_threads;
+
+    /* cores left idle by the chunks in flight go to KDU threads, e.g. a 4K
+       frame of 9 chunks on 64 cores gets 7 KDU threads per chunk, and the last
+       chunk to start the 8 cores the others left */
+    int free_cores = std::max(0, this->core_count - held_cores);
+    int chunks = std::max(1, std::min(remaining, this->concurrency - running));
+    int threads = std::min(free_cores / chunks, this->max_kdu_threads);
+
+    return threads < 2 ? 0 : threads;
+}
+
+void
+chunk_scheduler::run(int chunk_count, const std::function<void(int, int, memory_lease &)> &fn)
+{
+    std::unique_ptr<worker_pool> local;
+    worker_pool *pool = this->pool;
+    if (pool == NULL)
+    {
+        local.reset(new worker_pool(this->concurrency));
+        pool = local.get();
+    }
+
+    /* runners pull the chunks in order, so that a larger warm pool does not
+       code more chunks concurrently than planned */
+    std::mutex next_mutex;
+    int next = 0;
+
+    /* not next_mutex, which is held while waiting for memory that a finishing
+       chunk may only release after giving back its cores */
+    std::mutex cores_mutex;
+    int running = 0;
+    int held_cores = 0;
+
+    std::atomic<bool> failed(false);
+    uint64_t lease_bytes = chunk_working_bytes(this->planned_chunk_bytes);
+
+    int runners = std::min(this->concurrency, pool->size());
+    for (int r = 0; r < runners; r++)
+    {
+        pool->submit([&] {
+            while (!failed)
+            {
+                int i;
+                int threads;
+                int cores;
+                memory_lease lease;
+                {
+                    /* the lease is taken with the chunk index, hence in order */
+                    std::lock_guard<std::mutex> lock(next_mutex);
+                    if (next >= chunk_count)
+                        return;
+                    lease = memory_lease(this->budget, lease_bytes, &failed);
+                    if (lease.is_cancelled())
+                        return;
+                    i = next++;
+
+                    std::lock_guard<std::mutex> cores_lock(cores_mutex);
+                    threads = this->kdu_threads(chunk_count - i, running, held_cores);
+                    cores = std::max(1, threads);
+                    running++;
+                    held_cores += cores;
+                }
+
+                try
+                {
+                    fn(i, threads, lease);
+
+                    std::lock_guard<std::mutex> lock(cores_mutex);
+                    running--;
+                    held_cores -= cores;
+                }
+                catch (...)
+                {
+                    /* chunks waiting for memory held by chunks that will
+                       never be written give up */
+                    failed = true;
+                    if (this->budget)
+                        this->budget->wake();
+                    throw;
+                }
+            }
+        });
+    }
+
+    pool->wait();
+}
+
+worker_pool::worker_pool(int thread_count) : busy(0), stopping(false)
+{
+    for (int i = 0; i < std::max(1, thread_count); i++)
+        this->threads.emplace_back(&worker_pool::run, this);
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->task_ready.notify_all();
+
+    for (std::thread &t : this->threads)
+        t.join();
+}
+
+void
+worker_pool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->tasks.push_back(std::move(task));
+    }
+    this->task_ready.notify_one();
+}
+
+void
+worker_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->idle.wait(lock, [this] { return this->tasks.empty() && this->busy == 0; });
+
+    if (this->error)
+    {
+        std::exception_ptr e = this->error;
+        this->error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void
+worker_pool::run()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    while (true)
+    {
+        this->task_ready.wait(lock, [this] { return this->stopping || !this->tasks.empty(); });
+
+        if (this->tasks.empty())
+            return;
+
+        std::function<void()> task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        this->busy++;
+
+        /* once a task failed, the remaining ones are dropped */
+        bool skip = (bool)this->error;
+
+        lock.unlock();
+        std::exception_ptr e;
+        if (!skip)
+        {
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                e = std::current_exception();
+            }
+        }
+        lock.lock();
+
+        if (e && !this->error)
+            this->error = e;
+
+        this->busy--;
+        if (this->tasks.empty() && this->busy == 0)
+            this->idle.notify_all();
+    }
+}
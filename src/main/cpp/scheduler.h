@@ -0,0 +1,197 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Number of cores the process may use: the CPU affinity mask, further limited
+   by the cgroup CPU quota (cgroup v2 cpu.max or v1 cfs_quota_us) so that a
+   container limited to N CPUs on a large node is not oversubscribed. */
+int
+available_cores();
+
+/* parses a byte count with an optional K, M, G or T (binary) suffix, e.g. 8G */
+bool
+parse_byte_size(const std::string &s, uint64_t &bytes);
+
+/* Bytes of buffers that may be alive at once, shared by the chunks of a job
+   or by the jobs of a process. acquire() blocks until the request fits;
+   requests are admitted in arrival order, so that large ones are not starved,
+   and a request larger than the whole budget is admitted once nothing else is
+   held, so that it still makes progress. */
+class memory_budget
+{
+public:
+    /* 0 for no limit */
+    explicit memory_budget(uint64_t limit);
+
+    /* returns false, without acquiring anything, if `cancel` is set while
+       waiting, which wake() makes the waiters check */
+    bool acquire(uint64_t bytes, const std::atomic<bool> *cancel = NULL);
+    void release(uint64_t bytes);
+    void wake();
+
+    uint64_t limit() const { return this->max_bytes; }
+
+private:
+    void advance();
+
+    std::mutex mutex;
+    std::condition_variable released;
+    uint64_t max_bytes;
+    uint64_t used;
+    uint64_t next_ticket;
+    uint64_t serving;
+    std::set<uint64_t> abandoned;
+};
+
+/* bytes held from a budget until destroyed; a NULL budget holds nothing */
+class memory_lease
+{
+public:
+    memory_lease() : budget(NULL), bytes(0), cancelled(false) {}
+    memory_lease(memory_budget *budget, uint64_t bytes, const std::atomic<bool> *cancel = NULL);
+    ~memory_lease();
+
+    memory_lease(memory_lease &&other);
+    memory_lease &operator=(memory_lease &&other);
+
+    memory_lease(const memory_lease &) = delete;
+    memory_lease &operator=(const memory_lease &) = delete;
+
+    /* true if the wait was cancelled, in which case nothing is held */
+    bool is_cancelled() const { return this->cancelled; }
+
+private:
+    memory_budget *budget;
+    uint64_t bytes;
+    bool cancelled;
+};
+
+class worker_pool;
+
+/* Splits the available cores between chunks coded concurrently (inter-chunk
+   parallelism) and KDU threads within each chunk (intra-chunk parallelism).
+
+   Chunks are preferred, since they scale with no synchronization; KDU threads
+   are only given to a chunk once there are fewer chunks left than cores, and
+   only as many as its size can keep busy. */
+class chunk_scheduler
+{
+public:
+    /* kdu_threads > 0 forces that many KDU threads per chunk; `pool`, if not
+       NULL, provides warm threads for the chunks instead of a pool created for
+       each part, and must not be used concurrently by another scheduler */
+    chunk_scheduler(int cores, int kdu_threads = 0, worker_pool *pool = NULL);
+
+    /* plans a part of `chunk_count` chunks of `chunk_bytes` samples each */
+    void plan(int chunk_count, size_t chunk_bytes);
+
+    /* number of chunks coded concurrently */
+    int in_flight() const { return this->concurrency; }
+
+    /* KDU threads for the next chunk, when `remaining` chunks, including this
+       one, are not yet started and `running` chunks in flight hold
+       `held_cores` cores: the free cores are shared between this chunk and
+       those that may start alongside it, so that no core is handed out twice */
+    int kdu_threads(int remaining, int running, int held_cores) const;
+
+    int cores() const { return this->core_count; }
+
+    /* bytes of working buffers (packed, unpacked and compressed) of a chunk of
+       `chunk_bytes` samples */
+    static uint64_t chunk_working_bytes(size_t chunk_bytes);
+
+    /* makes run() hold chunk_working_bytes() of `budget` for each chunk, from
+       its start until its lease is released; NULL for no limit */
+    void set_budget(memory_budget *budget) { this->budget = budget; }
+
+    /* calls fn(i, kdu_threads, lease) for the `chunk_count` chunks of the
+       planned part, in order, with in_flight() chunks running concurrently;
+       rethrows the first exception, after which no further chunk is started.
+       Leases are taken in chunk order, so that a chunk waiting to be written in
+       order never holds memory its predecessors need. Each chunk holds the
+       cores of its KDU threads, or one core, until fn returns. */
+    void run(int chunk_count, const std::function<void(int, int, memory_lease &)> &fn);
+
+private:
+    worker_pool *pool;
+    memory_budget *budget;
+    size_t planned_chunk_bytes;
+    int core_count;
+    int forced_kdu_threads;
+    int concurrency;
+    int max_kdu_threads;
+};
+
+/* fixed pool of worker threads; the first exception thrown by a task is
+   rethrown by wait() */
+class worker_pool
+{
+public:
+    explicit worker_pool(int thread_count);
+    ~worker_pool();
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    void submit(std::function<void()> task);
+
+    /* waits for all submitted tasks */
+    void wait();
+
+    int size() const { return (int)this->threads.size(); }
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> tasks;
+    int busy;
+    bool stopping;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,434 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "synth.h"
+
+/* round to nearest even, with subnormals */
+
+uint16_t
+synth_float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000)
+        return (uint16_t)(sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00));
+
+    if (abs >= 0x477ff000)
+        return (uint16_t)(sign | 0x7c00);
+
+    uint32_t r;
+    uint32_t rem;
+    uint32_t halfway;
+
+    if (abs < 0x38800000)
+    {
+        if (abs < 0x33000000)
+            return (uint16_t)sign;
+
+        uint32_t e = abs >> 23;
+        uint32_t m = (abs & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - e;
+
+        r = m >> shift;
+        rem = m & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        r = (abs - 0x38000000) >> 13;
+        rem = abs & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    if (rem > halfway || (rem == halfway && (r & 1)))
+        r++;
+
+    return (uint16_t)(sign | r);
+}
+
+static uint32_t
+hash32(uint32_t a, uint32_t b, uint32_t c)
+{
+    uint32_t h = a * 0x9e3779b1u ^ b * 0x85ebca77u ^ c * 0xc2b2ae3du;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+static float
+unit(uint32_t h)
+{
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+static float
+gradient(uint32_t key, int x, int y)
+{
+    float fx = x * (0.0011f + (key & 7) * 0.0002f);
+    float fy = y * (0.0017f + ((key >> 3) & 7) * 0.0002f);
+    return 0.5f + 0.35f * std::sin(fx + 0.7f * fy) + 0.15f * std::cos(0.5f * fx - fy);
+}
+
+/* approximately gaussian, from the sum of 4 uniform variables */
+static float
+grain(uint32_t key, int x, int y)
+{
+    float s = 0;
+    for (uint32_t i = 0; i < 4; i++)
+        s += unit(hash32(key + i, (uint32_t)x, (uint32_t)y));
+    return (s - 2.f) * 0.05f;
+}
+
+/* a few discs, on a 512 x 512 grid of cells */
+static float
+sparse_alpha(uint32_t key, int x, int y)
+{
+    int cx = x >> 9;
+    int cy = y >> 9;
+    uint32_t h = hash32(key, (uint32_t)cx, (uint32_t)cy);
+
+    if ((h & 3) != 0)
+        return 0.f;
+
+    float ox = (cx << 9) + 128 + (h >> 8 & 255);
+    float oy = (cy << 9) + 128 + (h >> 16 & 255);
+    float radius = 32 + (h >> 24 & 63);
+    float d = std::sqrt((x - ox) * (x - ox) + (y - oy) * (y - oy));
+
+    return std::min(1.f, std::max(0.f, radius - d));
+}
+
+/* objects on a jittered 64 x 64 grid */
+static uint32_t
+id_matte(uint32_t key, int x, int y)
+{
+    uint32_t jx = hash32(key, (uint32_t)y >> 4, 1) & 31;
+    uint32_t jy = hash32(key, (uint32_t)x >> 4, 2) & 31;
+
+    return 1 + (hash32(key, ((uint32_t)x + jx) >> 6, ((uint32_t)y + jy) >> 6) % 500);
+}
+
+void
+synth_fill(
+    const synth_channel &channel,
+    uint32_t seed,
+    int part_index,
+    int channel_index,
+    int x0,
+    int y0,
+    int w,
+    int h,
+    uint8_t *dst,
+    int pixel_stride,
+    int line_stride)
+{
+    uint32_t key = hash32(seed, (uint32_t)part_index, (uint32_t)channel_index);
+
+    for (int y = y0; y < y0 + h; y++, dst += line_stride)
+    {
+        uint8_t *p = dst;
+        for (int x = x0; x < x0 + w; x++, p += pixel_stride)
+        {
+            float v;
+            uint32_t u;
+
+            switch (channel.content)
+            {
+            case SYNTH_GRADIENT:
+                v = gradient(key, x, y);
+                u = (uint32_t)(v * 65535.f);
+                break;
+            case SYNTH_GRAIN:
+                v = gradient(key, x, y) + grain(key, x, y);
+                u = (uint32_t)(std::max(0.f, v) * 65535.f);
+                break;
+            case SYNTH_SPARSE_ALPHA:
+                v = sparse_alpha(key, x, y);
+                u = v > 0.5f;
+                break;
+            case SYNTH_CONSTANT:
+                v = channel.value;
+                u = (uint32_t)channel.value;
+                break;
+            default:
+                u = id_matte(key, x, y);
+                v = (float)u;
+                break;
+            }
+
+            if (channel.type == EXR_PIXEL_HALF)
+            {
+                uint16_t half = synth_float_to_half(v);
+                memcpy(p, &half, sizeof(half));
+            }
+            else if (channel.type == EXR_PIXEL_FLOAT)
+            {
+                memcpy(p, &v, sizeof(v));
+            }
+            else
+            {
+                memcpy(p, &u, sizeof(u));
+            }
+        }
+    }
+}
+
+static void
+add_layer(
+    std::vector<synth_channel> &channels, const std::string &layer, const char *suffixes, exr_pixel_type_t type, synth_content content)
+{
+    for (const char *s = suffixes; *s; s++)
+        channels.push_back({layer.empty() ? std::string(1, *s) : layer + "." + *s, type, content, 0.f});
+}
+
+bool
+synth_make_preset(
+    const std::string &preset,
+    int width,
+    int height,
+    int part_count,
+    exr_storage_t storage,
+    int tile_size,
+    exr_compression_t compression,
+    synth_image &image)
+{
+    static const exr_pixel_type_t mixed_types[] = {EXR_PIXEL_HALF, EXR_PIXEL_FLOAT, EXR_PIXEL_UINT};
+
+    for (int i = 0; i < part_count; i++)
+    {
+        synth_part part;
+        part.name = preset + std::to_string(i);
+        part.width = width;
+        part.height = height;
+        part.storage = storage;
+        part.tile_size = tile_size;
+        part.compression = compression;
+
+        if (preset == "beauty")
+        {
+            add_layer(part.channels, "", "BGR", EXR_PIXEL_HALF, SYNTH_GRAIN);
+            add_layer(part.channels, "", "A", EXR_PIXEL_HALF, SYNTH_SPARSE_ALPHA);
+        }
+        else if (preset == "aovs")
+        {
+            add_layer(part.channels, "", "BGR", EXR_PIXEL_HALF, SYNTH_GRAIN);
+            part.channels.push_back({"A", EXR_PIXEL_HALF, SYNTH_CONSTANT, 1.f});
+            add_layer(part.channels, "diffuse", "BGR", EXR_PIXEL_HALF, SYNTH_GRAIN);
+            add_layer(part.channels, "specular", "BGR", EXR_PIXEL_HALF, SYNTH_GRADIENT);
+            add_layer(part.channels, "emission", "BGR", EXR_PIXEL_HALF, SYNTH_CONSTANT);
+            add_layer(part.channels, "matte", "BGR", EXR_PIXEL_HALF, SYNTH_SPARSE_ALPHA);
+        }
+        else if (preset == "ids")
+        {
+            add_layer(part.channels, "objectId", "R", EXR_PIXEL_UINT, SYNTH_ID_MATTE);
+            add_layer(part.channels, "materialId", "R", EXR_PIXEL_UINT, SYNTH_ID_MATTE);
+        }
+        else if (preset == "mixed")
+        {
+            /* the pixel type changes from part to part */
+            exr_pixel_type_t type = mixed_types[i % 3];
+            add_layer(part.channels, "", "BGR", type, type == EXR_PIXEL_UINT ? SYNTH_ID_MATTE : SYNTH_GRAIN);
+            add_layer(part.channels, "", "A", type, SYNTH_SPARSE_ALPHA);
+        }
+        else
+        {
+            return false;
+        }
+
+        image.parts.push_back(part);
+    }
+
+    return true;
+}
+
+#define SYNTH_CHECK(x)                  \
+    do                                  \
+    {                                   \
+        exr_result_t rv_ = (x);         \
+        if (rv_ != EXR_ERR_SUCCESS)     \
+        {                               \
+            exr_finish(&f);             \
+            return rv_;                 \
+        }                               \
+    } while (0)
+
+/* encodes one chunk, whose samples are generated in an interleaved buffer */
+
+static exr_result_t
+write_chunk(
+    exr_context_t f,
+    const synth_image &image,
+    int part_index,
+    const exr_chunk_info_t &cinfo,
+    bool first,
+    exr_encode_pipeline_t &encoder,
+    std::vector<uint8_t> &buffer)
+{
+    const synth_part &part = image.parts[part_index];
+    exr_result_t rv;
+
+    if (first)
+        rv = exr_encoding_initialize(f, part_index, &cinfo, &encoder);
+    else
+        rv = exr_encoding_update(f, part_index, &cinfo, &encoder);
+    if (rv != EXR_ERR_SUCCESS)
+        return rv;
+
+    int pixelstride = 0;
+    for (int ch_id = 0; ch_id < encoder.channel_count; ch_id++)
+        pixelstride += encoder.channels[ch_id].bytes_per_element;
+    int linestride = pixelstride * cinfo.width;
+
+    buffer.resize((size_t)linestride * cinfo.height);
+
+    int offset = 0;
+    for (int ch_id = 0; ch_id < encoder.channel_count; ch_id++)
+    {
+        exr_coding_channel_info_t &channel = encoder.channels[ch_id];
+
+        /* channels are sorted by name in the file */
+        size_t synth_id = 0;
+        while (synth_id < part.channels.size() && part.channels[synth_id].name != channel.channel_name)
+            synth_id++;
+        if (synth_id == part.channels.size())
+            return EXR_ERR_INVALID_ARGUMENT;
+
+        synth_fill(
+            part.channels[synth_id],
+            image.seed,
+            part_index,
+            (int)synth_id,
+            cinfo.start_x,
+            cinfo.start_y,
+            cinfo.width,
+            cinfo.height,
+            buffer.data() + offset,
+            pixelstride,
+            linestride);
+
+        channel.encode_from_ptr = buffer.data() + offset;
+        channel.user_pixel_stride = pixelstride;
+        channel.user_line_stride = linestride;
+        offset += channel.bytes_per_element;
+    }
+
+    if (first)
+    {
+        rv = exr_encoding_choose_default_routines(f, part_index, &encoder);
+        if (rv != EXR_ERR_SUCCESS)
+            return rv;
+    }
+
+    return exr_encoding_run(f, part_index, &encoder);
+}
+
+exr_result_t
+synth_write(const synth_image &image, const std::string &path)
+{
+    exr_context_t f;
+    exr_result_t rv = exr_start_write(&f, path.c_str(), EXR_WRITE_FILE_DIRECTLY, NULL);
+    if (rv != EXR_ERR_SUCCESS)
+        return rv;
+
+    for (const synth_part &part : image.parts)
+    {
+        int part_index;
+        SYNTH_CHECK(exr_add_part(f, part.name.c_str(), part.storage, &part_index));
+        SYNTH_CHECK(exr_initialize_required_attr_simple(f, part_index, part.width, part.height, part.compression));
+
+        for (const synth_channel &channel : part.channels)
+        {
+            SYNTH_CHECK(exr_add_channel(
+                f, part_index, channel.name.c_str(), channel.type, EXR_PERCEPTUALLY_LOGARITHMIC, 1, 1));
+        }
+
+        if (part.storage == EXR_STORAGE_TILED)
+        {
+            SYNTH_CHECK(exr_set_tile_descriptor(
+                f, part_index, part.tile_size, part.tile_size, EXR_TILE_ONE_LEVEL, EXR_TILE_ROUND_DOWN));
+        }
+    }
+
+    SYNTH_CHECK(exr_write_header(f));
+
+    std::vector<uint8_t> buffer;
+
+    for (int part_index = 0; part_index < (int)image.parts.size(); part_index++)
+    {
+        const synth_part &part = image.parts[part_index];
+
+        exr_encode_pipeline_t encoder;
+        exr_chunk_info_t cinfo;
+        bool first = true;
+
+        if (part.storage == EXR_STORAGE_TILED)
+        {
+            int32_t tiles_x, tiles_y;
+            SYNTH_CHECK(exr_get_tile_counts(f, part_index, 0, 0, &tiles_x, &tiles_y));
+
+            for (int ty = 0; ty < tiles_y; ty++)
+            {
+                for (int tx = 0; tx < tiles_x; tx++)
+                {
+                    SYNTH_CHECK(exr_write_tile_chunk_info(f, part_index, tx, ty, 0, 0, &cinfo));
+                    SYNTH_CHECK(write_chunk(f, image, part_index, cinfo, first, encoder, buffer));
+                    first = false;
+                }
+            }
+        }
+        else
+        {
+            int32_t scansperchunk;
+            SYNTH_CHECK(exr_get_scanlines_per_chunk(f, part_index, &scansperchunk));
+
+            for (int y = 0; y < part.height; y += scansperchunk)
+            {
+                SYNTH_CHECK(exr_write_scanline_chunk_info(f, part_index, y, &cinfo));
+                SYNTH_CHECK(write_chunk(f, image, part_index, cinfo, first, encoder, buffer));
+                first = false;
+            }
+        }
+
+        if (!first)
+            SYNTH_CHECK(exr_encoding_destroy(f, &encoder));
+    }
+
+    return exr_finish(&f);
+}
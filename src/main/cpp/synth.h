@@ -0,0 +1,110 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <openexr.h>
+
+/* Deterministic synthetic content for reproducible benchmarks. Sample values
+   depend only on the seed, the part, the channel and the pixel coordinates, so
+   that the same image is produced regardless of chunking or storage. */
+
+enum synth_content
+{
+    SYNTH_GRADIENT,     /* smooth gradients */
+    SYNTH_GRAIN,        /* gradients with film-grain noise */
+    SYNTH_SPARSE_ALPHA, /* mostly transparent, with a few soft-edged shapes */
+    SYNTH_CONSTANT,     /* a single value, e.g. empty AOVs */
+    SYNTH_ID_MATTE      /* piecewise-constant object identifiers */
+};
+
+struct synth_channel
+{
+    std::string name;
+    exr_pixel_type_t type;
+    synth_content content;
+    float value; /* for SYNTH_CONSTANT */
+};
+
+struct synth_part
+{
+    std::string name;
+    int width;
+    int height;
+    exr_storage_t storage; /* EXR_STORAGE_SCANLINE or EXR_STORAGE_TILED */
+    int tile_size;
+    exr_compression_t compression;
+    std::vector<synth_channel> channels;
+};
+
+struct synth_image
+{
+    uint32_t seed;
+    std::vector<synth_part> parts;
+};
+
+/* builds the parts of a named preset: beauty, aovs, ids or mixed */
+bool
+synth_make_preset(
+    const std::string &preset,
+    int width,
+    int height,
+    int part_count,
+    exr_storage_t storage,
+    int tile_size,
+    exr_compression_t compression,
+    synth_image &image);
+
+/* fills a w x h region whose top-left pixel is (x0, y0) */
+void
+synth_fill(
+    const synth_channel &channel,
+    uint32_t seed,
+    int part_index,
+    int channel_index,
+    int x0,
+    int y0,
+    int w,
+    int h,
+    uint8_t *dst,
+    int pixel_stride,
+    int line_stride);
+
+exr_result_t
+synth_write(const synth_image &image, const std::string &path);
+
+uint16_t
+synth_float_to_half(float f);
+
+#endif
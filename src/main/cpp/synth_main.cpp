@@ -0,0 +1,115 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* writes a synthetic EXR file for reproducible benchmarks */
+
+#include <iostream>
+#include <string>
+
+#include "synth.h"
+
+#include "cxxopts.hpp"
+
+static bool
+parse_compression(const std::string &name, exr_compression_t &compression)
+{
+    if (name == "none")
+        compression = EXR_COMPRESSION_NONE;
+    else if (name == "zip")
+        compression = EXR_COMPRESSION_ZIP;
+    else if (name == "piz")
+        compression = EXR_COMPRESSION_PIZ;
+    else if (name == "htj2k")
+        compression = EXR_COMPRESSION_HTJ2K;
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    cxxopts::Options options(
+        "exrkdu_synth", "Writes a synthetic EXR file with deterministic content");
+
+    options.add_options()(
+        "opath", "Output image path", cxxopts::value<std::string>())(
+        "preset", "Content preset (beauty, aovs, ids, mixed)", cxxopts::value<std::string>()->default_value("beauty"))(
+        "width", "Image width", cxxopts::value<int>()->default_value("3840"))(
+        "height", "Image height", cxxopts::value<int>()->default_value("2160"))(
+        "parts", "Number of parts", cxxopts::value<int>()->default_value("1"))(
+        "tiled", "Write tiled parts")(
+        "tile-size", "Tile width and height", cxxopts::value<int>()->default_value("256"))(
+        "compression", "Compression (none, zip, piz, htj2k)", cxxopts::value<std::string>()->default_value("zip"))(
+        "seed", "Content seed", cxxopts::value<uint32_t>()->default_value("1"))(
+        "h,help", "Print usage");
+
+    options.parse_positional({"opath"});
+
+    auto args = options.parse(argc, argv);
+
+    if (args.count("help") || !args.count("opath"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(args.count("help") ? 0 : -1);
+    }
+
+    exr_compression_t compression;
+    if (!parse_compression(args["compression"].as<std::string>(), compression))
+    {
+        std::cout << "Unknown compression: " << args["compression"].as<std::string>() << std::endl;
+        exit(-1);
+    }
+
+    synth_image image;
+    image.seed = args["seed"].as<uint32_t>();
+
+    if (!synth_make_preset(
+            args["preset"].as<std::string>(),
+            args["width"].as<int>(),
+            args["height"].as<int>(),
+            args["parts"].as<int>(),
+            args.count("tiled") ? EXR_STORAGE_TILED : EXR_STORAGE_SCANLINE,
+            args["tile-size"].as<int>(),
+            compression,
+            image))
+    {
+        std::cout << "Unknown preset: " << args["preset"].as<std::string>() << std::endl;
+        exit(-1);
+    }
+
+    exr_result_t rv = synth_write(image, args["opath"].as<std::string>());
+    if (rv != EXR_ERR_SUCCESS)
+    {
+        std::cout << "Cannot write " << args["opath"].as<std::string>() << ": " << exr_get_default_error_message(rv)
+                  << std::endl;
+        exit(-1);
+    }
+
+    return 0;
+}
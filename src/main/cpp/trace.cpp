@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+#include "trace.h"
+
+trace_recorder tracer;
+
+uint64_t trace_recorder::now_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int trace_recorder::thread_id()
+{
+    static std::atomic<int> next_id(1);
+    static thread_local int id = next_id++;
+
+    return id;
+}
+
+void trace_recorder::add(
+    const char *name, const char *category, uint64_t start_ns, uint64_t duration_ns, const std::string &args)
+{
+    if (!this->enabled)
+        return;
+
+    int tid = thread_id();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->events.push_back({name, category, start_ns, duration_ns, tid, args});
+}
+
+bool trace_recorder::write(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL)
+        return false;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    /* timestamps are relative to the first event, in microseconds */
+    uint64_t origin = UINT64_MAX;
+    for (const event &e : this->events)
+        origin = std::min(origin, e.start_ns);
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"exrkdu\"}}");
+
+    for (const event &e : this->events)
+    {
+        fprintf(
+            f,
+            ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+            e.name,
+            e.category,
+            e.tid,
+            (e.start_ns - origin) / 1000.0,
+            e.duration_ns / 1000.0,
+            e.args.c_str());
+    }
+
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
+
+trace_scope::~trace_scope()
+{
+    if (!tracer.is_enabled())
+        return;
+
+    std::string args;
+    if (this->part_index >= 0)
+        args += "\"part\":" + std::to_string(this->part_index);
+    if (this->y != INT32_MIN)
+        args += std::string(args.empty() ? "" : ",") + "\"y\":" + std::to_string(this->y);
+
+    tracer.add(this->name, this->category, this->start_ns, trace_recorder::now_ns() - this->start_ns, args);
+}
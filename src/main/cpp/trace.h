@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Records a timeline of the transcode in the Chrome trace event format, which
+   can be loaded in Perfetto or chrome://tracing */
+
+class trace_recorder
+{
+public:
+    trace_recorder() : enabled(false) {}
+
+    void enable() { this->enabled = true; }
+
+    bool is_enabled() const { return this->enabled; }
+
+    /* records a complete event; times are in ns of std::chrono::steady_clock */
+    void add(const char *name, const char *category, uint64_t start_ns, uint64_t duration_ns, const std::string &args);
+
+    bool write(const std::string &path);
+
+    static uint64_t now_ns();
+
+    /* small sequential identifier of the calling thread */
+    static int thread_id();
+
+private:
+    struct event
+    {
+        const char *name;
+        const char *category;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        int tid;
+        std::string args;
+    };
+
+    bool enabled;
+    std::mutex mutex;
+    std::vector<event> events;
+};
+
+extern trace_recorder tracer;
+
+/* records the lifetime of the object as an event, if tracing is enabled */
+
+class trace_scope
+{
+public:
+    trace_scope(const char *name, const char *category, int part_index = -1, int y = INT32_MIN)
+        : name(name), category(category), part_index(part_index), y(y),
+          start_ns(tracer.is_enabled() ? trace_recorder::now_ns() : 0)
+    {
+    }
+
+    ~trace_scope();
+
+private:
+    const char *name;
+    const char *category;
+    int part_index;
+    int y;
+    uint64_t start_ns;
+};
+
+#endif
@@ -0,0 +1,1759 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "chunk_cache.h"
+#include "output.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "transcode.h"
+
+static void
+check(exr_result_t r, const char *what)
+{
+    if (r != EXR_ERR_SUCCESS)
+        throw transcode_error(std::string(what) + ": " + exr_get_default_error_message(r), r);
+}
+
+/* interleaved baseband layout of a part, as produced by the decoder */
+
+struct part_layout
+{
+    exr_attr_box2i_t dw;
+    int width;
+    int height;
+    int32_t scansperchunk;
+    int chunk_count;
+    int pixelstride;
+    size_t linestride;
+    std::vector<int> ch_offset;
+
+    size_t chunk_bytes() const { return this->linestride * this->scansperchunk; }
+
+    size_t size() const { return this->linestride * this->height; }
+};
+
+static part_layout
+get_layout(exr_const_context_t f, int part_id)
+{
+    part_layout layout;
+
+    check(exr_get_data_window(f, part_id, &layout.dw), "exr_get_data_window");
+    layout.width = layout.dw.max.x - layout.dw.min.x + 1;
+    layout.height = layout.dw.max.y - layout.dw.min.y + 1;
+
+    check(exr_get_scanlines_per_chunk(f, part_id, &layout.scansperchunk), "exr_get_scanlines_per_chunk");
+    layout.chunk_count = (layout.height + layout.scansperchunk - 1) / layout.scansperchunk;
+
+    const exr_attr_chlist_t *channels;
+    check(exr_get_channels(f, part_id, &channels), "exr_get_channels");
+
+    layout.pixelstride = 0;
+    for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+    {
+        layout.ch_offset.push_back(layout.pixelstride);
+        layout.pixelstride += channels->entries[ch_id].pixel_type == EXR_PIXEL_HALF ? 2 : 4;
+    }
+    layout.linestride = (size_t)layout.pixelstride * layout.width;
+
+    return layout;
+}
+
+/* points the channels of a pipeline at a chunk of the baseband buffer */
+
+template <class Pipeline, class Ptr>
+static void
+set_channel_pointers(
+    Pipeline &pipeline, Ptr exr_coding_channel_info_t::*ptr, const part_layout &layout, uint8_t *chunk_buf)
+{
+    for (int ch_id = 0; ch_id < pipeline.channel_count; ++ch_id)
+    {
+        exr_coding_channel_info_t &channel = pipeline.channels[ch_id];
+
+        if (channel.height == 0)
+        {
+            channel.*ptr = NULL;
+            channel.user_pixel_stride = 0;
+            channel.user_line_stride = 0;
+            continue;
+        }
+
+        channel.*ptr = chunk_buf + layout.ch_offset[ch_id];
+        channel.user_pixel_stride = layout.pixelstride;
+        channel.user_line_stride = (int32_t)layout.linestride;
+    }
+}
+
+/* decodes a chunk, scanlines or tile, to `chunk_buf`; `session` is NULL to
+   use the default decoder */
+
+static void
+run_decoder(
+    exr_const_context_t f,
+    int part_id,
+    const exr_chunk_info_t &chunk,
+    const part_layout &layout,
+    uint8_t *chunk_buf,
+    exrkdu_session_t session,
+    int kdu_threads,
+    const char *stage)
+{
+    exr_decode_pipeline_t decoder;
+    check(exr_decoding_initialize(f, part_id, &chunk, &decoder), "exr_decoding_initialize");
+
+    set_channel_pointers(decoder, &exr_coding_channel_info_t::decode_to_ptr, layout, chunk_buf);
+
+    exr_result_t rv = exr_decoding_choose_default_routines(f, part_id, &decoder);
+    if (rv == EXR_ERR_SUCCESS && session)
+        rv = exrkdu_install_decoder(session, &decoder);
+    if (rv == EXR_ERR_SUCCESS && session)
+        rv = exrkdu_set_decoder_threads(&decoder, kdu_threads);
+    if (rv == EXR_ERR_SUCCESS)
+    {
+        trace_scope scope("exr_decoding_run", stage, part_id, chunk.start_y);
+        rv = exr_decoding_run(f, part_id, &decoder);
+    }
+
+    exrkdu_uninstall_decoder(&decoder);
+    exr_decoding_destroy(f, &decoder);
+
+    check(rv, "exr_decoding_run");
+}
+
+static void
+decode_chunk(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    int chunk_index,
+    uint8_t *buffer,
+    exrkdu_session_t session,
+    int kdu_threads,
+    const char *stage)
+{
+    int y = layout.dw.min.y + chunk_index * layout.scansperchunk;
+
+    exr_chunk_info_t chunk;
+    {
+        trace_scope scope("read_chunk_info", "io", part_id, y);
+        check(exr_read_scanline_chunk_info(f, part_id, y, &chunk), "exr_read_scanline_chunk_info");
+    }
+
+    run_decoder(f, part_id, chunk, layout, buffer + chunk_index * layout.chunk_bytes(), session, kdu_threads, stage);
+}
+
+static void
+decode_part(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    uint8_t *buffer,
+    exrkdu_session_t session,
+    chunk_scheduler &sched,
+    const char *stage)
+{
+    sched.plan(layout.chunk_count, layout.chunk_bytes());
+
+    sched.run(layout.chunk_count, [&](int i, int kdu_threads, memory_lease &) {
+        decode_chunk(f, part_id, layout, i, buffer, session, kdu_threads, stage);
+    });
+}
+
+/* the OpenEXR writer requires chunks in order, unless the line order of the
+   part is RANDOM_Y: chunks coded out of order are then held, with their memory
+   lease, until their predecessors are written. With RANDOM_Y, chunks are
+   written as they come and OpenEXR records their offsets in the chunk table
+   written by exr_finish(). */
+
+class ordered_writer
+{
+public:
+    typedef std::function<void(int chunk_index, const std::vector<uint8_t> &data)> write_fn;
+
+    /* writes the chunks of a scanline part */
+    ordered_writer(exr_context_t f, int part_id, const part_layout &layout)
+        : ordered_writer(f, part_id, [f, part_id, &layout](int chunk_index, const std::vector<uint8_t> &data) {
+              int y = layout.dw.min.y + chunk_index * layout.scansperchunk;
+
+              trace_scope scope("write_chunk", "io", part_id, y);
+              check(
+                  exr_write_scanline_chunk(f, part_id, y, data.data(), data.size()), "exr_write_scanline_chunk");
+          })
+    {
+    }
+
+    /* writes the chunks of a part with `write`, e.g. its tiles, by chunk index */
+    ordered_writer(exr_context_t f, int part_id, write_fn write) : write(write), next(0)
+    {
+        exr_lineorder_t lineorder;
+        check(exr_get_lineorder(f, part_id, &lineorder), "exr_get_lineorder");
+        this->in_order = lineorder != EXR_LINEORDER_RANDOM_Y;
+    }
+
+    void commit(int chunk_index, std::vector<uint8_t> &&data, memory_lease &&lease)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        if (!this->in_order)
+        {
+            this->write(chunk_index, data);
+            return;
+        }
+
+        this->pending[chunk_index] = std::make_pair(std::move(data), std::move(lease));
+
+        for (auto it = this->pending.begin(); it != this->pending.end() && it->first == this->next;
+             it = this->pending.erase(it), this->next++)
+            this->write(this->next, it->second.first);
+    }
+
+private:
+    write_fn write;
+    std::mutex mutex;
+    std::map<int, std::pair<std::vector<uint8_t>, memory_lease>> pending;
+    int next;
+    bool in_order;
+};
+
+/* chunks are handed to the ordered writer instead of being written by the
+   pipeline */
+static exr_result_t
+defer_write(exr_encode_pipeline_t *)
+{
+    return EXR_ERR_SUCCESS;
+}
+
+/* encodes a chunk, scanlines or tile, from `chunk_buf` */
+
+static std::vector<uint8_t>
+run_encoder(
+    exr_context_t f,
+    int part_id,
+    const exr_chunk_info_t &chunk,
+    const part_layout &layout,
+    uint8_t *chunk_buf,
+    exrkdu_session_t session,
+    int kdu_threads)
+{
+    exr_encode_pipeline_t encoder;
+    check(exr_encoding_initialize(f, part_id, &chunk, &encoder), "exr_encoding_initialize");
+
+    set_channel_pointers(encoder, &exr_coding_channel_info_t::encode_from_ptr, layout, chunk_buf);
+
+    std::vector<uint8_t> compressed(chunk.unpacked_size);
+    std::vector<uint8_t> data;
+
+    exr_result_t rv = exr_encoding_choose_default_routines(f, part_id, &encoder);
+    if (rv == EXR_ERR_SUCCESS)
+    {
+        encoder.compressed_buffer = compressed.data();
+        encoder.compressed_alloc_size = compressed.size();
+        encoder.write_fn = defer_write;
+        rv = exrkdu_install_encoder(session, &encoder);
+    }
+    if (rv == EXR_ERR_SUCCESS)
+        rv = exrkdu_set_encoder_threads(&encoder, kdu_threads);
+    if (rv == EXR_ERR_SUCCESS)
+    {
+        trace_scope scope("exr_encoding_run", "encode", part_id, chunk.start_y);
+        rv = exr_encoding_run(f, part_id, &encoder);
+    }
+    if (rv == EXR_ERR_SUCCESS)
+    {
+        /* a chunk stored uncompressed is left in the packed buffer */
+        const uint8_t *src = (const uint8_t *)encoder.compressed_buffer;
+        if (encoder.compressed_bytes == encoder.packed_bytes && encoder.packed_buffer)
+            src = (const uint8_t *)encoder.packed_buffer;
+        data.assign(src, src + encoder.compressed_bytes);
+    }
+
+    exrkdu_uninstall_encoder(&encoder);
+    encoder.compressed_buffer = NULL;
+    encoder.compressed_alloc_size = 0;
+    exr_encoding_destroy(f, &encoder);
+
+    check(rv, "exr_encoding_run");
+
+    return data;
+}
+
+static std::vector<uint8_t>
+encode_chunk(
+    exr_context_t f,
+    int part_id,
+    const part_layout &layout,
+    int chunk_index,
+    uint8_t *buffer,
+    exrkdu_session_t session,
+    int kdu_threads)
+{
+    int y = layout.dw.min.y + chunk_index * layout.scansperchunk;
+
+    exr_chunk_info_t chunk;
+    check(exr_write_scanline_chunk_info(f, part_id, y, &chunk), "exr_write_scanline_chunk_info");
+
+    return run_encoder(f, part_id, chunk, layout, buffer + chunk_index * layout.chunk_bytes(), session, kdu_threads);
+}
+
+/* name of the string attribute that holds the digests of the baseband chunks
+   of a part, in chunk order, as 32 hexadecimal digits each */
+static const char CHUNK_DIGESTS_ATTR[] = "exrkduChunkDigests";
+
+/* version of the digests, bumped whenever what they cover changes, so that
+   chunks keyed by earlier digests are never reused */
+#define CHUNK_DIGEST_VERSION "2"
+
+/* digests of the baseband chunks of a part; the channel list, the chunk
+   dimensions and the codec configuration that changes the coded bytes are part
+   of the digest, since the compressed bytes of a chunk can only be reused for
+   chunks that match them and that the session would code the same way */
+static std::vector<chunk_digest>
+digest_part(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    const uint8_t *buffer,
+    exrkdu_session_t session,
+    chunk_scheduler &sched)
+{
+    const exr_attr_chlist_t *channels;
+    check(exr_get_channels(f, part_id, &channels), "exr_get_channels");
+
+    exrkdu_config_t config;
+    exrkdu_session_get_config(session, &config);
+
+    std::string desc = "v" CHUNK_DIGEST_VERSION ";constant=" + std::to_string(config.constant_chunks != 0) +
+                       ";groups=" + std::to_string(config.channel_groups != 0) +
+                       ";tile=" + std::to_string(std::max(config.tile_width, 0)) +
+                       ";ap=" + std::to_string(config.adaptive_precision != 0) + ";" + std::to_string(layout.width);
+    for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+    {
+        const exr_attr_chlist_entry_t &ch = channels->entries[ch_id];
+        desc += ";" + std::string(ch.name.str, ch.name.length) + ":" + std::to_string(ch.pixel_type) + ":" +
+                std::to_string(ch.x_sampling) + ":" + std::to_string(ch.y_sampling);
+    }
+    chunk_digest seed = digest_bytes(desc.data(), desc.size(), {0, 0});
+
+    std::vector<chunk_digest> digests(layout.chunk_count);
+
+    sched.plan(layout.chunk_count, layout.chunk_bytes());
+
+    sched.run(layout.chunk_count, [&](int i, int, memory_lease &) {
+        int32_t lines = std::min(layout.scansperchunk, layout.height - i * layout.scansperchunk);
+        chunk_digest chunk_seed = digest_bytes(&lines, sizeof(lines), seed);
+        digests[i] = digest_bytes(buffer + i * layout.chunk_bytes(), lines * layout.linestride, chunk_seed);
+    });
+
+    return digests;
+}
+
+/* compressed chunks of a previous output, by digest of their baseband
+   samples, across all its parts */
+
+struct previous_output
+{
+    exr_const_context_t f;
+    std::vector<part_layout> layouts;
+    std::map<chunk_digest, std::pair<int, int>> chunks;
+};
+
+static void
+load_previous(exr_const_context_t f, previous_output &prev)
+{
+    prev.f = f;
+
+    int part_count;
+    check(exr_get_count(f, &part_count), "exr_get_count");
+
+    prev.layouts.resize(part_count);
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        exr_storage_t storage;
+        exr_compression_t compression;
+        int32_t length;
+        const char *digests;
+        if (exr_get_storage(f, part_id, &storage) != EXR_ERR_SUCCESS || storage != EXR_STORAGE_SCANLINE ||
+            exr_get_compression(f, part_id, &compression) != EXR_ERR_SUCCESS ||
+            compression != EXR_COMPRESSION_HTJ2K ||
+            exr_attr_get_string(f, part_id, CHUNK_DIGESTS_ATTR, &length, &digests) != EXR_ERR_SUCCESS)
+            continue;
+
+        prev.layouts[part_id] = get_layout(f, part_id);
+        if (length != prev.layouts[part_id].chunk_count * 32)
+            continue;
+
+        for (int i = 0; i < prev.layouts[part_id].chunk_count; i++)
+        {
+            chunk_digest digest;
+            if (digest_from_hex(digests + 32 * i, digest))
+                prev.chunks.emplace(digest, std::make_pair(part_id, i));
+        }
+    }
+}
+
+static bool
+read_previous_chunk(const previous_output &prev, const chunk_digest &digest, std::vector<uint8_t> &data)
+{
+    auto it = prev.chunks.find(digest);
+    if (it == prev.chunks.end())
+        return false;
+
+    int part_id = it->second.first;
+    const part_layout &layout = prev.layouts[part_id];
+    int y = layout.dw.min.y + it->second.second * layout.scansperchunk;
+
+    exr_chunk_info_t chunk;
+    if (exr_read_scanline_chunk_info(prev.f, part_id, y, &chunk) != EXR_ERR_SUCCESS)
+        return false;
+
+    data.resize(chunk.packed_size);
+    return exr_read_chunk(prev.f, part_id, &chunk, data.data()) == EXR_ERR_SUCCESS;
+}
+
+/* sources of compressed chunks for unchanged content */
+
+struct chunk_reuse
+{
+    const previous_output *previous;
+    const chunk_cache *cache;
+    std::atomic<uint64_t> reused;
+    std::atomic<uint64_t> cached;
+};
+
+static void
+encode_part(
+    exr_context_t f,
+    int part_id,
+    const part_layout &layout,
+    uint8_t *buffer,
+    const std::vector<chunk_digest> &digests,
+    chunk_reuse &reuse,
+    exrkdu_session_t session,
+    bool two_phase,
+    chunk_scheduler &sched)
+{
+    sched.plan(layout.chunk_count, layout.chunk_bytes());
+
+    ordered_writer writer(f, part_id, layout);
+
+    /* in two phases, all chunks are coded before the first is written, so that
+       the writes are not paced by the coding; their leases end with the coding
+       since the job holds the memory of the coded part */
+    std::vector<std::vector<uint8_t>> coded(two_phase ? layout.chunk_count : 0);
+    auto commit = [&](int i, std::vector<uint8_t> &&data, memory_lease &lease) {
+        if (two_phase)
+            coded[i] = std::move(data);
+        else
+            writer.commit(i, std::move(data), std::move(lease));
+    };
+
+    sched.run(layout.chunk_count, [&](int i, int kdu_threads, memory_lease &lease) {
+        int y = layout.dw.min.y + i * layout.scansperchunk;
+        std::vector<uint8_t> data;
+
+        if (reuse.previous)
+        {
+            trace_scope scope("read_previous_chunk", "io", part_id, y);
+            if (read_previous_chunk(*reuse.previous, digests[i], data))
+            {
+                reuse.reused++;
+                commit(i, std::move(data), lease);
+                return;
+            }
+        }
+
+        if (reuse.cache)
+        {
+            trace_scope scope("read_cached_chunk", "io", part_id, y);
+            if (reuse.cache->get(digests[i], data))
+            {
+                reuse.cached++;
+                commit(i, std::move(data), lease);
+                return;
+            }
+        }
+
+        data = encode_chunk(f, part_id, layout, i, buffer, session, kdu_threads);
+
+        if (reuse.cache)
+            reuse.cache->put(digests[i], data);
+
+        commit(i, std::move(data), lease);
+    });
+
+    for (int i = 0; i < (int)coded.size(); i++)
+    {
+        writer.commit(i, std::move(coded[i]), memory_lease());
+    }
+}
+
+/* copies one HTJ2K chunk of the source as is; returns its size */
+
+static size_t
+copy_chunk(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    int chunk_index,
+    exrkdu_session_t session,
+    bool validate,
+    memory_lease &lease,
+    ordered_writer &writer)
+{
+    int y = layout.dw.min.y + chunk_index * layout.scansperchunk;
+
+    exr_chunk_info_t chunk;
+    check(exr_read_scanline_chunk_info(f, part_id, y, &chunk), "exr_read_scanline_chunk_info");
+
+    std::vector<uint8_t> data(chunk.packed_size);
+    {
+        trace_scope scope("read_chunk", "io", part_id, y);
+        check(exr_read_chunk(f, part_id, &chunk, data.data()), "exr_read_chunk");
+    }
+
+    if (validate)
+    {
+        trace_scope scope("validate_chunk", "copy", part_id, y);
+
+        exr_decode_pipeline_t decoder;
+        check(exr_decoding_initialize(f, part_id, &chunk, &decoder), "exr_decoding_initialize");
+        exr_result_t rv = exrkdu_validate_chunk(session, &decoder, data.data(), data.size());
+        exr_decoding_destroy(f, &decoder);
+
+        check(rv, "exrkdu_validate_chunk");
+    }
+
+    size_t size = data.size();
+    writer.commit(chunk_index, std::move(data), std::move(lease));
+
+    return size;
+}
+
+static uint64_t
+copy_part(
+    exr_const_context_t src,
+    exr_context_t dst,
+    int part_id,
+    const part_layout &layout,
+    exrkdu_session_t session,
+    bool validate,
+    chunk_scheduler &sched)
+{
+    sched.plan(layout.chunk_count, layout.chunk_bytes());
+
+    ordered_writer writer(dst, part_id, layout);
+    std::atomic<uint64_t> copied(0);
+
+    sched.run(layout.chunk_count, [&](int i, int, memory_lease &lease) {
+        copied += copy_chunk(src, part_id, layout, i, session, validate, lease, writer);
+    });
+
+    return copied;
+}
+
+/* closes a context on scope exit, unless it was finished explicitly */
+
+class context_guard
+{
+public:
+    explicit context_guard(exr_context_t &f) : f(f) {}
+
+    ~context_guard()
+    {
+        if (this->f)
+            exr_finish(&this->f);
+    }
+
+    void finish(const char *what) { check(exr_finish(&this->f), what); }
+
+private:
+    exr_context_t &f;
+};
+
+/* decodes `enc_fn` and compares it with the baseband of each part, skipping
+   the parts without baseband */
+
+static void
+verify_parts(
+    exrkdu_session_t session,
+    const std::string &enc_fn,
+    const std::vector<std::vector<uint8_t>> &baseband_bufs,
+    const transcode_options &options,
+    chunk_scheduler &sched)
+{
+    exr_context_t dec_file = NULL;
+    check(exr_start_read(&dec_file, enc_fn.c_str(), NULL), "exr_start_read");
+    context_guard dec_guard(dec_file);
+
+    int part_count;
+    check(exr_get_count(dec_file, &part_count), "exr_get_count");
+    if (part_count != (int)baseband_bufs.size())
+        throw transcode_error("Decoded image does not match the source image");
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        if (baseband_bufs[part_id].empty())
+            continue;
+
+        part_layout layout = get_layout(dec_file, part_id);
+        if (layout.size() != baseband_bufs[part_id].size())
+            throw transcode_error("Decoded image does not match the source image");
+
+        std::vector<uint8_t> dec_buffer(layout.size());
+
+        decode_part(
+            dec_file, part_id, layout, dec_buffer.data(), options.default_decoder ? NULL : session, sched, "verify");
+
+        trace_scope scope("compare", "verify", part_id);
+        if (dec_buffer != baseband_bufs[part_id])
+            throw transcode_error("Decoded image does not match the source image");
+    }
+
+    dec_guard.finish("exr_finish");
+}
+
+/* lossless HTJ2K is on par with the lossless OpenEXR codecs, so the source
+   size is used as the estimate of the output size; the excess is trimmed when
+   the output is closed */
+
+static uint64_t
+estimate_output_size(const std::string &src_fn)
+{
+    std::ifstream src(src_fn, std::ios::binary | std::ios::ate);
+    return src ? (uint64_t)src.tellg() : 0;
+}
+
+/* starts writing `enc_fn`, through `output` if the options ask for a write
+   buffer, which is preallocated to `size_estimate` if they ask for it */
+
+static void
+start_output(
+    const std::string &enc_fn,
+    uint64_t size_estimate,
+    const transcode_options &options,
+    buffered_output &output,
+    exr_context_t &enc_file)
+{
+    exr_context_initializer_t enc_init = EXR_DEFAULT_CONTEXT_INITIALIZER;
+
+    if (options.write_buffer > 0)
+    {
+        output_options output_opts;
+        output_opts.buffer_size = options.write_buffer;
+        output_opts.preallocate = options.preallocate ? size_estimate : 0;
+        output_opts.direct_io = options.direct_io;
+        output_opts.io_threads = options.io_threads;
+
+        std::string error;
+        if (!output.open(enc_fn, output_opts, error))
+            throw transcode_error(error, EXR_ERR_FILE_ACCESS);
+
+        output.install(enc_init);
+    }
+
+    check(exr_start_write(&enc_file, enc_fn.c_str(), EXR_WRITE_FILE_DIRECTLY, &enc_init), "exr_start_write");
+}
+
+static void
+finish_output(
+    context_guard &enc_guard, buffered_output &output, const transcode_options &options, transcode_stats &stats)
+{
+    trace_scope scope("exr_finish", "io");
+    enc_guard.finish("exr_finish");
+
+    std::string error;
+    if (options.write_buffer > 0 && !output.close(error))
+        throw transcode_error(error, EXR_ERR_WRITE_IO);
+    stats.write_calls = output.write_calls();
+}
+
+/* holds the memory of a job from `budget`: the baseband buffers of the parts
+   of `f` for the whole job, since the chunk digests and the verification need
+   the whole frame, plus `extra_parts` buffers of the largest part, e.g. for the
+   decoded part being verified, and room for the working buffers of its chunks,
+   which are then admitted chunk by chunk, in order, by the scheduler */
+
+class job_memory
+{
+public:
+    job_memory(memory_budget *budget, exr_const_context_t f, int part_count, int extra_parts, chunk_scheduler &sched)
+    {
+        if (budget == NULL || budget->limit() == 0)
+            return;
+
+        uint64_t frame_bytes = 0;
+        uint64_t max_part_bytes = 0;
+        size_t max_chunk_bytes = 0;
+        for (int part_id = 0; part_id < part_count; part_id++)
+        {
+            part_layout layout = get_layout(f, part_id);
+            frame_bytes += layout.size();
+            max_part_bytes = std::max<uint64_t>(max_part_bytes, layout.size());
+            max_chunk_bytes = std::max(max_chunk_bytes, layout.chunk_bytes());
+        }
+        frame_bytes += extra_parts * max_part_bytes;
+
+        this->hold(budget, frame_bytes, max_chunk_bytes, sched);
+    }
+
+    /* holds `job_bytes` for the whole job, e.g. the mip levels of a frame,
+       plus room for the working buffers of chunks of `max_chunk_bytes` */
+    job_memory(memory_budget *budget, uint64_t job_bytes, size_t max_chunk_bytes, chunk_scheduler &sched)
+    {
+        if (budget == NULL || budget->limit() == 0)
+            return;
+
+        this->hold(budget, job_bytes, max_chunk_bytes, sched);
+    }
+
+private:
+    void hold(memory_budget *budget, uint64_t job_bytes, size_t max_chunk_bytes, chunk_scheduler &sched)
+    {
+        /* room for one chunk at least, and for no more chunks than can run */
+        uint64_t chunk_bytes = chunk_scheduler::chunk_working_bytes(max_chunk_bytes);
+        uint64_t rest = budget->limit() > job_bytes ? budget->limit() - job_bytes : 0;
+        uint64_t reserve = std::min((uint64_t)sched.cores() * chunk_bytes, std::max(chunk_bytes, rest));
+
+        this->lease = memory_lease(budget, job_bytes + reserve);
+        this->chunks.reset(new memory_budget(reserve));
+        sched.set_budget(this->chunks.get());
+    }
+
+    memory_lease lease;
+    std::unique_ptr<memory_budget> chunks;
+};
+
+transcode_stats
+transcode(
+    exrkdu_session_t session, const std::string &src_fn, const std::string &enc_fn, const transcode_options &options)
+{
+    transcode_stats stats = {0};
+
+    if (options.previous == enc_fn)
+        throw transcode_error("The previous output cannot be overwritten", EXR_ERR_INVALID_ARGUMENT);
+
+    if (options.io_threads > 0 && options.write_buffer == 0)
+        throw transcode_error("Concurrent writes require a write buffer", EXR_ERR_INVALID_ARGUMENT);
+
+    chunk_scheduler sched(
+        options.cores > 0 ? options.cores : available_cores(), options.kdu_threads, options.pool);
+
+    /* source file */
+
+    exr_context_t src_file = NULL;
+    check(exr_start_read(&src_file, src_fn.c_str(), NULL), "exr_start_read");
+    context_guard src_guard(src_file);
+
+    int part_count;
+    check(exr_get_count(src_file, &part_count), "exr_get_count");
+
+    /* encoded file */
+
+    buffered_output output;
+    exr_context_t enc_file = NULL;
+    start_output(enc_fn, estimate_output_size(src_fn), options, output, enc_file);
+    context_guard enc_guard(enc_file);
+
+    /* copy parts to the output file */
+
+    std::vector<bool> passthrough(part_count, false);
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        exr_storage_t stortype;
+        check(exr_get_storage(src_file, part_id, &stortype), "exr_get_storage");
+        if (stortype != EXR_STORAGE_SCANLINE)
+            throw transcode_error("Only supports scanline files", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        const char *pn = NULL;
+        exr_get_name(src_file, part_id, &pn);
+
+        int new_part_id = 0;
+        check(exr_add_part(enc_file, pn, EXR_STORAGE_SCANLINE, &new_part_id), "exr_add_part");
+
+        if (new_part_id != part_id)
+            throw transcode_error("Part index mismatch");
+
+        check(exr_copy_unset_attributes(enc_file, part_id, src_file, part_id), "exr_copy_unset_attributes");
+        check(exr_set_compression(enc_file, part_id, EXR_COMPRESSION_HTJ2K), "exr_set_compression");
+        if (options.random_order)
+            check(exr_set_lineorder(enc_file, part_id, EXR_LINEORDER_RANDOM_Y), "exr_set_lineorder");
+
+        exr_compression_t compression;
+        check(exr_get_compression(src_file, part_id, &compression), "exr_get_compression");
+        passthrough[part_id] = options.passthrough && compression == EXR_COMPRESSION_HTJ2K;
+    }
+
+    /* passthrough parts are counted, since those whose chunks do not match
+       are decoded; a part coded in two phases is held compressed, which
+       lossless coding keeps below its baseband size */
+    job_memory memory(
+        options.budget, src_file, part_count, (options.verify ? 1 : 0) + (options.io_threads > 0 ? 1 : 0), sched);
+
+    /* decode each part to a baseband buffer, whose chunk digests are recorded
+       in the header of the output for later incremental transcodes */
+
+    std::vector<std::vector<uint8_t>> baseband_bufs(part_count);
+    std::vector<std::vector<chunk_digest>> digests(part_count);
+
+    auto decode_source = [&](int part_id, const part_layout &layout) {
+        baseband_bufs[part_id].resize(layout.size());
+        stats.baseband_bytes += layout.size();
+
+        decode_part(src_file, part_id, layout, baseband_bufs[part_id].data(), NULL, sched, "decode");
+
+        trace_scope scope("digest_part", "decode", part_id);
+        digests[part_id] = digest_part(src_file, part_id, layout, baseband_bufs[part_id].data(), session, sched);
+    };
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        if (passthrough[part_id])
+            continue;
+
+        decode_source(part_id, get_layout(src_file, part_id));
+
+        std::string hex;
+        for (const chunk_digest &digest : digests[part_id])
+            hex += digest_to_hex(digest);
+        check(exr_attr_set_string(enc_file, part_id, CHUNK_DIGESTS_ATTR, hex.c_str()), "exr_attr_set_string");
+    }
+
+    check(exr_write_header(enc_file), "exr_write_header");
+
+    /* compressed chunks of unchanged content */
+
+    exr_context_t prev_file = NULL;
+    context_guard prev_guard(prev_file);
+    previous_output previous;
+    if (!options.previous.empty())
+    {
+        check(exr_start_read(&prev_file, options.previous.c_str(), NULL), "exr_start_read");
+        load_previous(prev_file, previous);
+    }
+
+    std::unique_ptr<chunk_cache> cache;
+    if (!options.cache_dir.empty())
+        cache.reset(new chunk_cache(options.cache_dir));
+
+    chunk_reuse reuse;
+    reuse.previous = prev_file ? &previous : NULL;
+    reuse.cache = cache.get();
+    reuse.reused = 0;
+    reuse.cached = 0;
+
+    /* encode each part, or copy its chunks */
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        part_layout layout = get_layout(src_file, part_id);
+
+        /* chunks are copied only if they cover the same scanlines */
+        if (passthrough[part_id])
+        {
+            part_layout enc_layout = get_layout(enc_file, part_id);
+            passthrough[part_id] = enc_layout.scansperchunk == layout.scansperchunk &&
+                                   enc_layout.chunk_count == layout.chunk_count;
+        }
+
+        if (passthrough[part_id])
+        {
+            stats.copied_bytes += copy_part(src_file, enc_file, part_id, layout, session, options.validate, sched);
+            continue;
+        }
+
+        /* a passthrough part whose chunks do not match is transcoded; the
+           header is written, so its digests serve the cache but are not
+           recorded in the output */
+        if (baseband_bufs[part_id].empty())
+            decode_source(part_id, layout);
+
+        encode_part(
+            enc_file, part_id, layout, baseband_bufs[part_id].data(), digests[part_id], reuse, session,
+            options.io_threads > 0, sched);
+    }
+
+    stats.reused_chunks = reuse.reused;
+    stats.cached_chunks = reuse.cached;
+
+    if (prev_file)
+        prev_guard.finish("exr_finish");
+    src_guard.finish("exr_finish");
+    finish_output(enc_guard, output, options, stats);
+
+    if (options.verify)
+        verify_parts(session, enc_fn, baseband_bufs, options, sched);
+
+    return stats;
+}
+
+void
+verify(exrkdu_session_t session, const std::string &src_fn, const std::string &enc_fn, const transcode_options &options)
+{
+    chunk_scheduler sched(
+        options.cores > 0 ? options.cores : available_cores(), options.kdu_threads, options.pool);
+
+    exr_context_t src_file = NULL;
+    check(exr_start_read(&src_file, src_fn.c_str(), NULL), "exr_start_read");
+    context_guard src_guard(src_file);
+
+    int part_count;
+    check(exr_get_count(src_file, &part_count), "exr_get_count");
+
+    std::vector<std::vector<uint8_t>> baseband_bufs(part_count);
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        exr_storage_t stortype;
+        check(exr_get_storage(src_file, part_id, &stortype), "exr_get_storage");
+        if (stortype != EXR_STORAGE_SCANLINE)
+            throw transcode_error("Only supports scanline files", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+    }
+
+    job_memory memory(options.budget, src_file, part_count, 1, sched);
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        part_layout layout = get_layout(src_file, part_id);
+        baseband_bufs[part_id].resize(layout.size());
+
+        decode_part(src_file, part_id, layout, baseband_bufs[part_id].data(), NULL, sched, "decode");
+    }
+
+    src_guard.finish("exr_finish");
+
+    verify_parts(session, enc_fn, baseband_bufs, options, sched);
+}
+
+/* windows of a proxy: the samples of a JPEG 2000 resolution reduced by
+   `levels` cover ceil(size / 2^levels) samples from floor(min / 2^levels) */
+
+static exr_attr_box2i_t
+reduce_box(const exr_attr_box2i_t &box, int levels)
+{
+    auto reduce_min = [levels](int32_t v) { return v >= 0 ? v >> levels : -((-v + (1 << levels) - 1) >> levels); };
+    auto reduce_size = [levels](int32_t min, int32_t max) { return ((max - min) >> levels) + 1; };
+
+    exr_attr_box2i_t reduced;
+    reduced.min.x = reduce_min(box.min.x);
+    reduced.min.y = reduce_min(box.min.y);
+    reduced.max.x = reduced.min.x + reduce_size(box.min.x, box.max.x) - 1;
+    reduced.max.y = reduced.min.y + reduce_size(box.min.y, box.max.y) - 1;
+
+    return reduced;
+}
+
+/* decodes the source chunks from `first` at the resolution of the proxy and
+   stacks them into the uncompressed proxy chunk of `rows` lines */
+
+static std::vector<uint8_t>
+decode_proxy_chunk(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    const part_layout &proxy_layout,
+    int first,
+    int rows,
+    const std::vector<exr_chunk_info_t> &infos,
+    const std::vector<std::vector<uint8_t>> &chunks,
+    int levels,
+    exrkdu_session_t session)
+{
+    std::vector<uint8_t> raw((size_t)rows * proxy_layout.linestride);
+    size_t offset = 0;
+
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        int y = layout.dw.min.y + (first + (int)k) * layout.scansperchunk;
+        trace_scope scope("decode_reduced", "proxy", part_id, y);
+
+        exr_decode_pipeline_t decoder;
+        check(exr_decoding_initialize(f, part_id, &infos[k], &decoder), "exr_decoding_initialize");
+
+        int discarded;
+        exr_result_t rv = exrkdu_decode_reduced(
+            session, &decoder, chunks[k].data(), chunks[k].size(), levels, raw.data() + offset, raw.size() - offset,
+            &discarded);
+        exr_decoding_destroy(f, &decoder);
+        check(rv, "exrkdu_decode_reduced");
+
+        if (discarded != levels)
+            throw transcode_error("Chunks have too few DWT levels for the proxy", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        int chunk_rows = std::min(layout.scansperchunk, layout.height - (first + (int)k) * layout.scansperchunk);
+        offset += (size_t)((chunk_rows + (1 << levels) - 1) >> levels) * proxy_layout.linestride;
+    }
+
+    return raw;
+}
+
+/* reads the source chunks of proxy chunk `proxy_index` and rewrites them as
+   that chunk; a proxy codestream no smaller than the samples, e.g. of noise
+   whose code-blocks gain nothing from dropping DWT levels, is replaced by the
+   samples, stored uncompressed as the encoder does */
+
+static std::vector<uint8_t>
+proxy_chunk(
+    exr_const_context_t f,
+    int part_id,
+    const part_layout &layout,
+    const part_layout &proxy_layout,
+    int proxy_index,
+    int levels,
+    exrkdu_session_t session)
+{
+    int first = proxy_index << levels;
+    int last = std::min(layout.chunk_count, first + (1 << levels));
+    int rows = std::min(proxy_layout.scansperchunk, proxy_layout.height - proxy_index * proxy_layout.scansperchunk);
+    uint64_t unpacked_size = (uint64_t)rows * proxy_layout.linestride;
+
+    std::vector<exr_chunk_info_t> infos(last - first);
+    std::vector<std::vector<uint8_t>> chunks(last - first);
+    std::vector<const void *> data;
+    std::vector<uint64_t> sizes;
+
+    for (int i = first; i < last; i++)
+    {
+        int y = layout.dw.min.y + i * layout.scansperchunk;
+
+        exr_chunk_info_t &chunk = infos[i - first];
+        check(exr_read_scanline_chunk_info(f, part_id, y, &chunk), "exr_read_scanline_chunk_info");
+        if (chunk.packed_size == chunk.unpacked_size)
+            throw transcode_error(
+                "Proxies cannot be made from chunks stored uncompressed", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        std::vector<uint8_t> &chunk_data = chunks[i - first];
+        chunk_data.resize(chunk.packed_size);
+        {
+            trace_scope scope("read_chunk", "io", part_id, y);
+            check(exr_read_chunk(f, part_id, &chunk, chunk_data.data()), "exr_read_chunk");
+        }
+
+        data.push_back(chunk_data.data());
+        sizes.push_back(chunk_data.size());
+    }
+
+    /* a chunk whose size is that of its samples reads as uncompressed, hence
+       the proxy codestream must be strictly smaller */
+    std::vector<uint8_t> out(unpacked_size > 0 ? unpacked_size - 1 : 0);
+    uint64_t out_size;
+    exr_result_t rv;
+    {
+        trace_scope scope("proxy_chunks", "proxy", part_id, layout.dw.min.y + first * layout.scansperchunk);
+        rv = exrkdu_proxy_chunks(
+            session, data.data(), sizes.data(), (int)data.size(), levels, out.data(), out.size(), &out_size);
+    }
+
+    if (rv == EXR_ERR_OUT_OF_MEMORY)
+        return decode_proxy_chunk(f, part_id, layout, proxy_layout, first, rows, infos, chunks, levels, session);
+
+    check(rv, "exrkdu_proxy_chunks");
+    out.resize(out_size);
+
+    return out;
+}
+
+transcode_stats
+make_proxy(
+    exrkdu_session_t session,
+    const std::string &src_fn,
+    const std::string &enc_fn,
+    int levels,
+    const transcode_options &options)
+{
+    transcode_stats stats = {0};
+
+    if (levels < 1 || levels > 15)
+        throw transcode_error("A proxy discards between 1 and 15 resolution levels", EXR_ERR_INVALID_ARGUMENT);
+
+    if (options.io_threads > 0 && options.write_buffer == 0)
+        throw transcode_error("Concurrent writes require a write buffer", EXR_ERR_INVALID_ARGUMENT);
+
+    chunk_scheduler sched(
+        options.cores > 0 ? options.cores : available_cores(), options.kdu_threads, options.pool);
+
+    exr_context_t src_file = NULL;
+    check(exr_start_read(&src_file, src_fn.c_str(), NULL), "exr_start_read");
+    context_guard src_guard(src_file);
+
+    int part_count;
+    check(exr_get_count(src_file, &part_count), "exr_get_count");
+
+    buffered_output output;
+    exr_context_t enc_file = NULL;
+    start_output(enc_fn, estimate_output_size(src_fn) >> levels, options, output, enc_file);
+    context_guard enc_guard(enc_file);
+
+    /* each part keeps its chunk height, so that 2^levels source chunks make
+       one proxy chunk */
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        exr_storage_t stortype;
+        check(exr_get_storage(src_file, part_id, &stortype), "exr_get_storage");
+        if (stortype != EXR_STORAGE_SCANLINE)
+            throw transcode_error("Only supports scanline files", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        exr_compression_t compression;
+        check(exr_get_compression(src_file, part_id, &compression), "exr_get_compression");
+        if (compression != EXR_COMPRESSION_HTJ2K)
+            throw transcode_error(
+                "Proxies are made from parts compressed with HTJ2K", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        const exr_attr_chlist_t *channels;
+        check(exr_get_channels(src_file, part_id, &channels), "exr_get_channels");
+        for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+        {
+            if (channels->entries[ch_id].x_sampling != 1 || channels->entries[ch_id].y_sampling != 1)
+                throw transcode_error(
+                    "Proxies of subsampled channels are not supported", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+        }
+
+        part_layout layout = get_layout(src_file, part_id);
+        if (layout.scansperchunk % (1 << levels) != 0)
+            throw transcode_error("Chunks are too short for the proxy", EXR_ERR_INVALID_ARGUMENT);
+
+        const char *pn = NULL;
+        exr_get_name(src_file, part_id, &pn);
+
+        int new_part_id = 0;
+        check(exr_add_part(enc_file, pn, EXR_STORAGE_SCANLINE, &new_part_id), "exr_add_part");
+
+        if (new_part_id != part_id)
+            throw transcode_error("Part index mismatch");
+
+        exr_attr_box2i_t display_window;
+        check(exr_get_display_window(src_file, part_id, &display_window), "exr_get_display_window");
+        exr_attr_box2i_t proxy_data_window = reduce_box(layout.dw, levels);
+        exr_attr_box2i_t proxy_display_window = reduce_box(display_window, levels);
+        check(exr_set_data_window(enc_file, part_id, &proxy_data_window), "exr_set_data_window");
+        check(exr_set_display_window(enc_file, part_id, &proxy_display_window), "exr_set_display_window");
+
+        /* the chunk digests of the source are those of its full resolution */
+        check(exr_attr_set_string(enc_file, part_id, CHUNK_DIGESTS_ATTR, ""), "exr_attr_set_string");
+
+        check(exr_copy_unset_attributes(enc_file, part_id, src_file, part_id), "exr_copy_unset_attributes");
+        check(exr_set_compression(enc_file, part_id, EXR_COMPRESSION_HTJ2K), "exr_set_compression");
+        if (options.random_order)
+            check(exr_set_lineorder(enc_file, part_id, EXR_LINEORDER_RANDOM_Y), "exr_set_lineorder");
+    }
+
+    check(exr_write_header(enc_file), "exr_write_header");
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        part_layout layout = get_layout(src_file, part_id);
+        part_layout proxy_layout = get_layout(enc_file, part_id);
+        sched.plan(proxy_layout.chunk_count, proxy_layout.chunk_bytes());
+
+        ordered_writer writer(enc_file, part_id, proxy_layout);
+
+        sched.run(proxy_layout.chunk_count, [&](int i, int, memory_lease &lease) {
+            writer.commit(i, proxy_chunk(src_file, part_id, layout, proxy_layout, i, levels, session), std::move(lease));
+        });
+    }
+
+    src_guard.finish("exr_finish");
+    finish_output(enc_guard, output, options, stats);
+
+    return stats;
+}
+
+/* mip levels are held as baseband buffers in the layout of the source part,
+   at the sizes of the levels of the tiled output */
+
+static std::vector<part_layout>
+mip_layouts(exr_const_context_t tiled_f, int part_id, const part_layout &base)
+{
+    int32_t levels_x, levels_y;
+    check(exr_get_tile_levels(tiled_f, part_id, &levels_x, &levels_y), "exr_get_tile_levels");
+
+    std::vector<part_layout> levels(levels_x, base);
+    for (int level = 0; level < levels_x; level++)
+    {
+        part_layout &layout = levels[level];
+        check(
+            exr_get_level_sizes(tiled_f, part_id, level, level, &layout.width, &layout.height), "exr_get_level_sizes");
+        layout.dw.max.x = layout.dw.min.x + layout.width - 1;
+        layout.dw.max.y = layout.dw.min.y + layout.height - 1;
+        layout.scansperchunk = base.scansperchunk >> level;
+        layout.linestride = (size_t)layout.pixelstride * layout.width;
+    }
+
+    return levels;
+}
+
+static float
+half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+
+    if (exp == 0x1f)
+        x = sign | 0x7f800000 | (mant << 13);
+    else if (exp != 0)
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (mant == 0)
+        x = sign;
+    else
+    {
+        /* subnormal: normalize the mantissa */
+        exp = 113;
+        while (!(mant & 0x400))
+        {
+            mant <<= 1;
+            exp--;
+        }
+        x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+/* round to nearest even, with subnormals */
+
+static uint16_t
+float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000)
+        return (uint16_t)(sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00));
+    if (abs >= 0x477ff000)
+        return (uint16_t)(sign | 0x7c00);
+    if (abs < 0x33000000)
+        return (uint16_t)sign;
+
+    uint32_t r, rem, halfway;
+    if (abs < 0x38800000)
+    {
+        uint32_t m = (abs & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - (abs >> 23);
+        r = m >> shift;
+        rem = m & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        r = (abs - 0x38000000) >> 13;
+        rem = abs & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    if (rem > halfway || (rem == halfway && (r & 1)))
+        r++;
+
+    return (uint16_t)(sign | r);
+}
+
+/* makes rows [first_row, last_row) of a level from the level above by
+   averaging 2x2 samples as linear values, where the chunks have no more DWT
+   levels: HALF and FLOAT means are rounded to the nearest sample, UINT means
+   to the nearest integer */
+
+static void
+halve_level(
+    const std::vector<exr_pixel_type_t> &types,
+    const part_layout &in,
+    const uint8_t *in_buf,
+    const part_layout &out,
+    uint8_t *out_buf,
+    int first_row,
+    int last_row)
+{
+    for (int y = first_row; y < last_row; y++)
+    {
+        for (int x = 0; x < out.width; x++)
+        {
+            for (size_t c = 0; c < types.size(); c++)
+            {
+                double sum = 0;
+                uint64_t int_sum = 0;
+                int n = 0;
+                for (int in_y = 2 * y; in_y < std::min(2 * y + 2, in.height); in_y++)
+                {
+                    for (int in_x = 2 * x; in_x < std::min(2 * x + 2, in.width); in_x++, n++)
+                    {
+                        const uint8_t *p = in_buf + in_y * in.linestride + in_x * in.pixelstride + in.ch_offset[c];
+                        if (types[c] == EXR_PIXEL_HALF)
+                        {
+                            uint16_t h;
+                            memcpy(&h, p, sizeof(h));
+                            sum += half_to_float(h);
+                        }
+                        else if (types[c] == EXR_PIXEL_FLOAT)
+                        {
+                            float f;
+                            memcpy(&f, p, sizeof(f));
+                            sum += f;
+                        }
+                        else
+                        {
+                            uint32_t u;
+                            memcpy(&u, p, sizeof(u));
+                            int_sum += u;
+                        }
+                    }
+                }
+
+                uint8_t *q = out_buf + y * out.linestride + x * out.pixelstride + out.ch_offset[c];
+                if (types[c] == EXR_PIXEL_HALF)
+                {
+                    uint16_t h = float_to_half((float)(sum / n));
+                    memcpy(q, &h, sizeof(h));
+                }
+                else if (types[c] == EXR_PIXEL_FLOAT)
+                {
+                    float f = (float)(sum / n);
+                    memcpy(q, &f, sizeof(f));
+                }
+                else
+                {
+                    uint32_t u = (uint32_t)((int_sum + n / 2) / n);
+                    memcpy(q, &u, sizeof(u));
+                }
+            }
+        }
+    }
+}
+
+/* copies lines in the unpacked layout, each holding the samples of every
+   channel in turn, to rows of a baseband buffer */
+
+static void
+interleave_lines(
+    const uint8_t *unpacked,
+    const std::vector<exr_pixel_type_t> &types,
+    const part_layout &layout,
+    uint8_t *buffer,
+    int first_row,
+    int rows)
+{
+    const uint8_t *src = unpacked;
+    for (int y = first_row; y < first_row + rows; y++)
+    {
+        for (size_t c = 0; c < types.size(); c++)
+        {
+            int bpe = types[c] == EXR_PIXEL_HALF ? 2 : 4;
+            uint8_t *dst = buffer + y * layout.linestride + layout.ch_offset[c];
+            for (int x = 0; x < layout.width; x++, src += bpe, dst += layout.pixelstride)
+                memcpy(dst, src, bpe);
+        }
+    }
+}
+
+/* decodes the rows of levels [0, chunk_levels] covered by one source chunk:
+   level 0 in full, then, with `dwt`, each level from the DWT of the chunk as
+   far as its levels go, and the others from the level above */
+
+static void
+decode_mip_chunk(
+    exr_const_context_t f,
+    int part_id,
+    int chunk_index,
+    const std::vector<exr_pixel_type_t> &types,
+    const std::vector<part_layout> &levels,
+    std::vector<std::vector<uint8_t>> &bufs,
+    int chunk_levels,
+    bool dwt,
+    exrkdu_session_t session)
+{
+    const part_layout &layout = levels[0];
+    int y = layout.dw.min.y + chunk_index * layout.scansperchunk;
+
+    exr_chunk_info_t chunk;
+    check(exr_read_scanline_chunk_info(f, part_id, y, &chunk), "exr_read_scanline_chunk_info");
+
+    std::vector<uint8_t> data(chunk.packed_size);
+    {
+        trace_scope scope("read_chunk", "io", part_id, y);
+        check(exr_read_chunk(f, part_id, &chunk, data.data()), "exr_read_chunk");
+    }
+
+    exr_decode_pipeline_t decoder;
+    check(exr_decoding_initialize(f, part_id, &chunk, &decoder), "exr_decoding_initialize");
+
+    std::vector<uint8_t> unpacked(chunk.unpacked_size);
+    bool from_dwt = true;
+    exr_result_t rv = EXR_ERR_SUCCESS;
+
+    for (int level = 0; level <= chunk_levels && rv == EXR_ERR_SUCCESS; level++)
+    {
+        int first_row = chunk_index * levels[level].scansperchunk;
+        int rows = std::min(levels[level].scansperchunk, levels[level].height - first_row);
+
+        if (from_dwt)
+        {
+            trace_scope scope("decode_reduced", "decode", part_id, y);
+
+            int discarded;
+            rv = exrkdu_decode_reduced(
+                session, &decoder, data.data(), data.size(), level, unpacked.data(), unpacked.size(), &discarded);
+            if (rv == EXR_ERR_SUCCESS && discarded == level)
+            {
+                interleave_lines(unpacked.data(), types, levels[level], bufs[level].data(), first_row, rows);
+                from_dwt = dwt;
+                continue;
+            }
+            from_dwt = false;
+        }
+
+        if (rv == EXR_ERR_SUCCESS)
+        {
+            halve_level(
+                types, levels[level - 1], bufs[level - 1].data(), levels[level], bufs[level].data(), first_row,
+                first_row + rows);
+        }
+    }
+
+    exr_decoding_destroy(f, &decoder);
+
+    check(rv, "exrkdu_decode_reduced");
+}
+
+/* tiles of a MIPMAP part in chunk order, i.e. level by level in row order */
+
+struct mip_tile
+{
+    int level;
+    int x;
+    int y;
+};
+
+static std::vector<mip_tile>
+list_tiles(exr_const_context_t f, int part_id, int level_count)
+{
+    std::vector<mip_tile> tiles;
+    for (int level = 0; level < level_count; level++)
+    {
+        int32_t count_x, count_y;
+        check(exr_get_tile_counts(f, part_id, level, level, &count_x, &count_y), "exr_get_tile_counts");
+        for (int y = 0; y < count_y; y++)
+        {
+            for (int x = 0; x < count_x; x++)
+                tiles.push_back({level, x, y});
+        }
+    }
+
+    return tiles;
+}
+
+static uint8_t *
+tile_origin(
+    const std::vector<part_layout> &levels,
+    std::vector<std::vector<uint8_t>> &bufs,
+    const mip_tile &tile,
+    int tile_size)
+{
+    const part_layout &layout = levels[tile.level];
+    return bufs[tile.level].data() + (size_t)tile.y * tile_size * layout.linestride +
+           (size_t)tile.x * tile_size * layout.pixelstride;
+}
+
+static void
+encode_mip_tiles(
+    exr_context_t f,
+    int part_id,
+    const std::vector<part_layout> &levels,
+    std::vector<std::vector<uint8_t>> &bufs,
+    int tile_size,
+    exrkdu_session_t session,
+    chunk_scheduler &sched)
+{
+    std::vector<mip_tile> tiles = list_tiles(f, part_id, (int)levels.size());
+    int tile_count = (int)tiles.size();
+
+    sched.plan(tile_count, (size_t)levels[0].pixelstride * tile_size * tile_size);
+
+    ordered_writer writer(f, part_id, [&](int i, const std::vector<uint8_t> &data) {
+        const mip_tile &tile = tiles[i];
+
+        trace_scope scope("write_tile", "io", part_id, tile.y * tile_size);
+        check(
+            exr_write_tile_chunk(f, part_id, tile.x, tile.y, tile.level, tile.level, data.data(), data.size()),
+            "exr_write_tile_chunk");
+    });
+
+    sched.run(tile_count, [&](int i, int kdu_threads, memory_lease &lease) {
+        const mip_tile &tile = tiles[i];
+
+        exr_chunk_info_t chunk;
+        check(
+            exr_write_tile_chunk_info(f, part_id, tile.x, tile.y, tile.level, tile.level, &chunk),
+            "exr_write_tile_chunk_info");
+
+        uint8_t *tile_buf = tile_origin(levels, bufs, tile, tile_size);
+        writer.commit(
+            i, run_encoder(f, part_id, chunk, levels[tile.level], tile_buf, session, kdu_threads), std::move(lease));
+    });
+}
+
+/* decodes the tiles of `enc_fn` and compares them with the mip levels */
+
+static void
+verify_mip_levels(
+    exrkdu_session_t session,
+    const std::string &enc_fn,
+    const std::vector<part_layout> &bases,
+    const std::vector<std::vector<std::vector<uint8_t>>> &mip_bufs,
+    int tile_size,
+    const transcode_options &options,
+    chunk_scheduler &sched)
+{
+    exr_context_t dec_file = NULL;
+    check(exr_start_read(&dec_file, enc_fn.c_str(), NULL), "exr_start_read");
+    context_guard dec_guard(dec_file);
+
+    for (int part_id = 0; part_id < (int)bases.size(); part_id++)
+    {
+        std::vector<part_layout> levels = mip_layouts(dec_file, part_id, bases[part_id]);
+        if (levels.size() != mip_bufs[part_id].size())
+            throw transcode_error("Decoded image does not match the mip levels");
+
+        std::vector<std::vector<uint8_t>> dec_bufs;
+        for (const part_layout &layout : levels)
+            dec_bufs.emplace_back(layout.size());
+
+        std::vector<mip_tile> tiles = list_tiles(dec_file, part_id, (int)levels.size());
+        int tile_count = (int)tiles.size();
+
+        sched.plan(tile_count, (size_t)levels[0].pixelstride * tile_size * tile_size);
+
+        sched.run(tile_count, [&](int i, int kdu_threads, memory_lease &) {
+            const mip_tile &tile = tiles[i];
+
+            exr_chunk_info_t chunk;
+            check(
+                exr_read_tile_chunk_info(dec_file, part_id, tile.x, tile.y, tile.level, tile.level, &chunk),
+                "exr_read_tile_chunk_info");
+
+            run_decoder(
+                dec_file, part_id, chunk, levels[tile.level], tile_origin(levels, dec_bufs, tile, tile_size),
+                options.default_decoder ? NULL : session, kdu_threads, "verify");
+        });
+
+        trace_scope scope("compare", "verify", part_id);
+        if (dec_bufs != mip_bufs[part_id])
+            throw transcode_error("Decoded image does not match the mip levels");
+    }
+
+    dec_guard.finish("exr_finish");
+}
+
+transcode_stats
+make_mipmap(
+    exrkdu_session_t session,
+    const std::string &src_fn,
+    const std::string &enc_fn,
+    int tile_size,
+    bool from_dwt,
+    const transcode_options &options)
+{
+    transcode_stats stats = {0};
+
+    if (tile_size < 1)
+        throw transcode_error("Invalid tile size", EXR_ERR_INVALID_ARGUMENT);
+
+    if (options.io_threads > 0 && options.write_buffer == 0)
+        throw transcode_error("Concurrent writes require a write buffer", EXR_ERR_INVALID_ARGUMENT);
+
+    chunk_scheduler sched(
+        options.cores > 0 ? options.cores : available_cores(), options.kdu_threads, options.pool);
+
+    exr_context_t src_file = NULL;
+    check(exr_start_read(&src_file, src_fn.c_str(), NULL), "exr_start_read");
+    context_guard src_guard(src_file);
+
+    int part_count;
+    check(exr_get_count(src_file, &part_count), "exr_get_count");
+
+    /* the mip levels add a third to the source */
+    buffered_output output;
+    exr_context_t enc_file = NULL;
+    start_output(enc_fn, estimate_output_size(src_fn) / 3 * 4, options, output, enc_file);
+    context_guard enc_guard(enc_file);
+
+    /* levels are rounded up, as are the resolutions of JPEG 2000 */
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        exr_storage_t stortype;
+        check(exr_get_storage(src_file, part_id, &stortype), "exr_get_storage");
+        if (stortype != EXR_STORAGE_SCANLINE)
+            throw transcode_error("Only supports scanline files", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+
+        exr_compression_t compression;
+        check(exr_get_compression(src_file, part_id, &compression), "exr_get_compression");
+        if (compression != EXR_COMPRESSION_HTJ2K)
+        {
+            throw transcode_error(
+                "Mip levels are made from parts compressed with HTJ2K", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+        }
+
+        const exr_attr_chlist_t *channels;
+        check(exr_get_channels(src_file, part_id, &channels), "exr_get_channels");
+        for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+        {
+            if (channels->entries[ch_id].x_sampling != 1 || channels->entries[ch_id].y_sampling != 1)
+            {
+                throw transcode_error(
+                    "Mip levels of subsampled channels are not supported", EXR_ERR_FEATURE_NOT_IMPLEMENTED);
+            }
+        }
+
+        const char *pn = NULL;
+        exr_get_name(src_file, part_id, &pn);
+
+        int new_part_id = 0;
+        check(exr_add_part(enc_file, pn, EXR_STORAGE_TILED, &new_part_id), "exr_add_part");
+
+        if (new_part_id != part_id)
+            throw transcode_error("Part index mismatch");
+
+        check(
+            exr_set_tile_descriptor(
+                enc_file, part_id, tile_size, tile_size, EXR_TILE_MIPMAP_LEVELS, EXR_TILE_ROUND_UP),
+            "exr_set_tile_descriptor");
+
+        /* the chunk digests of the source are those of its scanline chunks */
+        check(exr_attr_set_string(enc_file, part_id, CHUNK_DIGESTS_ATTR, ""), "exr_attr_set_string");
+
+        check(exr_copy_unset_attributes(enc_file, part_id, src_file, part_id), "exr_copy_unset_attributes");
+        check(exr_set_compression(enc_file, part_id, EXR_COMPRESSION_HTJ2K), "exr_set_compression");
+        if (options.random_order)
+            check(exr_set_lineorder(enc_file, part_id, EXR_LINEORDER_RANDOM_Y), "exr_set_lineorder");
+    }
+
+    check(exr_write_header(enc_file), "exr_write_header");
+
+    std::vector<part_layout> bases;
+    std::vector<std::vector<part_layout>> part_levels;
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        bases.push_back(get_layout(src_file, part_id));
+        part_levels.push_back(mip_layouts(enc_file, part_id, bases.back()));
+    }
+
+    /* the levels of all parts, about 4/3 of the frame, are kept for the
+       verification, as transcode() keeps the baseband of the source; the
+       verification decodes the levels of one part at a time */
+    uint64_t levels_bytes = 0;
+    uint64_t max_part_levels_bytes = 0;
+    size_t max_chunk_bytes = 0;
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        uint64_t part_bytes = 0;
+        for (const part_layout &level : part_levels[part_id])
+            part_bytes += level.size();
+        levels_bytes += part_bytes;
+        max_part_levels_bytes = std::max(max_part_levels_bytes, part_bytes);
+        max_chunk_bytes = std::max(max_chunk_bytes, bases[part_id].chunk_bytes());
+    }
+    if (options.verify)
+        levels_bytes += max_part_levels_bytes;
+
+    job_memory memory(options.budget, levels_bytes, max_chunk_bytes, sched);
+
+    std::vector<std::vector<std::vector<uint8_t>>> mip_bufs(part_count);
+
+    for (int part_id = 0; part_id < part_count; part_id++)
+    {
+        const part_layout &layout = bases[part_id];
+        const std::vector<part_layout> &levels = part_levels[part_id];
+        std::vector<std::vector<uint8_t>> &bufs = mip_bufs[part_id];
+        for (const part_layout &level : levels)
+        {
+            bufs.emplace_back(level.size());
+            stats.baseband_bytes += level.size();
+        }
+
+        const exr_attr_chlist_t *channels;
+        check(exr_get_channels(src_file, part_id, &channels), "exr_get_channels");
+        std::vector<exr_pixel_type_t> types;
+        bool all_uint = true;
+        for (int ch_id = 0; ch_id < channels->num_channels; ++ch_id)
+        {
+            types.push_back(channels->entries[ch_id].pixel_type);
+            all_uint = all_uint && channels->entries[ch_id].pixel_type == EXR_PIXEL_UINT;
+        }
+
+        /* the DWT of HALF and FLOAT samples filters their bit patterns, which
+           behave like a logarithm of their values, so that its levels would be
+           darker than the linear averages below them */
+        bool dwt = from_dwt || all_uint;
+
+        /* the levels that halve the chunks exactly are made chunk by chunk */
+        int chunk_levels = 0;
+        while (chunk_levels + 1 < (int)levels.size() && layout.scansperchunk % (2 << chunk_levels) == 0)
+            chunk_levels++;
+
+        sched.plan(layout.chunk_count, layout.chunk_bytes());
+
+        sched.run(layout.chunk_count, [&](int i, int, memory_lease &) {
+            decode_mip_chunk(src_file, part_id, i, types, levels, bufs, chunk_levels, dwt, session);
+        });
+
+        for (int level = chunk_levels + 1; level < (int)levels.size(); level++)
+        {
+            trace_scope scope("halve_level", "decode", part_id);
+            halve_level(
+                types, levels[level - 1], bufs[level - 1].data(), levels[level], bufs[level].data(), 0,
+                levels[level].height);
+        }
+
+        encode_mip_tiles(enc_file, part_id, levels, bufs, tile_size, session, sched);
+    }
+
+    src_guard.finish("exr_finish");
+    finish_output(enc_guard, output, options, stats);
+
+    if (options.verify)
+        verify_mip_levels(session, enc_fn, bases, mip_bufs, tile_size, options, sched);
+
+    return stats;
+}
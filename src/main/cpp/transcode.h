@@ -0,0 +1,185 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <openexr.h>
+
+#include "kdu.h"
+#include "scheduler.h"
+
+/* default --write-buffer of the tools, in MiB: buffered output is only
+   supported on UNIX, so the writes are left to OpenEXR elsewhere */
+#ifdef _WIN32
+#define DEFAULT_WRITE_BUFFER_MIB "0"
+#else
+#define DEFAULT_WRITE_BUFFER_MIB "8"
+#endif
+
+struct transcode_options
+{
+    /* cores shared by the chunks in flight and their KDU threads; 0 uses
+       available_cores() */
+    int cores;
+
+    /* KDU threads per chunk; 0 lets the scheduler decide */
+    int kdu_threads;
+
+    /* decode the output and compare it with the source */
+    bool verify;
+
+    /* verify with the default HTJ2K decoder instead of KDU */
+    bool default_decoder;
+
+    /* coalesce the writes of the output in buffers of this size; 0 leaves the
+       writes to OpenEXR, i.e. two per chunk. Not supported on Windows. */
+    size_t write_buffer;
+
+    /* preallocate the buffered output to an estimate of its size */
+    bool preallocate;
+
+    /* write the buffered output with O_DIRECT */
+    bool direct_io;
+
+    /* code all chunks of each part to memory before writing them, then write
+       the buffers of the output with this many threads concurrently; 0 writes
+       the chunks as they are coded. Requires write_buffer. */
+    int io_threads;
+
+    /* copy the chunks of source parts already compressed with HTJ2K unchanged,
+       instead of decoding and encoding them; such parts are not verified and
+       record no chunk digests, even if they are transcoded because their
+       chunks do not match those of the output */
+    bool passthrough;
+
+    /* check the chunk header and the codestream SIZ/COD of copied chunks */
+    bool validate;
+
+    /* write the output with the RANDOM_Y line order, so that chunks are
+       written as soon as they are coded instead of in order */
+    bool random_order;
+
+    /* output of a previous transcode, e.g. of an earlier render of the frame,
+       whose compressed chunks are reused for chunks with the same baseband
+       samples; empty for none */
+    std::string previous;
+
+    /* directory of compressed chunks reused across runs, keyed by the digest
+       of their baseband samples; empty for none */
+    std::string cache_dir;
+
+    /* warm threads for the chunks, e.g. those of a daemon job slot; NULL
+       creates threads for each part. A pool is used by one call at a time. */
+    worker_pool *pool;
+
+    /* memory shared with other jobs, from which the job holds its baseband
+       buffers and the working buffers of its chunks; NULL for no limit */
+    memory_budget *budget;
+};
+
+struct transcode_stats
+{
+    uint64_t baseband_bytes;
+
+    /* chunk bytes copied by passthrough */
+    uint64_t copied_bytes;
+
+    /* chunks reused from the previous output and from the cache, instead of
+       being encoded */
+    uint64_t reused_chunks;
+    uint64_t cached_chunks;
+
+    /* write system calls of the buffered output */
+    uint64_t write_calls;
+};
+
+class transcode_error : public std::runtime_error
+{
+public:
+    transcode_error(const std::string &what, exr_result_t code = EXR_ERR_UNKNOWN)
+        : std::runtime_error(what), code(code)
+    {
+    }
+
+    exr_result_t code;
+};
+
+/* transcodes all parts of `src_fn` to HTJ2K with the KDU encoder of `session`;
+   throws transcode_error */
+transcode_stats
+transcode(
+    exrkdu_session_t session, const std::string &src_fn, const std::string &enc_fn, const transcode_options &options);
+
+/* writes to `enc_fn` a proxy of `src_fn`, smaller by 2^levels in each
+   dimension, by dropping the highest `levels` DWT levels of its chunks in the
+   compressed domain instead of decoding them, as in kdu_transcode -reduce. The
+   parts of `src_fn` must be compressed with HTJ2K, e.g. by transcode(), and
+   their chunks must hold a multiple of 2^levels scanlines. Only the options of
+   the scheduler and of the output apply; throws transcode_error */
+transcode_stats
+make_proxy(
+    exrkdu_session_t session,
+    const std::string &src_fn,
+    const std::string &enc_fn,
+    int levels,
+    const transcode_options &options);
+
+/* writes to `enc_fn` the parts of `src_fn` as tiled parts with MIPMAP levels,
+   rounded up, with square tiles of `tile_size` compressed with HTJ2K. Each
+   level averages 2x2 samples of the level above as linear values. The levels
+   of parts whose channels are all UINT, or of all parts if `from_dwt` is set,
+   are instead decoded from the DWT of the chunks of `src_fn`, each at its
+   resolution, down to the levels the chunks hold, which skips the synthesis of
+   the finer levels; for HALF and FLOAT channels, the DWT filters the bit
+   patterns of the samples rather than their values. The parts of `src_fn` must
+   be compressed with HTJ2K. With `options.verify`, the tiles are decoded and
+   compared with the levels; the passthrough, reuse and two-phase options do
+   not apply. Throws transcode_error */
+transcode_stats
+make_mipmap(
+    exrkdu_session_t session,
+    const std::string &src_fn,
+    const std::string &enc_fn,
+    int tile_size,
+    bool from_dwt,
+    const transcode_options &options);
+
+/* decodes `src_fn` and `enc_fn`, the latter with `session` unless
+   `options.default_decoder` is set, and throws transcode_error if their
+   samples differ */
+void
+verify(exrkdu_session_t session, const std::string &src_fn, const std::string &enc_fn, const transcode_options &options);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "work_queue.h"
+
+std::string
+work_unit::name() const
+{
+    return std::to_string(this->first) + "-" + std::to_string(this->last);
+}
+
+std::vector<work_unit>
+split_frames(int first, int last, int size)
+{
+    std::vector<work_unit> units;
+    size = std::max(size, 1);
+
+    for (int f = first; f <= last; f += size)
+        units.push_back({f, std::min(f + size - 1, last)});
+
+    return units;
+}
+
+/* lease */
+
+work_lease::work_lease(const work_queue &queue, const work_unit &unit, dev_t dev, ino_t ino)
+    : queue(queue), claimed(unit), dev(dev), ino(ino), lost(false), stopped(false)
+{
+    this->renewer = std::thread(&work_lease::renew, this);
+}
+
+work_lease::~work_lease()
+{
+    this->stop();
+
+    /* an uncompleted unit is released to the other workers */
+    if (this->owned())
+        unlink(this->queue.path(this->claimed, ".lease").c_str());
+}
+
+/* the lease file is still the one this worker created, possibly moved aside
+   by a worker taking over an expired lease, which puts back a lease that was
+   renewed or claimed meanwhile */
+
+bool
+work_lease::owned() const
+{
+    struct stat st;
+    if (stat(this->queue.path(this->claimed, ".lease").c_str(), &st) == 0 && st.st_dev == this->dev &&
+        st.st_ino == this->ino)
+        return true;
+
+    DIR *d = opendir(this->queue.dir.c_str());
+    if (d == NULL)
+        return false;
+
+    std::string prefix = this->claimed.name() + ".lease.";
+    std::string suffix = ".stale";
+    bool found = false;
+    while (struct dirent *entry = readdir(d))
+    {
+        std::string name = entry->d_name;
+        if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+            continue;
+
+        std::string moved_path = this->queue.dir + "/" + name;
+        if (stat(moved_path.c_str(), &st) == 0 && st.st_dev == this->dev && st.st_ino == this->ino)
+        {
+            found = true;
+            break;
+        }
+    }
+    closedir(d);
+
+    return found;
+}
+
+/* touches the lease three times per lease period */
+
+void
+work_lease::renew()
+{
+    std::string lease_path = this->queue.path(this->claimed, ".lease");
+    auto period = std::chrono::milliseconds(std::max(1, this->queue.lease_seconds) * 1000 / 3);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (!this->stopping.wait_for(lock, period, [this] { return this->stopped; }))
+    {
+        if (!this->owned())
+        {
+            this->lost = true;
+            return;
+        }
+
+        utimensat(AT_FDCWD, lease_path.c_str(), NULL, 0);
+    }
+}
+
+bool
+work_lease::confirm()
+{
+    if (!this->lost && this->owned())
+        utimensat(AT_FDCWD, this->queue.path(this->claimed, ".lease").c_str(), NULL, 0);
+    else
+        this->lost = true;
+
+    return !this->lost;
+}
+
+void
+work_lease::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->stopped)
+            return;
+        this->stopped = true;
+    }
+    this->stopping.notify_all();
+    this->renewer.join();
+}
+
+void
+work_lease::complete(bool ok, const std::string &message)
+{
+    this->stop();
+
+    if (!this->owned())
+    {
+        this->lost = true;
+        return;
+    }
+
+    /* the marker is written before the lease is removed, so that the unit is
+       never seen unclaimed and not done */
+    this->queue.write_marker(this->claimed, ok ? ".done" : ".failed", message);
+    unlink(this->queue.path(this->claimed, ".lease").c_str());
+}
+
+/* queue */
+
+work_queue::work_queue(const std::string &dir, const std::string &worker_id, int lease_seconds)
+    : dir(dir), worker_id(worker_id), lease_seconds(std::max(lease_seconds, 1))
+{
+    if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        throw std::runtime_error(dir + ": " + strerror(errno));
+}
+
+std::string
+work_queue::path(const work_unit &unit, const char *suffix) const
+{
+    return this->dir + "/" + unit.name() + suffix;
+}
+
+bool
+work_queue::exists(const work_unit &unit, const char *suffix) const
+{
+    struct stat st;
+    return stat(this->path(unit, suffix).c_str(), &st) == 0;
+}
+
+bool
+work_queue::is_finished(const work_unit &unit) const
+{
+    return this->exists(unit, ".done") || this->exists(unit, ".failed");
+}
+
+bool
+work_queue::write_marker(const work_unit &unit, const char *suffix, const std::string &text) const
+{
+    std::string marker_path = this->path(unit, suffix);
+    std::string tmp_path = marker_path + "." + this->worker_id + ".tmp";
+
+    bool ok;
+    {
+        std::ofstream f(tmp_path, std::ios::trunc);
+        f << this->worker_id << "\n" << text << "\n";
+        ok = (bool)f;
+    }
+
+    if (!ok || rename(tmp_path.c_str(), marker_path.c_str()) != 0)
+    {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/* the clocks of the nodes may differ: lease ages are measured against the
+   modification time the file server gives to a file of this worker */
+
+double
+work_queue::server_time() const
+{
+    std::string clock_path = this->dir + "/" + this->worker_id + ".clock";
+
+    int fd = open(clock_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw std::runtime_error(clock_path + ": " + strerror(errno));
+
+    struct stat st;
+    bool ok = futimens(fd, NULL) == 0 && fstat(fd, &st) == 0;
+    int error = errno;
+    close(fd);
+
+    if (!ok)
+        throw std::runtime_error(clock_path + ": " + strerror(error));
+
+    return st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9;
+}
+
+std::unique_ptr<work_lease>
+work_queue::try_claim(const work_unit &unit)
+{
+    std::string lease_path = this->path(unit, ".lease");
+
+    struct stat st;
+    if (stat(lease_path.c_str(), &st) == 0)
+    {
+        if (this->server_time() - (st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9) <= this->lease_seconds)
+            return NULL;
+
+        /* the lease expired: of the workers taking it over, the one that moves
+           it aside wins, unless it moved a lease claimed or renewed meanwhile,
+           which it then puts back; its holder still finds it while it is
+           aside */
+        std::string stale_path = lease_path + "." + this->worker_id + ".stale";
+        if (rename(lease_path.c_str(), stale_path.c_str()) != 0)
+            return NULL;
+
+        struct stat moved;
+        bool same = stat(stale_path.c_str(), &moved) == 0 && moved.st_dev == st.st_dev && moved.st_ino == st.st_ino &&
+                    moved.st_mtim.tv_sec == st.st_mtim.tv_sec && moved.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+        if (!same)
+            link(stale_path.c_str(), lease_path.c_str());
+        unlink(stale_path.c_str());
+
+        if (!same)
+            return NULL;
+    }
+
+    /* link() fails if the lease exists; the link count is checked as well,
+       since a retried link() over NFS may report a failure that succeeded */
+    std::string tmp_path = lease_path + "." + this->worker_id + ".tmp";
+    {
+        std::ofstream f(tmp_path, std::ios::trunc);
+        f << this->worker_id << "\n";
+        if (!f)
+            throw std::runtime_error(tmp_path + ": cannot write the lease");
+    }
+
+    link(tmp_path.c_str(), lease_path.c_str());
+
+    struct stat claimed;
+    bool ok = stat(tmp_path.c_str(), &claimed) == 0 && claimed.st_nlink == 2;
+    unlink(tmp_path.c_str());
+
+    if (!ok)
+        return NULL;
+
+    /* the unit may have been completed between the check and the claim */
+    if (this->is_finished(unit))
+    {
+        unlink(lease_path.c_str());
+        return NULL;
+    }
+
+    return std::unique_ptr<work_lease>(new work_lease(*this, unit, claimed.st_dev, claimed.st_ino));
+}
+
+std::unique_ptr<work_lease>
+work_queue::claim(const std::vector<work_unit> &units)
+{
+    auto poll = std::chrono::milliseconds(std::min(this->lease_seconds * 1000 / 4, 5000));
+
+    while (true)
+    {
+        bool pending = false;
+
+        for (const work_unit &unit : units)
+        {
+            if (this->is_finished(unit))
+                continue;
+
+            pending = true;
+
+            std::unique_ptr<work_lease> lease = this->try_claim(unit);
+            if (lease)
+                return lease;
+        }
+
+        if (!pending)
+            return NULL;
+
+        /* the remaining units are leased: wait for them to complete or expire */
+        std::this_thread::sleep_for(poll);
+    }
+}
+
+int
+work_queue::failed(const std::vector<work_unit> &units, std::vector<std::string> &messages) const
+{
+    int count = 0;
+
+    for (const work_unit &unit : units)
+    {
+        std::ifstream f(this->path(unit, ".failed"));
+        if (!f)
+            continue;
+
+        /* the worker, then the message */
+        std::string worker, message;
+        std::getline(f, worker);
+        std::getline(f, message);
+        messages.push_back(unit.name() + " (" + worker + "): " + message);
+        count++;
+    }
+
+    return count;
+}
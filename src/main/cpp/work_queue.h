@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+/* range of frames, first to last inclusive, claimed as a whole */
+
+struct work_unit
+{
+    int first;
+    int last;
+
+    /* e.g. 1001-1010 */
+    std::string name() const;
+};
+
+/* splits the frames `first` to `last` in units of `size` frames */
+std::vector<work_unit>
+split_frames(int first, int last, int size);
+
+class work_queue;
+
+/* lease of a unit, renewed by a thread of its own until completed or
+   destroyed; destroying an uncompleted lease releases the unit to the other
+   workers */
+class work_lease
+{
+public:
+    ~work_lease();
+
+    work_lease(const work_lease &) = delete;
+    work_lease &operator=(const work_lease &) = delete;
+
+    const work_unit &unit() const { return this->claimed; }
+
+    /* true once another worker took the lease over, e.g. after this process
+       stalled for longer than the lease; results must then be discarded */
+    bool is_lost() const { return this->lost; }
+
+    /* renews the lease now, e.g. before committing results, and returns false
+       if it was lost; the renewing thread may only notice a takeover later */
+    bool confirm();
+
+    /* marks the unit done, or failed with `message`, and releases the lease;
+       does nothing if the lease was lost */
+    void complete(bool ok, const std::string &message);
+
+private:
+    friend class work_queue;
+
+    work_lease(const work_queue &queue, const work_unit &unit, dev_t dev, ino_t ino);
+
+    bool owned() const;
+    void renew();
+    void stop();
+
+    const work_queue &queue;
+    work_unit claimed;
+    dev_t dev;
+    ino_t ino;
+    std::atomic<bool> lost;
+    std::mutex mutex;
+    std::condition_variable stopping;
+    bool stopped;
+    std::thread renewer;
+};
+
+/* Frame ranges shared by batch workers, on one node or many, through a
+   directory of a shared filesystem, with no queue service. For each unit, the
+   directory holds <unit>.lease while a worker processes it, then <unit>.done
+   or <unit>.failed. Leases are created with link(), which is atomic on NFS,
+   and renewed by touching them; a lease not renewed for `lease_seconds`, by
+   the clock of the file server, is taken over. */
+class work_queue
+{
+public:
+    /* creates `dir` if it does not exist */
+    work_queue(const std::string &dir, const std::string &worker_id, int lease_seconds);
+
+    /* claims the first of `units` neither done, failed nor leased by a live
+       worker, waiting for the leases of the other workers while some units are
+       not done; NULL once all units are done or failed */
+    std::unique_ptr<work_lease> claim(const std::vector<work_unit> &units);
+
+    /* number of `units` that failed, with their messages */
+    int failed(const std::vector<work_unit> &units, std::vector<std::string> &messages) const;
+
+    const std::string &worker() const { return this->worker_id; }
+
+private:
+    friend class work_lease;
+
+    std::string path(const work_unit &unit, const char *suffix) const;
+    bool exists(const work_unit &unit, const char *suffix) const;
+    bool is_finished(const work_unit &unit) const;
+    bool write_marker(const work_unit &unit, const char *suffix, const std::string &text) const;
+
+    /* current time of the file server, in seconds */
+    double server_time() const;
+
+    std::unique_ptr<work_lease> try_claim(const work_unit &unit);
+
+    std::string dir;
+    std::string worker_id;
+    int lease_seconds;
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scheduler.h"
+
+static int failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                                                     \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        long long a = (long long)(actual);                                                                             \
+        long long e = (long long)(expected);                                                                           \
+        if (a != e)                                                                                                    \
+        {                                                                                                              \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a, e);                  \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+#define MIB ((size_t)1 << 20)
+
+/* KDU threads of each chunk when all the chunks of a part start together */
+static std::vector<int>
+start_all(const chunk_scheduler &sched, int chunk_count)
+{
+    std::vector<int> threads;
+    int held = 0;
+    for (int i = 0; i < chunk_count; i++)
+    {
+        int t = sched.kdu_threads(chunk_count - i, i, held);
+        threads.push_back(t);
+        held += std::max(1, t);
+    }
+    return threads;
+}
+
+static void
+test_4k_frame()
+{
+    /* 9 chunks of 256 lines of 4096 RGBA half pixels */
+    chunk_scheduler sched(64);
+    sched.plan(9, 8 * MIB);
+    CHECK_EQ(sched.in_flight(), 9);
+
+    std::vector<int> threads = start_all(sched, 9);
+    for (int i = 0; i < 8; i++)
+        CHECK_EQ(threads[i], 7);
+
+    /* the last chunk gets the cores the others left, not all of them */
+    CHECK_EQ(threads[8], 8);
+    CHECK_EQ(sched.kdu_threads(1, 8, 56), 8);
+
+    /* the last chunk of the part, once the others are done */
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 8);
+}
+
+static void
+test_large_chunks()
+{
+    /* 9 chunks that could each keep all 64 cores busy */
+    chunk_scheduler sched(64);
+    sched.plan(9, 64 * MIB);
+    CHECK_EQ(sched.in_flight(), 9);
+
+    std::vector<int> threads = start_all(sched, 9);
+    for (int i = 0; i < 8; i++)
+        CHECK_EQ(threads[i], 7);
+    CHECK_EQ(threads[8], 8);
+
+    /* as chunks end, the next ones get the cores they give back */
+    CHECK_EQ(sched.kdu_threads(1, 8, 49), 15);
+    CHECK_EQ(sched.kdu_threads(1, 1, 7), 57);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 64);
+}
+
+static void
+test_many_chunks()
+{
+    chunk_scheduler sched(64);
+    sched.plan(100, 8 * MIB);
+    CHECK_EQ(sched.in_flight(), 64);
+    CHECK_EQ(sched.kdu_threads(100, 0, 0), 0);
+
+    /* a chunk starting as another ends, with 63 cores held */
+    CHECK_EQ(sched.kdu_threads(37, 63, 63), 0);
+    CHECK_EQ(sched.kdu_threads(1, 63, 63), 0);
+
+    /* the tail of the part, with 3 chunks still running */
+    CHECK_EQ(sched.kdu_threads(1, 3, 3), 8);
+    CHECK_EQ(sched.kdu_threads(2, 3, 3), 8);
+    CHECK_EQ(sched.kdu_threads(2, 3, 50), 7);
+}
+
+static void
+test_small_chunks()
+{
+    /* chunks too small to keep a KDU thread busy */
+    chunk_scheduler sched(16);
+    sched.plan(4, MIB / 2);
+    CHECK_EQ(sched.in_flight(), 4);
+    CHECK_EQ(sched.kdu_threads(4, 0, 0), 0);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 0);
+
+    /* a single chunk is limited by its size, not by the cores */
+    sched.plan(1, 3 * MIB);
+    CHECK_EQ(sched.in_flight(), 1);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 3);
+
+    sched.plan(1, 64 * MIB);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 16);
+}
+
+static void
+test_few_cores()
+{
+    chunk_scheduler sched(4);
+    sched.plan(9, 8 * MIB);
+    CHECK_EQ(sched.in_flight(), 4);
+    CHECK_EQ(sched.kdu_threads(9, 0, 0), 0);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 4);
+    CHECK_EQ(sched.kdu_threads(2, 1, 1), 0);
+
+    /* cores held beyond the count, e.g. by forced threads, leave none free */
+    CHECK_EQ(sched.kdu_threads(1, 3, 6), 0);
+
+    /* no cores at all still schedules one chunk at a time */
+    chunk_scheduler none(0);
+    none.plan(9, 8 * MIB);
+    CHECK_EQ(none.cores(), 1);
+    CHECK_EQ(none.in_flight(), 1);
+    CHECK_EQ(none.kdu_threads(9, 0, 0), 0);
+}
+
+static void
+test_forced_threads()
+{
+    chunk_scheduler sched(16, 4);
+    sched.plan(9, MIB / 2);
+    CHECK_EQ(sched.in_flight(), 4);
+    CHECK_EQ(sched.kdu_threads(9, 0, 0), 4);
+    CHECK_EQ(sched.kdu_threads(1, 3, 12), 4);
+
+    sched.plan(2, MIB / 2);
+    CHECK_EQ(sched.in_flight(), 2);
+
+    /* more threads than cores still codes one chunk */
+    chunk_scheduler wide(16, 32);
+    wide.plan(9, 8 * MIB);
+    CHECK_EQ(wide.in_flight(), 1);
+    CHECK_EQ(wide.kdu_threads(9, 0, 0), 32);
+}
+
+static void
+test_empty_part()
+{
+    chunk_scheduler sched(8);
+    sched.plan(0, 0);
+    CHECK_EQ(sched.in_flight(), 1);
+    CHECK_EQ(sched.kdu_threads(1, 0, 0), 0);
+}
+
+/* the chunks run() codes at once never hold more cores than there are */
+static void
+test_run_holds_cores()
+{
+    for (int cores : {4, 16, 64})
+    {
+        for (int chunk_count : {1, 9, 100})
+        {
+            chunk_scheduler sched(cores);
+            sched.plan(chunk_count, 8 * MIB);
+
+            std::mutex mutex;
+            int held = 0;
+            int max_held = 0;
+            std::atomic<int> started(0);
+
+            sched.run(chunk_count, [&](int, int kdu_threads, memory_lease &) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    held += std::max(1, kdu_threads);
+                    max_held = std::max(max_held, held);
+                }
+                started++;
+                std::this_thread::yield();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    held -= std::max(1, kdu_threads);
+                }
+            });
+
+            CHECK_EQ(started, chunk_count);
+            CHECK_EQ(held, 0);
+            CHECK_EQ(max_held <= cores, 1);
+        }
+    }
+}
+
+int
+main()
+{
+    test_4k_frame();
+    test_large_chunks();
+    test_many_chunks();
+    test_small_chunks();
+    test_few_cores();
+    test_forced_threads();
+    test_empty_part();
+    test_run_holds_cores();
+
+    if (failures)
+        fprintf(stderr, "%d failure(s)\n", failures);
+
+    return failures ? 1 : 0;
+}
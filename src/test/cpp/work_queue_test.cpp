@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2024, Sandflow Consulting LLC
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "work_queue.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(cond))                                                                                                   \
+        {                                                                                                              \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);                                         \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+#define LEASE_SECONDS 1
+
+static bool
+file_exists(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static void
+append_line(const std::string &path, const std::string &line)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    std::string text = line + "\n";
+    if (fd >= 0)
+    {
+        if (write(fd, text.data(), text.size()) < 0)
+            perror(path.c_str());
+        close(fd);
+    }
+}
+
+/* a worker process: claims units until none is left, processes each for
+   `work_ms` and records the units it completed in `log_path`; the claims are
+   reported on `claim_fd`, if not negative */
+static void
+run_worker(
+    const std::string &dir,
+    const std::string &worker_id,
+    const std::vector<work_unit> &units,
+    int work_ms,
+    const std::string &log_path,
+    int claim_fd)
+{
+    work_queue queue(dir, worker_id, LEASE_SECONDS);
+
+    while (std::unique_ptr<work_lease> lease = queue.claim(units))
+    {
+        if (claim_fd >= 0)
+        {
+            std::string name = lease->unit().name() + "\n";
+            if (write(claim_fd, name.data(), name.size()) < 0)
+                _exit(2);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(work_ms));
+
+        if (!lease->confirm())
+            continue;
+
+        lease->complete(true, "");
+        if (!lease->is_lost())
+            append_line(log_path, lease->unit().name() + " " + worker_id);
+    }
+
+    _exit(0);
+}
+
+static std::string
+make_queue_dir()
+{
+    char dir[] = "/tmp/exrkdu_work_queue_XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return dir;
+}
+
+static void
+remove_queue_dir(const std::string &dir)
+{
+    std::string cmd = "rm -rf '" + dir + "'";
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "cannot remove %s\n", dir.c_str());
+}
+
+/* several workers share the units of a queue while one is stopped for longer
+   than its lease and another is killed: every unit ends up done, and completed
+   by a single worker */
+static void
+test_takeover()
+{
+    std::string dir = make_queue_dir();
+    std::string log_path = dir + "/completed.log";
+    std::vector<work_unit> units = split_frames(1001, 1024, 2);
+
+    int stopped_pipe[2], killed_pipe[2];
+    if (pipe(stopped_pipe) != 0 || pipe(killed_pipe) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    std::vector<pid_t> workers;
+    for (int w = 0; w < 4; w++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int claim_fd = w == 0 ? stopped_pipe[1] : (w == 1 ? killed_pipe[1] : -1);
+            run_worker(dir, "worker" + std::to_string(w), units, 300, log_path, claim_fd);
+        }
+        workers.push_back(pid);
+    }
+
+    /* each victim is caught while processing its first unit */
+    char c;
+    CHECK(read(stopped_pipe[0], &c, 1) == 1);
+    kill(workers[0], SIGSTOP);
+    CHECK(read(killed_pipe[0], &c, 1) == 1);
+    kill(workers[1], SIGKILL);
+
+    std::this_thread::sleep_for(std::chrono::seconds(3 * LEASE_SECONDS));
+    kill(workers[0], SIGCONT);
+
+    for (pid_t pid : workers)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+        if (pid != workers[1])
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    std::map<std::string, int> completions;
+    std::ifstream log(log_path);
+    std::string name, worker;
+    while (log >> name >> worker)
+        completions[name]++;
+
+    for (const work_unit &unit : units)
+    {
+        CHECK(file_exists(dir + "/" + unit.name() + ".done"));
+        CHECK(!file_exists(dir + "/" + unit.name() + ".lease"));
+        CHECK(completions[unit.name()] == 1);
+        if (completions[unit.name()] != 1)
+            fprintf(stderr, "%s completed %d times\n", unit.name().c_str(), completions[unit.name()]);
+    }
+
+    remove_queue_dir(dir);
+}
+
+/* a lease moved aside by a worker taking it over, then put back, is not lost;
+   one that is taken over is */
+static void
+test_lease_moved_aside()
+{
+    std::string dir = make_queue_dir();
+    std::vector<work_unit> units = split_frames(1, 1, 1);
+
+    work_queue queue(dir, "holder", LEASE_SECONDS);
+    std::unique_ptr<work_lease> lease = queue.claim(units);
+    CHECK(lease != nullptr);
+
+    std::string lease_path = dir + "/1-1.lease";
+    std::string stale_path = lease_path + ".taker.stale";
+
+    CHECK(rename(lease_path.c_str(), stale_path.c_str()) == 0);
+    CHECK(lease->confirm());
+    CHECK(link(stale_path.c_str(), lease_path.c_str()) == 0);
+    CHECK(unlink(stale_path.c_str()) == 0);
+    CHECK(lease->confirm());
+
+    CHECK(rename(lease_path.c_str(), stale_path.c_str()) == 0);
+    CHECK(unlink(stale_path.c_str()) == 0);
+    CHECK(!lease->confirm());
+
+    lease->complete(true, "");
+    CHECK(lease->is_lost());
+    CHECK(!file_exists(dir + "/1-1.done"));
+
+    remove_queue_dir(dir);
+}
+
+static void
+test_split_frames()
+{
+    std::vector<work_unit> units = split_frames(1001, 1010, 4);
+    CHECK(units.size() == 3);
+    CHECK(units[0].name() == "1001-1004");
+    CHECK(units[2].name() == "1009-1010");
+
+    CHECK(split_frames(5, 5, 0).size() == 1);
+    CHECK(split_frames(6, 5, 2).empty());
+}
+
+int
+main()
+{
+    test_split_frames();
+    test_lease_moved_aside();
+    test_takeover();
+
+    if (failures)
+        fprintf(stderr, "%d failure(s)\n", failures);
+
+    return failures ? 1 : 0;
+}